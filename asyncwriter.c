@@ -0,0 +1,302 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "asyncwriter.h"
+
+#include <errno.h>
+
+// time the engine thread waits for requests or completions before checking for cancellation
+#define ENGINE_WAIT_MS 100
+
+
+cAsyncWriter::cAsyncWriter(int maxInFlight) : cThread("permashift writer"),
+ m_requestCount(max(maxInFlight, 1)),
+ m_pending(0),
+ m_useRing(false)
+{
+	m_requests = MALLOC(tWriteRequest, m_requestCount);
+	m_aioList = MALLOC(const struct aiocb*, m_requestCount);
+	memset(m_requests, 0, m_requestCount * sizeof(tWriteRequest));
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		m_requests[request].state = rsFree;
+	}
+
+#ifdef PERMASHIFT_IO_URING
+	int result = io_uring_queue_init(m_requestCount, &m_ring, 0);
+	if (result == 0)
+	{
+		m_useRing = true;
+	}
+	else
+	{
+		esyslog("permashift: io_uring not available (%d), using POSIX AIO", -result);
+	}
+#endif
+
+	dsyslog("permashift: asynchronous writer using %s, %d writes in flight\n", Backend(), m_requestCount);
+	Start();
+}
+
+cAsyncWriter::~cAsyncWriter()
+{
+	m_mutex.Lock();
+	m_requestQueued.Broadcast();
+	m_mutex.Unlock();
+	Cancel(3);
+
+	// the kernel still uses the data of writes in flight, so wait for them
+	while (Count(rsSubmitted) > 0)
+	{
+		Complete(ENGINE_WAIT_MS);
+	}
+
+#ifdef PERMASHIFT_IO_URING
+	if (m_useRing)
+	{
+		io_uring_queue_exit(&m_ring);
+	}
+#endif
+
+	free(m_aioList);
+	free(m_requests);
+}
+
+int cAsyncWriter::Count(eRequestState state)
+{
+	int count = 0;
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		if (m_requests[request].state == state)
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+int cAsyncWriter::Write(int file, const uchar* data, uint64_t length, off_t offset)
+{
+	cMutexLock lock(&m_mutex);
+
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		tWriteRequest* slot = &m_requests[request];
+		if (slot->state == rsFree)
+		{
+			slot->file = file;
+			slot->data = data;
+			slot->length = length;
+			slot->offset = offset;
+			slot->result = 0;
+			slot->state = rsQueued;
+			m_pending++;
+			m_requestQueued.Broadcast();
+			return request;
+		}
+	}
+	return -1;
+}
+
+bool cAsyncWriter::Reap(int* request, int64_t* result, uint64_t* completionTime)
+{
+	cMutexLock lock(&m_mutex);
+
+	for (int done = 0; done < m_requestCount; done++)
+	{
+		if (m_requests[done].state == rsDone)
+		{
+			*request = done;
+			*result = m_requests[done].result;
+			if (completionTime != NULL)
+			{
+				*completionTime = m_requests[done].completionTime;
+			}
+			m_requests[done].state = rsFree;
+			m_pending--;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool cAsyncWriter::WaitForCompletion(int timeoutMs)
+{
+	cMutexLock lock(&m_mutex);
+
+	if (Count(rsDone) == 0 && m_pending > 0)
+	{
+		m_requestDone.TimedWait(m_mutex, timeoutMs);
+	}
+	return Count(rsDone) > 0;
+}
+
+void cAsyncWriter::Action()
+{
+	m_mutex.Lock();
+	while (Running())
+	{
+		Submit();
+		if (Count(rsSubmitted) > 0)
+		{
+			m_mutex.Unlock();
+			Complete(ENGINE_WAIT_MS);
+			m_mutex.Lock();
+		}
+		else
+		{
+			m_requestQueued.TimedWait(m_mutex, ENGINE_WAIT_MS);
+		}
+	}
+	m_mutex.Unlock();
+}
+
+void cAsyncWriter::Submit()
+{
+#ifdef PERMASHIFT_IO_URING
+	bool submitted = false;
+#endif
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		tWriteRequest* slot = &m_requests[request];
+		if (slot->state != rsQueued) continue;
+
+		if (m_useRing)
+		{
+#ifdef PERMASHIFT_IO_URING
+			struct io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+			if (sqe == NULL) break;
+			io_uring_prep_write(sqe, slot->file, slot->data, slot->length, slot->offset);
+			io_uring_sqe_set_data(sqe, slot);
+			slot->state = rsSubmitted;
+			submitted = true;
+#endif
+		}
+		else
+		{
+			memset(&slot->aio, 0, sizeof(slot->aio));
+			slot->aio.aio_fildes = slot->file;
+			slot->aio.aio_buf = (void*)slot->data;
+			slot->aio.aio_nbytes = slot->length;
+			slot->aio.aio_offset = slot->offset;
+			slot->aio.aio_sigevent.sigev_notify = SIGEV_NONE;
+			if (aio_write(&slot->aio) == 0)
+			{
+				slot->state = rsSubmitted;
+			}
+			else if (errno == EAGAIN)
+			{
+				// out of resources, try again later
+				break;
+			}
+			else
+			{
+				Finish(slot, -errno);
+			}
+		}
+	}
+
+#ifdef PERMASHIFT_IO_URING
+	if (submitted)
+	{
+		int result = io_uring_submit(&m_ring);
+		if (result < 0)
+		{
+			esyslog("permashift: io_uring submission failed (%d)", -result);
+		}
+	}
+#endif
+}
+
+void cAsyncWriter::Complete(int timeoutMs)
+{
+	if (m_useRing)
+	{
+#ifdef PERMASHIFT_IO_URING
+		struct io_uring_cqe* cqe;
+		struct __kernel_timespec timeout;
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+		if (io_uring_wait_cqe_timeout(&m_ring, &cqe, &timeout) == 0)
+		{
+			do
+			{
+				tWriteRequest* slot = (tWriteRequest*)io_uring_cqe_get_data(cqe);
+				int64_t result = cqe->res;
+				io_uring_cqe_seen(&m_ring, cqe);
+
+				cMutexLock lock(&m_mutex);
+				Finish(slot, result);
+			}
+			while (io_uring_peek_cqe(&m_ring, &cqe) == 0);
+		}
+#endif
+		return;
+	}
+
+	int count = 0;
+	m_mutex.Lock();
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		if (m_requests[request].state == rsSubmitted)
+		{
+			m_aioList[count++] = &m_requests[request].aio;
+		}
+	}
+	m_mutex.Unlock();
+	if (count == 0) return;
+
+	struct timespec timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+	aio_suspend(m_aioList, count, &timeout);
+
+	cMutexLock lock(&m_mutex);
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		tWriteRequest* slot = &m_requests[request];
+		if (slot->state != rsSubmitted) continue;
+
+		int error = aio_error(&slot->aio);
+		if (error == EINPROGRESS) continue;
+
+		ssize_t result = aio_return(&slot->aio);
+		Finish(slot, error == 0 ? result : -error);
+	}
+}
+
+void cAsyncWriter::Finish(tWriteRequest* request, int64_t result)
+{
+	if (result > 0 && (uint64_t)result < request->length)
+	{
+		// short write, queue the rest
+		request->data += result;
+		request->length -= result;
+		request->offset += result;
+		request->result += result;
+		request->state = rsQueued;
+		m_requestQueued.Broadcast();
+		return;
+	}
+
+	if (result < 0)
+	{
+		request->result = result;
+	}
+	else if (result == 0 && request->length > 0)
+	{
+		request->result = -EIO;
+	}
+	else
+	{
+		request->result += result;
+	}
+	request->completionTime = cTimeMs::Now();
+	request->state = rsDone;
+	m_requestDone.Broadcast();
+}
@@ -0,0 +1,131 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef ASYNCWRITER_H_
+#define ASYNCWRITER_H_
+
+#include <vdr/tools.h>
+#include <vdr/thread.h>
+#include <aio.h>
+
+#ifdef PERMASHIFT_IO_URING
+#include <liburing.h>
+#endif
+
+/// default number of writes in flight
+#define ASYNC_WRITES_IN_FLIGHT 4
+
+/// engine writing data to files asynchronously, in its own thread
+///
+/// Writes are queued without blocking and handed to the kernel by the engine
+/// thread, using io_uring (if built with PERMASHIFT_IO_URING) or POSIX AIO.
+/// Completed writes are collected by the caller with Reap(), so all
+/// bookkeeping stays in the caller's thread. Data to be written has to stay
+/// valid until its write has been reaped.
+class cAsyncWriter : public cThread
+{
+private:
+
+	/// state of a request slot
+	enum eRequestState
+	{
+		rsFree,			///< slot not used
+		rsQueued,		///< waiting to be submitted
+		rsSubmitted,	///< handed to the kernel
+		rsDone			///< completed, waiting to be reaped
+	};
+
+	/// a write request
+	struct tWriteRequest
+	{
+		eRequestState state;	///< state of request
+		int file;				///< file to write to
+		const uchar* data;		///< data not written yet
+		uint64_t length;		///< bytes not written yet
+		off_t offset;			///< file offset of data not written yet
+		int64_t result;			///< bytes written in total, or negative error number
+		uint64_t completionTime;	///< time of completion (ms, see cTimeMs::Now())
+		struct aiocb aio;		///< control block of POSIX AIO
+	};
+
+	/// syncs request slots between caller and engine thread
+	cMutex m_mutex;
+
+	/// signals new requests to engine thread
+	cCondVar m_requestQueued;
+
+	/// signals completed requests to caller
+	cCondVar m_requestDone;
+
+	/// request slots
+	tWriteRequest* m_requests;
+
+	/// number of request slots
+	int m_requestCount;
+
+	/// control blocks of submitted requests, for waiting on them (POSIX AIO)
+	const struct aiocb** m_aioList;
+
+	/// number of requests not reaped yet
+	int m_pending;
+
+#ifdef PERMASHIFT_IO_URING
+	/// submission and completion queues
+	struct io_uring m_ring;
+#endif
+
+	/// io_uring is used (otherwise POSIX AIO)
+	bool m_useRing;
+
+	/// hands queued requests to the kernel
+	void Submit();
+
+	/// waits for submitted requests to complete and marks them done
+	void Complete(int timeoutMs);
+
+	/// processes result of a request, requeueing short writes
+	void Finish(tWriteRequest* request, int64_t result);
+
+	/// number of requests in given state
+	int Count(eRequestState state);
+
+protected:
+
+	/// engine thread
+	virtual void Action();
+
+public:
+
+	/// create engine with given number of writes in flight and start its thread
+	cAsyncWriter(int maxInFlight = ASYNC_WRITES_IN_FLIGHT);
+
+	/// waits for writes still in flight and destroys engine
+	virtual ~cAsyncWriter();
+
+	/// queues writing data to file at given offset, returns request number (used by Reap())
+	/// returns -1 if there's no free slot (too many requests pending)
+	int Write(int file, const uchar* data, uint64_t length, off_t offset);
+
+	/// fetches a completed request without waiting, returns false if there's none
+	/// result is the number of bytes written or a negative error number
+	bool Reap(int* request, int64_t* result, uint64_t* completionTime = NULL);
+
+	/// waits up to given time for a request to complete, returns false if none has
+	bool WaitForCompletion(int timeoutMs);
+
+	/// number of requests not reaped yet
+	int Pending() { return m_pending; }
+
+	/// is there a free slot for another write?
+	bool CanWrite() { return m_pending < m_requestCount; }
+
+	/// name of kernel interface used
+	const char* Backend() { return m_useRing ? "io_uring" : "POSIX AIO"; }
+};
+
+#endif /* ASYNCWRITER_H_ */
@@ -0,0 +1,61 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "bufferanalyzer.h"
+#include "bufferreceiver.h"
+
+// time between analysis passes, unless woken up
+#define ANALYSIS_INTERVAL_MS 20
+
+
+cBufferAnalyzer::cBufferAnalyzer() : cThread("permashift analyzer")
+{
+	Start();
+}
+
+cBufferAnalyzer::~cBufferAnalyzer()
+{
+	Cancel(-1);
+	m_wakeup.Signal();
+	Cancel(3);
+}
+
+void cBufferAnalyzer::Add(cBufferReceiver* receiver)
+{
+	cMutexLock lock(&m_mutex);
+
+	if (m_receivers.IndexOf(receiver) < 0)
+	{
+		m_receivers.Append(receiver);
+	}
+}
+
+void cBufferAnalyzer::Remove(cBufferReceiver* receiver)
+{
+	cMutexLock lock(&m_mutex);
+
+	int index = m_receivers.IndexOf(receiver);
+	if (index >= 0)
+	{
+		m_receivers.Remove(index);
+	}
+}
+
+void cBufferAnalyzer::Action()
+{
+	while (Running())
+	{
+		m_wakeup.Wait(ANALYSIS_INTERVAL_MS);
+
+		cMutexLock lock(&m_mutex);
+		for (int receiver = 0; receiver < m_receivers.Size(); receiver++)
+		{
+			m_receivers[receiver]->Analyze();
+		}
+	}
+}
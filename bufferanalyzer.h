@@ -0,0 +1,56 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef BUFFERANALYZER_H_
+#define BUFFERANALYZER_H_
+
+#include <vdr/thread.h>
+#include <vdr/tools.h>
+
+class cBufferReceiver;
+
+/// analysis stage of buffering, in its own thread shared by all receivers
+///
+/// Receivers only queue the packets they get from the device, so the device's
+/// receiving thread is never held up. This thread runs the frame detector on the
+/// queued data, moves it to the buffer and builds the frame index, for each receiver
+/// in turn, a few times per second or when a receiver's queue fills up.
+class cBufferAnalyzer : public cThread
+{
+private:
+
+	/// syncs list of receivers vs. analysis
+	cMutex m_mutex;
+
+	/// receivers to analyze data of
+	cVector<cBufferReceiver*> m_receivers;
+
+	/// wakes thread up before its time
+	cCondWait m_wakeup;
+
+public:
+
+	cBufferAnalyzer();
+	virtual ~cBufferAnalyzer();
+
+	/// adds receiver to be analyzed
+	void Add(cBufferReceiver* receiver);
+
+	/// removes receiver, waiting for its analysis to finish
+	void Remove(cBufferReceiver* receiver);
+
+	/// asks for analysis right away
+	void Wakeup() { m_wakeup.Signal(); }
+
+protected:
+
+	/// analysis thread
+	virtual void Action();
+};
+
+#endif /* BUFFERANALYZER_H_ */
@@ -0,0 +1,155 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "bufferfile.h"
+#include "frameindex.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// identifies a buffer file
+static const char BUFFER_FILE_MAGIC[8] = { 'P', 'S', 'H', 'B', 'U', 'F', 'F', '\0' };
+
+// increase whenever layout of file or header changes
+#define BUFFER_FILE_VERSION 1
+
+
+cBufferFile::cBufferFile() :
+m_fileName(NULL), m_file(-1), m_index(NULL), m_indexSize(0), m_restorable(false)
+{
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+cBufferFile::~cBufferFile()
+{
+	if (m_index != NULL)
+	{
+		munmap(m_index, m_indexSize);
+	}
+	if (m_file >= 0)
+	{
+		close(m_file);
+	}
+	free(m_fileName);
+}
+
+uint64_t cBufferFile::Checksum(const tHeader& header)
+{
+	tHeader copy;
+	memcpy(&copy, &header, sizeof(copy));
+	copy.checksum = 0;
+
+	// FNV-1a
+	const uchar* bytes = (const uchar*)&copy;
+	uint64_t checksum = 14695981039346656037ull;
+	for (size_t i = 0; i < sizeof(copy); i++)
+	{
+		checksum = (checksum ^ bytes[i]) * 1099511628211ull;
+	}
+	return checksum;
+}
+
+bool cBufferFile::ReadHeader(int slot, tHeader* header)
+{
+	if (pread(m_file, header, sizeof(*header), (off_t)slot * BUFFER_FILE_HEADER_SIZE) != (ssize_t)sizeof(*header))
+	{
+		return false;
+	}
+	return memcmp(header->magic, BUFFER_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+		header->version == BUFFER_FILE_VERSION &&
+		header->checksum == Checksum(*header) &&
+		strncmp(header->channelId, m_header.channelId, sizeof(header->channelId)) == 0 &&
+		header->bufferLength == m_header.bufferLength &&
+		header->indexCapacity == m_header.indexCapacity;
+}
+
+bool cBufferFile::Open(const char* fileName, const char* channelId, uint64_t bufferLength, int indexCapacity)
+{
+	m_fileName = strdup(fileName);
+	m_file = open(fileName, O_RDWR | O_CREAT | O_CLOEXEC, DEFFILEMODE);
+	if (m_file < 0)
+	{
+		esyslog("permashift: could not open buffer file %s (%d)!", fileName, errno);
+		return false;
+	}
+
+	// header we're looking for
+	memcpy(m_header.magic, BUFFER_FILE_MAGIC, sizeof(m_header.magic));
+	m_header.version = BUFFER_FILE_VERSION;
+	strn0cpy(m_header.channelId, channelId, sizeof(m_header.channelId));
+	m_header.bufferLength = bufferLength;
+	m_header.indexCapacity = indexCapacity;
+
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	m_indexSize = (cFrameIndex::MemorySize(indexCapacity) + pageSize - 1) / pageSize * pageSize;
+	off_t fileSize = DataOffset() + (bufferLength + pageSize - 1) / pageSize * pageSize;
+
+	// the newer valid header slot wins
+	tHeader headers[2];
+	bool valid[2] = { ReadHeader(0, &headers[0]), ReadHeader(1, &headers[1]) };
+	struct stat fileStat;
+	if ((valid[0] || valid[1]) && fstat(m_file, &fileStat) == 0 && fileStat.st_size == fileSize)
+	{
+		int slot = valid[0] && (!valid[1] || headers[0].generation > headers[1].generation) ? 0 : 1;
+		m_header = headers[slot];
+		m_restorable = true;
+	}
+	else
+	{
+		// start over with an empty (sparse) file
+		m_header.generation = 0;
+		if (ftruncate(m_file, 0) != 0 || ftruncate(m_file, fileSize) != 0)
+		{
+			esyslog("permashift: could not size buffer file %s (%d)!", fileName, errno);
+			return false;
+		}
+	}
+
+	m_index = (uchar*)mmap(NULL, m_indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 2 * BUFFER_FILE_HEADER_SIZE);
+	if (m_index == MAP_FAILED)
+	{
+		esyslog("permashift: could not map buffer file index (%d)!", errno);
+		m_index = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool cBufferFile::GetRestorableState(tState* state)
+{
+	if (!m_restorable) return false;
+
+	*state = m_header.state;
+	return true;
+}
+
+bool cBufferFile::Commit(const tState& state)
+{
+	if (m_file < 0) return false;
+
+	m_header.generation++;
+	m_header.state = state;
+	m_header.checksum = Checksum(m_header);
+	int slot = m_header.generation % 2;
+	if (pwrite(m_file, &m_header, sizeof(m_header), (off_t)slot * BUFFER_FILE_HEADER_SIZE) != (ssize_t)sizeof(m_header))
+	{
+		esyslog("permashift: could not write buffer file header (%d)!", errno);
+		return false;
+	}
+	return true;
+}
+
+void cBufferFile::Remove()
+{
+	if (m_fileName != NULL && unlink(m_fileName) != 0 && errno != ENOENT)
+	{
+		esyslog("permashift: could not delete buffer file %s (%d)!", m_fileName, errno);
+	}
+}
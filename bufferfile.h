@@ -0,0 +1,115 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef BUFFERFILE_H_
+#define BUFFERFILE_H_
+
+#include <vdr/tools.h>
+
+/// size of each of the two header slots
+#define BUFFER_FILE_HEADER_SIZE 4096
+
+/// longest channel id kept in header
+#define BUFFER_FILE_CHANNEL_ID_SIZE 64
+
+/// file keeping the data and frame index of a buffer across restarts of VDR
+///
+/// The file holds two header slots, the frame index arrays and the ring buffer data.
+/// Index and data are mapped into memory, so they live in the file (meant to be on
+/// tmpfs or an SSD) and nothing has to be copied when resuming. The state to resume with
+/// is committed to the header slots alternately, each copy having a generation and a
+/// checksum, so a header torn by a crash leaves the previous one valid.
+class cBufferFile
+{
+public:
+
+	/// state of buffer and receiver committed to the header (without padding, as it's checksummed)
+	struct tState
+	{
+		uint64_t dataStart;		///< buffer position of oldest byte
+		uint64_t dataLength;	///< bytes in buffer
+		uint64_t dataWritten;	///< total bytes written to buffer
+		uint64_t filePartStart;	///< buffer offset of first frame of current file part
+		int64_t streamTime;		///< stream time of newest frame
+		uint64_t receiveTime;	///< system time newest frame has been received at
+		int32_t indexFirst;		///< array position of oldest frame
+		int32_t indexCount;		///< number of frames
+		uint16_t filePart;		///< current file part
+		uint16_t reserved[3];	///< unused, 0
+	};
+
+private:
+
+	/// contents of a header slot (without padding, as it's checksummed)
+	struct tHeader
+	{
+		char magic[8];				///< identifies the file
+		uint32_t version;			///< layout version
+		int32_t indexCapacity;		///< capacity of frame index
+		uint64_t generation;		///< number of commit, the higher the newer
+		uint64_t checksum;			///< checksum of header, with this field being 0
+		char channelId[BUFFER_FILE_CHANNEL_ID_SIZE];	///< channel buffered
+		uint64_t bufferLength;		///< size of ring buffer
+		tState state;				///< state committed
+	};
+
+	/// name of file
+	char* m_fileName;
+
+	/// file descriptor, -1 if not open
+	int m_file;
+
+	/// mapped frame index arrays
+	uchar* m_index;
+
+	/// bytes of frame index arrays (as mapped)
+	uint64_t m_indexSize;
+
+	/// header for next commit, its state being the one found when opening
+	tHeader m_header;
+
+	/// file contains a state to resume with
+	bool m_restorable;
+
+	/// checksum of header
+	static uint64_t Checksum(const tHeader& header);
+
+	/// reads header slot, returns false if it is not valid for our channel and layout
+	bool ReadHeader(int slot, tHeader* header);
+
+public:
+
+	cBufferFile();
+
+	/// unmaps index and closes file (which stays on disc, unless removed)
+	virtual ~cBufferFile();
+
+	/// opens file for the given channel and layout, creating it if necessary;
+	/// contents matching channel and layout are kept for resuming, otherwise the file is cleared
+	bool Open(const char* fileName, const char* channelId, uint64_t bufferLength, int indexCapacity);
+
+	/// fetches state committed before, returns false if there's none for this channel and layout
+	bool GetRestorableState(tState* state);
+
+	/// file descriptor for mapping buffer data
+	int File() { return m_file; }
+
+	/// file offset of buffer data
+	off_t DataOffset() { return 2 * BUFFER_FILE_HEADER_SIZE + m_indexSize; }
+
+	/// memory of frame index arrays (see cFrameIndex::Attach())
+	uchar* IndexMemory() { return m_index; }
+
+	/// writes state to the older header slot
+	bool Commit(const tState& state);
+
+	/// deletes the file, its contents stay available until it's closed
+	void Remove();
+};
+
+#endif /* BUFFERFILE_H_ */
@@ -0,0 +1,595 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "bufferplayer.h"
+
+#include <vdr/menu.h>
+#include "bufferreceiver.h"
+#include "permashift.h"
+#include "latencyhistogram.h"
+
+// data played at once (a multiple of TS package size)
+#define PLAY_CHUNK_SIZE (350 * TS_SIZE)
+
+// size of play data, large enough for I frames of HD channels
+#define PLAY_BUFFER_SIZE (1024 * 1024)
+
+// waiting time at end of buffer for new data to arrive
+#define WAIT_FOR_DATA_MS 3
+
+// waiting time when paused
+#define PAUSE_WAIT_MS 10
+
+// interval of showing I frames in trick mode
+#define TRICK_INTERVAL_MS 100
+
+// time progress display is shown after last key while playing
+#define DISPLAY_TIMEOUT_MS 3000
+
+// speeds of trick mode
+static const int s_trickSpeeds[] = { 2, 4, 8, 16, 32 };
+static const int s_trickSpeedCount = sizeof(s_trickSpeeds) / sizeof(int);
+
+
+cBufferPlayer::cBufferPlayer(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver) : cThread("permashift player"),
+ m_plugin(plugin),
+ m_bufferReceiver(bufferReceiver),
+ m_state(psPause),
+ m_forward(false),
+ m_speed(0),
+ m_readOffset(0),
+ m_playLength(0),
+ m_playDone(0),
+ m_trickTime(0),
+ m_shownTime(0),
+ m_still(false),
+ m_trickSteps(0),
+ m_trickLatency(0),
+ m_trickLatencyMax(0),
+ m_deviceLatency(0),
+ m_deviceLatencyMax(0),
+ m_framesPerSecond(DEFAULTFRAMESPERSECOND),
+ m_ended(false)
+{
+	m_playData = MALLOC(uchar, PLAY_BUFFER_SIZE);
+	if (m_playData == NULL)
+	{
+		esyslog("permashift: out of memory for buffer player!");
+		m_ended = true;
+	}
+
+	// start at the newest I frame
+	uint64_t offset;
+	int length;
+	int64_t frameTime;
+	if (FindIFrame(INT64_MAX, false, &offset, &length, &frameTime))
+	{
+		m_readOffset = offset;
+		m_shownTime = frameTime;
+	}
+
+	cBufferAccess access(m_plugin, m_bufferReceiver);
+	if (access.Receiver() != NULL)
+	{
+		m_framesPerSecond = access.Receiver()->FramesPerSecond();
+	}
+}
+
+cBufferPlayer::~cBufferPlayer()
+{
+	Detach();
+	EndTrick();
+	free(m_playData);
+}
+
+void cBufferPlayer::Activate(bool On)
+{
+	if (On)
+	{
+		Start();
+	}
+	else
+	{
+		Cancel(9);
+	}
+}
+
+int cBufferPlayer::ReadBuffer(uint64_t offset, uchar* data, int maxLength)
+{
+	cBufferAccess access(m_plugin, m_bufferReceiver);
+	if (access.Receiver() == NULL)
+	{
+		m_ended = true;
+		return -1;
+	}
+	return access.Receiver()->ReadBuffer(offset, data, maxLength);
+}
+
+bool cBufferPlayer::FindIFrame(int64_t time, bool forward, uint64_t* offset, int* length, int64_t* frameTime)
+{
+	cBufferAccess access(m_plugin, m_bufferReceiver);
+	if (access.Receiver() == NULL)
+	{
+		m_ended = true;
+		return false;
+	}
+	return access.Receiver()->FindIFrame(time, forward, offset, length, frameTime);
+}
+
+bool cBufferPlayer::GetFramePosition(int* frame, int* frameCount, int64_t* time)
+{
+	cBufferAccess access(m_plugin, m_bufferReceiver);
+	if (access.Receiver() == NULL)
+	{
+		m_ended = true;
+		return false;
+	}
+	return access.Receiver()->GetFramePosition(m_readOffset, frame, frameCount, time);
+}
+
+void cBufferPlayer::ShowIFrame(uint64_t offset, int length, int64_t frameTime)
+{
+	int bytesRead = ReadBuffer(offset, m_playData, min(length, PLAY_BUFFER_SIZE));
+	if (bytesRead > 0)
+	{
+		uint64_t start = MonotonicNanoSeconds();
+		DeviceStillPicture(m_playData, bytesRead);
+		uint64_t latency = (MonotonicNanoSeconds() - start) / 1000;
+		m_deviceLatency += latency;
+		m_deviceLatencyMax = max(m_deviceLatencyMax, latency);
+	}
+
+	// playing continues here
+	m_readOffset = offset;
+	m_playLength = 0;
+	m_playDone = 0;
+	m_shownTime = frameTime;
+	m_still = true;
+}
+
+void cBufferPlayer::Action()
+{
+	dsyslog("permashift: buffer player started\n");
+
+	{
+		LOCK_THREAD;
+
+		// show where we're starting when paused
+		uint64_t offset;
+		int length;
+		int64_t frameTime;
+		if (m_state == psPause && FindIFrame(m_shownTime, false, &offset, &length, &frameTime))
+		{
+			ShowIFrame(offset, length, frameTime);
+		}
+	}
+
+	cPoller poller;
+	while (Running() && !m_ended)
+	{
+		int waitMs;
+		{
+			LOCK_THREAD;
+			switch (m_state)
+			{
+			case psPlay:
+				waitMs = PlayStep();
+				break;
+			case psTrick:
+				waitMs = TrickStep();
+				break;
+			default:
+				waitMs = PAUSE_WAIT_MS;
+				break;
+			}
+		}
+
+		if (waitMs < 0)
+		{
+			DevicePoll(poller, 10);
+		}
+		else if (waitMs > 0)
+		{
+			cCondWait::SleepMs(waitMs);
+		}
+	}
+
+	dsyslog("permashift: buffer player stopped\n");
+}
+
+int cBufferPlayer::PlayStep()
+{
+	if (m_playDone == m_playLength)
+	{
+		// fetch next piece of buffer
+		int bytesRead = ReadBuffer(m_readOffset, m_playData, PLAY_CHUNK_SIZE);
+		if (bytesRead < 0)
+		{
+			if (m_ended) return 0;
+
+			// data has been overwritten before being played, continue with oldest I frame
+			uint64_t offset;
+			int length;
+			int64_t frameTime;
+			if (!FindIFrame(INT64_MIN, true, &offset, &length, &frameTime))
+			{
+				return WAIT_FOR_DATA_MS;
+			}
+			dsyslog("permashift: buffer overtook replay, skipping %llu bytes\n", (unsigned long long)(offset - m_readOffset));
+			m_readOffset = offset;
+			m_shownTime = frameTime;
+			DeviceClear();
+			DevicePlay();
+			return 0;
+		}
+		if (bytesRead == 0)
+		{
+			// reached live video
+			return WAIT_FOR_DATA_MS;
+		}
+		m_playLength = bytesRead;
+		m_playDone = 0;
+	}
+
+	int bytesPlayed = PlayTs(m_playData + m_playDone, m_playLength - m_playDone);
+	if (bytesPlayed <= 0)
+	{
+		return -1;
+	}
+	m_playDone += bytesPlayed;
+	m_readOffset += bytesPlayed;
+	return 0;
+}
+
+int cBufferPlayer::TrickStep()
+{
+	uint64_t start = MonotonicNanoSeconds();
+
+	// advance stream time by elapsed time times speed
+	int64_t step = (int64_t)m_trickTimer.Elapsed() * s_trickSpeeds[m_speed] * (TIMESTAMP_FREQUENCY / 1000);
+	m_trickTime += m_forward ? step : -step;
+	m_trickTimer.Set();
+
+	uint64_t offset;
+	int length;
+	int64_t frameTime;
+	if (!FindIFrame(m_trickTime, m_forward, &offset, &length, &frameTime))
+	{
+		if (m_ended) return 0;
+
+		// reached end of buffer: play live video when going forward, pause at oldest frame otherwise
+		EndTrick();
+		if (m_forward)
+		{
+			if (FindIFrame(INT64_MAX, false, &offset, &length, &frameTime))
+			{
+				m_readOffset = offset;
+				m_shownTime = frameTime;
+			}
+			m_playLength = 0;
+			m_playDone = 0;
+			DeviceClear();
+			m_still = false;
+			DevicePlay();
+			m_state = psPlay;
+		}
+		else
+		{
+			if (FindIFrame(INT64_MIN, true, &offset, &length, &frameTime))
+			{
+				ShowIFrame(offset, length, frameTime);
+			}
+			m_state = psPause;
+		}
+		return 0;
+	}
+
+	// show the I frame passed last, if it's a new one
+	if (FindIFrame(m_trickTime, !m_forward, &offset, &length, &frameTime) && frameTime != m_shownTime)
+	{
+		ShowIFrame(offset, length, frameTime);
+		uint64_t latency = (MonotonicNanoSeconds() - start) / 1000;
+		m_trickSteps++;
+		m_trickLatency += latency;
+		m_trickLatencyMax = max(m_trickLatencyMax, latency);
+	}
+	return TRICK_INTERVAL_MS;
+}
+
+void cBufferPlayer::StartTrick(bool forward)
+{
+	EndTrick();
+
+	// trick mode starts at the current position
+	if (m_state == psPlay)
+	{
+		int frame, frameCount;
+		int64_t time;
+		if (GetFramePosition(&frame, &frameCount, &time))
+		{
+			m_shownTime = time;
+		}
+	}
+	m_trickTime = m_shownTime;
+	m_trickTimer.Set();
+	m_forward = forward;
+	m_speed = 0;
+	m_state = psTrick;
+	DeviceClear();
+}
+
+void cBufferPlayer::EndTrick()
+{
+	if (m_state == psTrick && m_trickSteps > 0)
+	{
+		dsyslog("permashift: trick mode %s at %dx: %d steps, latency avg %llu us, max %llu us (device avg %llu us, max %llu us)\n",
+				m_forward ? "forward" : "backward", s_trickSpeeds[m_speed], m_trickSteps,
+				(unsigned long long)(m_trickLatency / m_trickSteps), (unsigned long long)m_trickLatencyMax,
+				(unsigned long long)(m_deviceLatency / m_trickSteps), (unsigned long long)m_deviceLatencyMax);
+	}
+	m_trickSteps = 0;
+	m_trickLatency = 0;
+	m_trickLatencyMax = 0;
+	m_deviceLatency = 0;
+	m_deviceLatencyMax = 0;
+}
+
+void cBufferPlayer::Play()
+{
+	LOCK_THREAD;
+
+	if (m_state == psPlay) return;
+
+	EndTrick();
+
+	if (m_still)
+	{
+		// continue at the I frame shown
+		DeviceClear();
+		m_still = false;
+	}
+	DevicePlay();
+	m_state = psPlay;
+}
+
+void cBufferPlayer::Pause()
+{
+	LOCK_THREAD;
+
+	EndTrick();
+
+	switch (m_state)
+	{
+	case psPause:
+		if (m_still)
+		{
+			DeviceClear();
+			m_still = false;
+		}
+		DevicePlay();
+		m_state = psPlay;
+		break;
+	case psPlay:
+		DeviceFreeze();
+		m_state = psPause;
+		break;
+	default:
+		// I frame shown last stays visible
+		m_state = psPause;
+		break;
+	}
+}
+
+void cBufferPlayer::Forward()
+{
+	LOCK_THREAD;
+
+	if (m_state == psTrick && m_forward)
+	{
+		m_speed = min(m_speed + 1, s_trickSpeedCount - 1);
+	}
+	else
+	{
+		StartTrick(true);
+	}
+}
+
+void cBufferPlayer::Backward()
+{
+	LOCK_THREAD;
+
+	if (m_state == psTrick && !m_forward)
+	{
+		m_speed = min(m_speed + 1, s_trickSpeedCount - 1);
+	}
+	else
+	{
+		StartTrick(false);
+	}
+}
+
+void cBufferPlayer::SkipSeconds(int seconds)
+{
+	LOCK_THREAD;
+
+	int frame, frameCount;
+	int64_t time;
+	if (!GetFramePosition(&frame, &frameCount, &time)) return;
+
+	// find I frame at target time, or at the end of buffer beyond it
+	time += (int64_t)seconds * TIMESTAMP_FREQUENCY;
+	bool forward = seconds > 0;
+	uint64_t offset;
+	int length;
+	int64_t frameTime;
+	if (!FindIFrame(time, forward, &offset, &length, &frameTime) && !FindIFrame(time, !forward, &offset, &length, &frameTime))
+	{
+		return;
+	}
+
+	if (m_state == psPlay)
+	{
+		m_readOffset = offset;
+		m_playLength = 0;
+		m_playDone = 0;
+		m_shownTime = frameTime;
+		DeviceClear();
+		DevicePlay();
+	}
+	else
+	{
+		ShowIFrame(offset, length, frameTime);
+		m_trickTime = frameTime;
+	}
+}
+
+bool cBufferPlayer::GetIndex(int& Current, int& Total, bool SnapToIFrame)
+{
+	LOCK_THREAD;
+
+	int64_t time;
+	return GetFramePosition(&Current, &Total, &time);
+}
+
+bool cBufferPlayer::GetReplayMode(bool& Play, bool& Forward, int& Speed)
+{
+	Play = m_state != psPause;
+	Forward = m_state != psTrick || m_forward;
+	Speed = m_state == psTrick ? m_speed + 1 : -1;
+	return true;
+}
+
+
+cBufferControl::cBufferControl(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver, bool rewind) :
+ cControl(m_player = new cBufferPlayer(plugin, bufferReceiver)),
+ m_displayReplay(NULL)
+{
+	m_title = bufferReceiver->Channel() != NULL ? bufferReceiver->Channel()->Name() : "";
+	if (rewind)
+	{
+		m_player->Backward();
+	}
+}
+
+cBufferControl::~cBufferControl()
+{
+	Hide();
+	delete m_player;
+}
+
+void cBufferControl::Hide()
+{
+	if (m_displayReplay != NULL)
+	{
+		delete m_displayReplay;
+		m_displayReplay = NULL;
+	}
+}
+
+void cBufferControl::ShowProgress()
+{
+	if (m_displayReplay == NULL)
+	{
+		m_displayReplay = Skins.Current()->DisplayReplay(false);
+		m_displayReplay->SetTitle(m_title);
+	}
+
+	bool play, forward;
+	int speed;
+	if (m_player->GetReplayMode(play, forward, speed))
+	{
+		m_displayReplay->SetMode(play, forward, speed);
+	}
+
+	int current, total;
+	if (m_player->GetIndex(current, total))
+	{
+		m_displayReplay->SetProgress(current, total);
+		m_displayReplay->SetCurrent(IndexToHMSF(current, false, m_player->FramesPerSecond()));
+		m_displayReplay->SetTotal(IndexToHMSF(total, false, m_player->FramesPerSecond()));
+	}
+	m_displayReplay->Flush();
+}
+
+eOSState cBufferControl::ProcessKey(eKeys Key)
+{
+	if (m_player->Ended())
+	{
+		// buffer is gone
+		Hide();
+		return osEnd;
+	}
+
+	// keep progress display up to date, hide it some time after last key when playing
+	if (m_displayReplay != NULL)
+	{
+		bool play, forward;
+		int speed;
+		m_player->GetReplayMode(play, forward, speed);
+		if (play && speed < 0 && m_displayTimeout.TimedOut())
+		{
+			Hide();
+		}
+		else
+		{
+			ShowProgress();
+		}
+	}
+
+	switch (int(Key))
+	{
+	case kPlay:
+	case kUp:
+		m_player->Play();
+		break;
+	case kPause:
+	case kDown:
+	case kPlayPause:
+		m_player->Pause();
+		break;
+	case kFastRew:
+	case kLeft:
+		m_player->Backward();
+		break;
+	case kFastFwd:
+	case kRight:
+		m_player->Forward();
+		break;
+	case kGreen | k_Repeat:
+	case kGreen:
+		m_player->SkipSeconds(-60);
+		break;
+	case kYellow | k_Repeat:
+	case kYellow:
+		m_player->SkipSeconds(60);
+		break;
+	case kRecord:
+		// keep buffer by turning it into an instant recording
+		Hide();
+		cRecordControls::Start();
+		return osEnd;
+	case kStop:
+	case kBlue:
+	case kBack:
+		Hide();
+		return osEnd;
+	case kOk:
+		if (m_displayReplay != NULL)
+		{
+			Hide();
+			return osContinue;
+		}
+		break;
+	default:
+		return osUnknown;
+	}
+
+	m_displayTimeout.Set(DISPLAY_TIMEOUT_MS);
+	ShowProgress();
+	return osContinue;
+}
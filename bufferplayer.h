@@ -0,0 +1,189 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef BUFFERPLAYER_H_
+#define BUFFERPLAYER_H_
+
+#include <vdr/player.h>
+#include <vdr/skins.h>
+
+class cPluginPermashift;
+class cBufferReceiver;
+
+/// player replaying the memory buffer of a receiver while it keeps receiving
+///
+/// The buffer is only accessed through the plugin, which makes sure it
+/// is not deleted while being read. When it is gone, replay ends.
+class cBufferPlayer : public cPlayer, cThread
+{
+private:
+
+	/// play states
+	enum ePlayState
+	{
+		psPlay,		///< playing at normal speed
+		psPause,	///< frozen
+		psTrick		///< showing I frames only, fast forward or rewind
+	};
+
+	/// plugin granting access to the buffer
+	cPluginPermashift* m_plugin;
+
+	/// receiver whose buffer is played (never dereferenced without access granted by plugin)
+	cBufferReceiver* m_bufferReceiver;
+
+	/// current play state
+	ePlayState m_state;
+
+	/// direction of trick mode
+	bool m_forward;
+
+	/// speed of trick mode (index into trick speeds)
+	int m_speed;
+
+	/// buffer offset of next data to play
+	uint64_t m_readOffset;
+
+	/// data copied from buffer for playing
+	uchar* m_playData;
+
+	/// bytes in play data
+	int m_playLength;
+
+	/// bytes of play data already played
+	int m_playDone;
+
+	/// stream time trick mode has advanced to
+	int64_t m_trickTime;
+
+	/// time since last trick mode step
+	cTimeMs m_trickTimer;
+
+	/// stream time of I frame shown last (or played from)
+	int64_t m_shownTime;
+
+	/// device shows a still picture, so it has to be cleared before playing
+	bool m_still;
+
+	/// steps of trick mode showing a new I frame
+	int m_trickSteps;
+
+	/// total and maximum latency of trick mode steps (from start of step to I frame passed to device, in us)
+	uint64_t m_trickLatency;
+	uint64_t m_trickLatencyMax;
+
+	/// total and maximum time the device took for showing I frames (in us)
+	uint64_t m_deviceLatency;
+	uint64_t m_deviceLatencyMax;
+
+	/// frame rate of channel
+	double m_framesPerSecond;
+
+	/// buffer is gone, replay has ended
+	bool m_ended;
+
+	/// copies data from buffer, see cBufferReceiver::ReadBuffer()
+	int ReadBuffer(uint64_t offset, uchar* data, int maxLength);
+
+	/// finds I frame in buffer, see cBufferReceiver::FindIFrame()
+	bool FindIFrame(int64_t time, bool forward, uint64_t* offset, int* length, int64_t* frameTime);
+
+	/// position of data to play next, see cBufferReceiver::GetFramePosition()
+	bool GetFramePosition(int* frame, int* frameCount, int64_t* time);
+
+	/// shows an I frame as still picture, playing will continue there
+	void ShowIFrame(uint64_t offset, int length, int64_t frameTime);
+
+	/// switches to trick mode in the given direction
+	void StartTrick(bool forward);
+
+	/// logs latency of trick mode steps since trick mode has been started
+	void EndTrick();
+
+	/// plays next piece of data, returns milliseconds to wait (-1 for waiting on device)
+	int PlayStep();
+
+	/// shows next I frame of trick mode, returns milliseconds to wait
+	int TrickStep();
+
+protected:
+
+	/// start or stop replay thread when attached to or detached from device
+	virtual void Activate(bool On);
+
+	/// replay thread
+	virtual void Action();
+
+public:
+
+	/// create player for the given receiver's buffer, starting paused at its newest I frame
+	cBufferPlayer(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver);
+
+	/// stop and destroy player
+	virtual ~cBufferPlayer();
+
+	/// has replay ended because the buffer is gone?
+	bool Ended() { return m_ended; }
+
+	/// play at normal speed
+	void Play();
+
+	/// freeze, or continue playing if already paused
+	void Pause();
+
+	/// fast forward, faster with every call
+	void Forward();
+
+	/// fast rewind, faster with every call
+	void Backward();
+
+	/// jumps the given seconds forward or (if negative) backward
+	void SkipSeconds(int seconds);
+
+	// player overrides
+	virtual double FramesPerSecond() { return m_framesPerSecond; }
+	virtual bool GetIndex(int& Current, int& Total, bool SnapToIFrame = false);
+	virtual bool GetReplayMode(bool& Play, bool& Forward, int& Speed);
+};
+
+
+/// control for replaying a memory buffer
+class cBufferControl : public cControl
+{
+private:
+
+	/// the player
+	cBufferPlayer* m_player;
+
+	/// channel name shown as title
+	cString m_title;
+
+	/// progress display, NULL if hidden
+	cSkinDisplayReplay* m_displayReplay;
+
+	/// hide progress display when timed out
+	cTimeMs m_displayTimeout;
+
+	/// shows or updates progress display
+	void ShowProgress();
+
+public:
+
+	/// create control and player for the given receiver's buffer
+	cBufferControl(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver, bool rewind);
+
+	/// stop replay and destroy control
+	virtual ~cBufferControl();
+
+	// control overrides
+	virtual void Hide();
+	virtual cString GetHeader() { return m_title; }
+	virtual eOSState ProcessKey(eKeys Key);
+};
+
+#endif /* BUFFERPLAYER_H_ */
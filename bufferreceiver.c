@@ -10,22 +10,101 @@
 
 #include <vdr/recording.h>
 #include "permashift.h"
+#include "services.h"
+#include "latencyhistogram.h"
 
 // copied from recording.c
 #define MAXBROKENTIMEOUT 30000 // milliseconds
 
+// frame size of a channel with low bitrate (about 2 MBit/s at 25 fps)
+#define AVERAGE_FRAME_SIZE (10 * 1024)
 
-cBufferReceiver::cBufferReceiver() : cRecorder(NULL, NULL, -1),
+// frames per group of pictures (usual minimum)
+#define AVERAGE_GOP_LENGTH 12
+
+// time stamp steps larger than this (in either direction) are taken as discontinuity
+#define MAX_TIMESTAMP_STEP (10 * TIMESTAMP_FREQUENCY)
+
+// data kept in sync buffer for the frame detector to look ahead,
+// adding some TS packets to make sure it works with as well as without Klaus' patch to remux.c
+#define SYNC_BUFFER_MARGIN ((MIN_TS_PACKETS_FOR_FRAME_DETECTOR + 5) * TS_SIZE)
+
+// size of sync buffer, queueing received data for the analysis thread
+#define SYNC_BUFFER_SIZE (4 * 1024 * 1024)
+
+// buffer data written between commits of buffer file state
+#define BUFFER_FILE_COMMIT_INTERVAL (1024 * 1024)
+
+// data possibly written after a commit before the next one, which the committed state leaves out
+// (one analysis pass may write a whole sync buffer plus injected PAT/PMT packets past the interval)
+#define BUFFER_FILE_MARGIN (BUFFER_FILE_COMMIT_INTERVAL + SYNC_BUFFER_SIZE + 16 * TS_SIZE)
+
+
+/// fetches DTS (or PTS, if there's no DTS) of the first PES packet of the given PID
+/// starting in the given TS data
+static bool GetTimestamp(const uchar* data, int length, int pid, int64_t* timestamp)
+{
+	for (; length >= TS_SIZE; data += TS_SIZE, length -= TS_SIZE)
+	{
+		if (data[0] != TS_SYNC_BYTE || TsPid(data) != pid || !TsPayloadStart(data))
+		{
+			continue;
+		}
+
+		const uchar* pes = data;
+		int pesLength = TsGetPayload(&pes);
+		if (pesLength < 9 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01)
+		{
+			return false;
+		}
+		if (PesHasDts(pes) && pesLength >= 19)
+		{
+			*timestamp = PesGetDts(pes);
+			return true;
+		}
+		if (PesHasPts(pes) && pesLength >= 14)
+		{
+			*timestamp = PesGetPts(pes);
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+
+cBufferReceiver::cBufferReceiver(cSegmentPool* segmentPool, cBufferAnalyzer* analyzer) : cRecorder(NULL, NULL, -1),
  m_channel(NULL),
  m_recordingMode(MemoryRecording),
+ m_filePart(1),
+ m_filePartStart(0),
+ m_lastTimestamp(-1),
+ m_streamTime(0),
+ m_lastReceiveTime(0),
  m_bufferWriter(NULL),
- // adding some TS packets to make sure it works with as well as without Klaus' patch to remux.c 
- m_syncBuffer(1024 * 1024, (MIN_TS_PACKETS_FOR_FRAME_DETECTOR + 5) * TS_SIZE),
+ m_syncBuffer(SYNC_BUFFER_SIZE, SYNC_BUFFER_MARGIN),
+ m_syncBufferHandedOver(false),
+ m_syncBufferOverflows(0),
+ m_analysisLag(0),
+ m_maxAnalysisLag(0),
+ m_receiveCalls(0),
+ m_receiveStart(0),
+ m_lockWaitUs(0),
+ m_switchMs(-1),
  m_saveOnTheFly(false),
+ m_saveMode(smCached),
+ m_saveWorkers(1),
+ m_unwatchedSince(0),
+ m_bufferFile(NULL),
+ m_keepBufferFile(false),
+ m_committedBytes(0),
  m_owner(NULL)
 {
 	dsyslog("permashift: making new empty ring buffer \n");
-	m_ringBuffer = new cOverwritingRingBuffer(0);
+	m_ringBuffer = new cOverwritingRingBuffer(0, segmentPool);
+
+	m_ownAnalyzer = analyzer == NULL;
+	m_analyzer = m_ownAnalyzer ? new cBufferAnalyzer() : analyzer;
 }
 
 cBufferReceiver::~cBufferReceiver()
@@ -36,6 +115,26 @@ cBufferReceiver::~cBufferReceiver()
 	// too late when it's called in cRecorder destructor, then our Activate(false) would not be called anymore...
 	cReceiver::Detach();
 
+	m_analyzer->Remove(this);
+	if (m_ownAnalyzer)
+	{
+		delete m_analyzer;
+	}
+
+	if (m_bufferFile != NULL)
+	{
+		if (m_keepBufferFile && m_recordingMode == MemoryRecording)
+		{
+			// analysis has stopped, everything in the buffer can be committed
+			CommitBufferFile(0);
+			dsyslog("permashift: kept buffer file for resuming\n");
+		}
+		else
+		{
+			m_bufferFile->Remove();
+		}
+	}
+
 	if (m_owner != NULL)
 	{
 		// tell the plugin we're gone
@@ -53,14 +152,140 @@ cBufferReceiver::~cBufferReceiver()
 		delete m_ringBuffer;
 		dsyslog("permashift: deleted ring buffer\n");
 	}
+	// the ring buffer may have been mapped from it
+	delete m_bufferFile;
 	dsyslog("permashift: leaving CBufferReceiver destructor\n");
 }
 
-bool cBufferReceiver::Allocate(uint64_t bufferSize)
+bool cBufferReceiver::Allocate(uint64_t bufferSize, uint64_t spillSize, const char* spillDirectory)
 {
+	// make room for the frames of a low bitrate channel, so the index won't have to grow while receiving
+	m_frameIndex.Reserve(bufferSize / AVERAGE_FRAME_SIZE);
+	m_iFrameIndex.Reserve(bufferSize / AVERAGE_FRAME_SIZE / AVERAGE_GOP_LENGTH);
+
 	// allocate ring buffer, rounding to TS package size
 	dsyslog("permashift: allocating ring buffer memory\n");
-	return m_ringBuffer->Allocate(bufferSize / 188 * 188);
+	if (spillSize > 0)
+	{
+		// only the buffer size is kept in memory, the index grows with the data on disc
+		if (m_ringBuffer->Allocate(bufferSize + spillSize, TS_SIZE) && m_ringBuffer->EnableSpill(spillDirectory, bufferSize))
+		{
+			return true;
+		}
+		esyslog("permashift: could not buffer on disc, buffering in memory only!");
+	}
+	return m_ringBuffer->Allocate(bufferSize, TS_SIZE);
+}
+
+bool cBufferReceiver::MakePersistent(const char* directory)
+{
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	if (m_channel == NULL || m_bufferFile != NULL || m_ringBuffer->Spilling() || m_ringBuffer->BytesWritten() > 0)
+	{
+		return false;
+	}
+
+	// the index can't grow in the file, so make room for twice the frames of a low bitrate channel
+	int indexCapacity = 1;
+	while ((uint64_t)indexCapacity < 2 * m_ringBuffer->Size() / AVERAGE_FRAME_SIZE)
+	{
+		indexCapacity *= 2;
+	}
+
+	cString channelId = m_channel->GetChannelID().ToString();
+	cString fileName = cString::sprintf("%s/%s.buffer", directory, *channelId);
+	cBufferFile* bufferFile = new cBufferFile();
+	if (!bufferFile->Open(fileName, channelId, m_ringBuffer->Size(), indexCapacity) ||
+		!m_ringBuffer->AttachFile(bufferFile->File(), bufferFile->DataOffset()))
+	{
+		esyslog("permashift: could not keep buffer in %s!", *fileName);
+		delete bufferFile;
+		return false;
+	}
+	m_bufferFile = bufferFile;
+	m_frameIndex.Attach(m_bufferFile->IndexMemory(), indexCapacity);
+
+	cBufferFile::tState state;
+	if (m_bufferFile->GetRestorableState(&state))
+	{
+		RestoreBufferFile(state);
+	}
+	m_committedBytes = m_ringBuffer->BytesWritten();
+
+	dsyslog("permashift: keeping buffer in %s\n", *fileName);
+	return true;
+}
+
+void cBufferReceiver::RestoreBufferFile(const cBufferFile::tState& state)
+{
+	if (!m_ringBuffer->Restore(state.dataStart, state.dataLength, state.dataWritten))
+	{
+		esyslog("permashift: buffer file not usable, starting with an empty buffer!");
+		return;
+	}
+	m_frameIndex.Restore(state.indexFirst, state.indexCount);
+
+	// frames may have been added after the last commit, overwriting older ones,
+	// so only the newest frames in order and inside the committed data are kept
+	uint64_t dropped = m_ringBuffer->BytesDropped();
+	int firstValid = 0;
+	for (int frame = 0; frame < m_frameIndex.Count(); frame++)
+	{
+		uint64_t offset = m_frameIndex.Offset(frame);
+		if (offset < dropped || offset >= state.dataWritten ||
+			(frame > firstValid && offset <= m_frameIndex.Offset(frame - 1)))
+		{
+			firstValid = frame + 1;
+		}
+	}
+	m_frameIndex.DropFirst(firstValid);
+
+	m_filePart = state.filePart;
+	m_filePartStart = state.filePartStart;
+	m_streamTime = state.streamTime;
+	// the clock may have been set back in the meantime (reboot)
+	m_lastReceiveTime = min(state.receiveTime, cTimeMs::Now());
+	m_lastTimestamp = -1;
+
+	// I frame lengths aren't kept, collect them again
+	for (int frame = 0; frame < m_frameIndex.Count(); frame++)
+	{
+		if (!m_frameIndex.IFrame(frame)) continue;
+
+		int lastIFrame = m_iFrameIndex.Count() - 1;
+		if (lastIFrame >= 0)
+		{
+			m_iFrameIndex.SetLength(lastIFrame, m_frameIndex.Offset(frame) - m_iFrameIndex.Offset(lastIFrame));
+		}
+		m_iFrameIndex.Add(true, m_frameIndex.Offset(frame), m_frameIndex.Time(frame), m_frameIndex.ReceiveTime(frame));
+	}
+
+	dsyslog("permashift: resumed buffer of %llu MB with %d frames\n",
+		(unsigned long long)(m_ringBuffer->BytesAvailable() / (1024 * 1024)), m_frameIndex.Count());
+}
+
+void cBufferReceiver::CommitBufferFile(uint64_t margin)
+{
+	cBufferFile::tState state;
+	memset(&state, 0, sizeof(state));
+	m_ringBuffer->GetPersistentState(margin, &state.dataStart, &state.dataLength, &state.dataWritten);
+	state.filePartStart = m_filePartStart;
+	state.streamTime = m_streamTime;
+	state.receiveTime = m_lastReceiveTime;
+	state.indexFirst = m_frameIndex.First();
+	state.indexCount = m_frameIndex.Count();
+	state.filePart = m_filePart;
+	m_bufferFile->Commit(state);
+
+	m_committedBytes = m_ringBuffer->BytesWritten();
+}
+
+uint64_t cBufferReceiver::FileBackedBytes()
+{
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	return m_bufferFile != NULL && m_recordingMode == MemoryRecording && m_ringBuffer != NULL ? m_ringBuffer->BytesInMemory() : 0;
 }
 
 void cBufferReceiver::SetOwner(cPluginPermashift* owner)
@@ -85,6 +310,24 @@ void cBufferReceiver::SetSavingOnTheFly(bool saveOnTheFly)
 	}
 }
 
+void cBufferReceiver::SetSaveMode(eSaveMode saveMode)
+{
+	// only allowed to change when still prerecording to memory
+	if (m_recordingMode == MemoryRecording)
+	{
+		m_saveMode = saveMode;
+	}
+}
+
+void cBufferReceiver::SetSaveWorkers(int saveWorkers)
+{
+	// only allowed to change when still prerecording to memory
+	if (m_recordingMode == MemoryRecording)
+	{
+		m_saveWorkers = saveWorkers;
+	}
+}
+
 bool cBufferReceiver::IsPreRecording(const cChannel *Channel)
 {
 	return m_recordingMode == MemoryRecording && m_channel == Channel;
@@ -92,8 +335,15 @@ bool cBufferReceiver::IsPreRecording(const cChannel *Channel)
 
 void cBufferReceiver::Activate(bool On)
 {
-	if (!On)
+	if (On)
+	{
+		m_receiveStart = cTimeMs::Now();
+		m_analyzer->Add(this);
+	}
+	else
 	{
+		m_analyzer->Remove(this);
+
 		// signal to recording thread
 		Cancel(3);
 	}
@@ -105,52 +355,113 @@ void cBufferReceiver::Receive(
 #endif
 				uchar *Data, int Length)
 {
+	LATENCY_PROBE(lpReceive);
+
+	m_receiveCalls++;
+
 	if (m_recordingMode == FileRecording)
 	{
+		if (!m_syncBufferHandedOver)
+		{
+			// data not analyzed before the switch comes first
+			HandOverSyncBuffer();
+		}
+
 		// Use base class to pass data into the recorder buffer.
 		// No need for a mutex lock as we're already in file recording phase.
 		cRecorder::Receive(Data, Length);
 		return;
 	}
-	
-	// memory recording or switching phase
 
-	// lock against phase switching in ActivatePreRecording()
-	m_bufferSwitchMutex.Lock();
+	// memory recording, the data is queued in our sync buffer for the analysis thread
+	if (m_syncBuffer.Put(Data, Length) < Length)
+	{
+		m_syncBufferOverflows++;
+	}
+	if (m_syncBuffer.Available() > SYNC_BUFFER_SIZE / 2)
+	{
+		m_analyzer->Wakeup();
+	}
+}
+
+void cBufferReceiver::Analyze()
+{
+	LATENCY_PROBE(lpAnalyze);
+
+	// lock against phase switching in ActivatePreRecording() and readers of buffer and index
+	uint64_t lockStart = MonotonicNanoSeconds();
+	cMutexLock lock(&m_bufferSwitchMutex);
+	m_lockWaitUs += (MonotonicNanoSeconds() - lockStart) / 1000;
+
+	// after switching, the receiving thread passes the sync buffer on to the recorder
+	if (m_recordingMode == FileRecording || m_channel == NULL) return;
+
+	int lag = m_syncBuffer.Available();
+	m_analysisLag = lag;
+	if (lag > m_maxAnalysisLag)
+	{
+		m_maxAnalysisLag = lag;
+	}
+	int overflows = m_syncBufferOverflows.exchange(0);
+	if (overflows > 0)
+	{
+		esyslog("permashift: analysis too slow, %d blocks of data lost", overflows);
+	}
 
 	// create frame detector at start of memory receiving
 	if (frameDetector == NULL)
 	{
 		frameDetector = new cFrameDetector(m_channel->Vpid(), m_channel->Vtype());
+		m_tsScanner.SetVideoPid(m_channel->Vpid());
+		dsyslog("permashift: scanning TS packets using %s\n", m_tsScanner.Implementation());
 	}
 
-	// route the data through our sync buffer.
-	m_syncBuffer.Put(Data, Length);
-
 	int syncByteCount;
-	uchar *syncBytes = m_syncBuffer.Get(syncByteCount);
-	if (syncBytes != NULL)
+	uchar *syncBytes;
+	while ((syncBytes = m_syncBuffer.Get(syncByteCount)) != NULL)
 	{
-		// fetch analyzed data
-		int Count = frameDetector->Analyze(syncBytes, syncByteCount);
+		// packets the frame detector doesn't need to see go to our ring buffer right away
+		int Count = m_tsScanner.Skippable(syncBytes, syncByteCount);
+		bool analyzed = Count == 0;
+		if (analyzed)
+		{
+			// fetch analyzed data
+			Count = frameDetector->Analyze(syncBytes, syncByteCount);
+			m_tsScanner.Analyzed(syncBytes, Count, frameDetector->Synced(), frameDetector->NewFrame());
+		}
 		if (Count)
 		{
-			// suppose we're not switching to recording phase
-			bool switchToRecorder = false;
-			if (frameDetector->Synced())
+			if (analyzed && frameDetector->Synced())
 			{
 				if (frameDetector->NewFrame())
 				{
-					// if we're asked to switch to disc recording, we do so when synced and at a new I frame
-					if (m_recordingMode == SyncingPhase && frameDetector->Synced() && frameDetector->IndependentFrame())
+					// add new frame information to our index
+					int64_t timestamp = 0;
+					bool hasTimestamp = GetTimestamp(syncBytes, Count, m_channel->Vpid(), &timestamp);
+					uint64_t receiveTime = cTimeMs::Now();
+					uint64_t offset = m_ringBuffer->BytesWritten();
+					int64_t streamTime = NextStreamTime(hasTimestamp, timestamp, receiveTime);
+					m_frameIndex.Add(frameDetector->IndependentFrame(), offset, streamTime, receiveTime);
+
+					// start new file part at first I frame after about a file's size
+					if (frameDetector->IndependentFrame() && offset - m_filePartStart >= VIDEO_FILE_SIZE)
 					{
-						switchToRecorder = true;
+						m_filePart++;
+						m_filePartStart = offset;
 					}
-					else
+					m_frameIndex.SetFileNo(m_frameIndex.Count() - 1, m_filePart);
+
+					// previous I frame is complete now
+					int lastIFrame = m_iFrameIndex.Count() - 1;
+					if (lastIFrame >= 0 && m_iFrameIndex.Length(lastIFrame) == 0)
 					{
-						// otherwise, add new frame information to our index
-						m_frameIndex.Add(new tFrameInfo(frameDetector->IndependentFrame(), m_ringBuffer->BytesWritten()), m_frameIndex.Last());
+						m_iFrameIndex.SetLength(lastIFrame, offset - m_iFrameIndex.Offset(lastIFrame));
 					}
+					if (frameDetector->IndependentFrame())
+					{
+						m_iFrameIndex.Add(true, offset, streamTime, receiveTime);
+					}
+
 					// inject PAT/PMT to our ring buffer at new I frame
 					if (frameDetector->IndependentFrame())
 					{
@@ -165,103 +476,68 @@ void cBufferReceiver::Receive(
 				}
 			}
 
-			if (!switchToRecorder)
-			{
-				// transfer data to our ring buffer
-				m_ringBuffer->WriteData(syncBytes, Count);
-				m_syncBuffer.Del(Count);
+			// transfer data to our ring buffer
+			m_ringBuffer->WriteData(syncBytes, Count);
+			m_syncBuffer.Del(Count);
 
-				// delete frame information for frames just overwritten
-				tFrameInfo* firstFrameInfo = NULL;
-				do
-				{
-					firstFrameInfo = m_frameIndex.First();
-					if (firstFrameInfo == NULL || firstFrameInfo->offset >= m_ringBuffer->BytesDropped())
-					{
-						break;
-					}
-					m_frameIndex.Del(firstFrameInfo);
-				} while (true);
+			// delete frame information for frames just overwritten
+			if (m_frameIndex.Count() > 0 && m_frameIndex.Offset(0) < m_ringBuffer->BytesDropped())
+			{
+				m_frameIndex.DropBefore(m_ringBuffer->BytesDropped());
 			}
-			else
+			if (m_iFrameIndex.Count() > 0 && m_iFrameIndex.Offset(0) < m_ringBuffer->BytesDropped())
 			{
-				// switch to disc recording
-				dsyslog("permashift: ending synchronization phase \n");
-
-				m_recordingMode = FileRecording;
-
-				// prepare buffer writer and index
-				m_bufferWriter->Initialize();
-
-				// write index file
-				tFrameInfo* frameInfo = m_frameIndex.First();
-				uint64_t firstByte = frameInfo->offset;
-				unsigned int currentFileNo = 0;
-				while (frameInfo != NULL)
-				{
-					if (frameInfo->fileNo > currentFileNo)
-					{
-						currentFileNo = frameInfo->fileNo;
-						firstByte = frameInfo->offset;
-					}
-					index->Write(frameInfo->iFrame, frameInfo->fileNo, frameInfo->offset - firstByte);
-					frameInfo = (tFrameInfo*)frameInfo->Next();
-				}
-
-				// write (whole or parts of) buffer
-				if (m_saveOnTheFly)
-				{
-					m_bufferWriter->SaveFile();
-				}
-				else
-				{
-					m_bufferWriter->SaveAll();
-				}
-
-				// start recorder thread
-				Start();
-
-				// move rest of sync buffer to recorder buffer
-				int r;
-				uchar *b = NULL;
-				do
-				{
-					b = m_syncBuffer.GetRest(r);
-					if (b != NULL)
-					{
-						cRecorder::Receive(b, r);
-						m_syncBuffer.Del(r);
-					}
-				} while (b != NULL && r > 0);
-
-				dsyslog("permashift: signaling end of synchronization phase \n");
+				m_iFrameIndex.DropBefore(m_ringBuffer->BytesDropped());
+			}
 
-				// signal end of sync phase
-				m_syncCondition.Signal();
+			if (m_bufferFile != NULL && m_ringBuffer->BytesWritten() - m_committedBytes >= BUFFER_FILE_COMMIT_INTERVAL)
+			{
+				CommitBufferFile(BUFFER_FILE_MARGIN);
 			}
 		}
+		else
+		{
+			break;
+		}
 	}
-
-	m_bufferSwitchMutex.Unlock();
 }
 
 // copied from recorder.c with minimal changes,
 // except added live buffer saving
 void cBufferReceiver::Action()
 {
+	// take over memory recording
+	if (m_ringBuffer != NULL && m_bufferWriter != NULL)
+	{
+		if (m_bufferWriter->Initialize() && index != NULL)
+		{
+			m_bufferWriter->WriteIndex(index, recordingName);
+		}
+
+		// save newest file right away, replay is likely to start there
+		// (saving all of it is left to the loop below, so live data won't pile up meanwhile)
+		if (m_saveOnTheFly)
+		{
+			m_bufferWriter->SaveFile();
+		}
+	}
+
+	// on the fly, ActivatePreRecording() may return now, otherwise once all of the buffer has been saved
+	bool syncSignaled = false;
+	if (m_saveOnTheFly || m_ringBuffer == NULL || m_bufferWriter == NULL)
+	{
+		dsyslog("permashift: signaling end of synchronization phase \n");
+		m_syncCondition.Signal();
+		syncSignaled = true;
+	}
+
 	cTimeMs t(MAXBROKENTIMEOUT);
 	bool InfoWritten = false;
 	bool FirstIframeSeen = true;
-	int liveByteCount = 0;
-	int liveBytesProcessed = 0;
 	while (Running()) {
 		int r;
 		uchar *b = ringBuffer->Get(r);
 		if (b) {
-			if (liveByteCount == 0) {
-				liveByteCount = r;
-				}
-
 			int Count = frameDetector->Analyze(b, r);
 			if (Count) {
 				if (!Running() && frameDetector->IndependentFrame()) // finish the recording before the next independent frame
@@ -309,77 +585,235 @@ void cBufferReceiver::Action()
 						}
 					}
 				ringBuffer->Del(Count);
-				liveBytesProcessed += Count;
 				}
 			}
 
-		// if we still got live buffer to save, do so when 75% of the bytes seen in live data have been processed
-		if (m_ringBuffer != NULL && m_bufferWriter != NULL && !m_bufferWriter->Finished() && liveBytesProcessed >= 0.75 * liveByteCount)
+		if (m_ringBuffer != NULL && m_bufferWriter != NULL)
 		{
-			dsyslog("permashift: saving chunk of buffer (%d of %d live bytes processed)", liveBytesProcessed, liveByteCount);
-
-			// save some data
-			m_bufferWriter->SaveChunk();
-
-			// reset our live bytes counter
-			liveBytesProcessed = 0;
-			liveByteCount = 0;
-
-			if (m_bufferWriter->Finished())
+			if (m_saveOnTheFly)
 			{
-				dsyslog("permashift: RAM recording fully saved. Deleting ring buffer.");
-				delete m_ringBuffer;
-				m_ringBuffer = NULL;
+				// save buffer as fast as the disc allows without holding up live recording
+				m_bufferWriter->SavePaced(ringBuffer->Available(), ringBuffer->Size());
+			}
+			else
+			{
+				// rewinding waits for the buffer, so save it as fast as the engine takes it,
+				// until there's live data for the recorder to go on with
+				while (m_bufferWriter->SaveAll() && ringBuffer->Available() < MIN_TS_PACKETS_FOR_FRAME_DETECTOR * TS_SIZE)
+				{
+				}
 			}
 		}
 
+		// give buffer memory back to the pool as soon as everything has been saved
+		if (m_ringBuffer != NULL && m_bufferWriter != NULL && m_bufferWriter->Finished())
+		{
+			dsyslog("permashift: RAM recording fully saved. Deleting ring buffer.");
+			delete m_ringBuffer;
+			m_ringBuffer = NULL;
+		}
+		if (!syncSignaled && m_ringBuffer == NULL)
+		{
+			dsyslog("permashift: signaling end of synchronization phase \n");
+			m_syncCondition.Signal();
+			syncSignaled = true;
+		}
+
         if (t.TimedOut()) {
 			esyslog("ERROR: video data stream broken");
 			ShutdownHandler.RequestEmergencyExit();
 			t.Set(MAXBROKENTIMEOUT);
 			}
 		}
+
+	// don't leave ActivatePreRecording() waiting if recording ended before the buffer was saved
+	if (!syncSignaled)
+	{
+		m_syncCondition.Signal();
+	}
 }
 
 bool cBufferReceiver::ActivatePreRecording(const char* fileName, int priority)
 {
-	bool retVal = true;
+	LATENCY_PROBE(lpActivate);
 
 	if (fileName == NULL) return false;
 
+	cTimeMs activationTime;
+
 	// sync against data receiving method
 	m_bufferSwitchMutex.Lock();
 
 	dsyslog("permashift: usage of preliminary RAM recording activated \n");
 
+	// the buffer becomes part of the recording, there's nothing to resume anymore
+	if (m_bufferFile != NULL)
+	{
+		m_bufferFile->Remove();
+	}
+
+	// the buffer up to its newest I frame is kept as it is, to be saved by the recorder thread,
+	// the recorder starts at that I frame (or with the data to come, if there's none)
+	int newestIFrame = m_frameIndex.Count() - 1;
+	while (newestIFrame >= 0 && !m_frameIndex.IFrame(newestIFrame))
+	{
+		newestIFrame--;
+	}
+	uint64_t switchOffset = newestIFrame >= 0 ? m_frameIndex.Offset(newestIFrame) : m_ringBuffer->BytesWritten();
+	m_frameIndex.DropLast(m_frameIndex.Count() - max(newestIFrame, 0));
+
+	// the I frame's offset has been taken before injecting PAT and PMT
+	int patPmtLength = 0;
+	if (newestIFrame >= 0)
+	{
+		cPatPmtGenerator patPmtGenerator(m_channel);
+		patPmtLength = TS_SIZE;
+		int Index = 0;
+		while (patPmtGenerator.GetPmt(Index) != NULL)
+		{
+			patPmtLength += TS_SIZE;
+		}
+	}
+
 	// initialize our writer (which will create all video files needed for saving)
-	m_bufferWriter = new cBufferWriter(m_ringBuffer, &m_frameIndex, fileName, m_saveOnTheFly);
+	m_bufferWriter = new cBufferWriter(m_ringBuffer, &m_frameIndex, fileName, m_saveOnTheFly, m_saveMode, m_saveWorkers);
 
 	// initialize our recorder (writing to first free file number)
 	dsyslog("permashift: starting disk recording of live video to come \n");
 	InitializeFile(fileName, m_channel);
 	cReceiver::SetPriority(priority);
 
-	// starting sync phase
-	dsyslog("permashift: starting synchronization phase \n");
+	HandOverData(switchOffset, patPmtLength);
 
-	m_recordingMode = SyncingPhase;
+	// start recorder thread, which will take over the buffer,
+	// and let the receiving thread pass data to it from now on
+	Start();
+	m_recordingMode = FileRecording;
 
 	m_bufferSwitchMutex.Unlock();
 
-	// wait for synchronization to finish
+	// wait for synchronization to finish and the newest file (or all of the buffer) to be saved,
+	// so replay of the recording finds its data on disc
 	m_syncCondition.Wait(0);
 
-	dsyslog("permashift: end of synchronization phase acknowledged \n");
+	m_switchMs = activationTime.Elapsed();
+	dsyslog("permashift: switched to disk recording in %d ms\n", (int)m_switchMs);
+
+	return true;
+}
+
+void cBufferReceiver::HandOverData(uint64_t offset, int skip)
+{
+	// buffer data from offset on
+	uint64_t start = min(offset + skip, m_ringBuffer->BytesWritten()) - m_ringBuffer->BytesDropped();
+	uint64_t length = m_ringBuffer->BytesAvailable() - start;
+	int pin = m_ringBuffer->PinData(start, length);
+	uint64_t handedOver = 0;
+	while (pin >= 0 && handedOver < length)
+	{
+		uchar* data;
+		uint64_t dataLength = m_ringBuffer->PinnedData(pin, handedOver, &data, length - handedOver);
+		if (ringBuffer->Put(data, dataLength) < (int)dataLength)
+		{
+			esyslog("permashift: recorder buffer overflow while switching to disk recording");
+			break;
+		}
+		handedOver += dataLength;
+	}
+	m_ringBuffer->Unpin(pin);
+
+	// cut buffer there
+	m_ringBuffer->Truncate(offset);
+}
+
+void cBufferReceiver::HandOverSyncBuffer()
+{
+	int r;
+	uchar *b = NULL;
+	do
+	{
+		b = m_syncBuffer.GetRest(r);
+		if (b != NULL)
+		{
+			cRecorder::Receive(b, r);
+			m_syncBuffer.Del(r);
+		}
+	} while (b != NULL && r > 0);
+	m_syncBufferHandedOver = true;
+}
+
+int64_t cBufferReceiver::NextStreamTime(bool hasTimestamp, int64_t timestamp, uint64_t receiveTime)
+{
+	if (m_lastReceiveTime == 0)
+	{
+		// first frame, start stream time at 0
+		m_lastTimestamp = hasTimestamp ? timestamp : -1;
+		m_lastReceiveTime = receiveTime;
+		m_streamTime = 0;
+		return m_streamTime;
+	}
+
+	int64_t step = -1;
+	if (hasTimestamp && m_lastTimestamp >= 0)
+	{
+		step = PtsDiff(m_lastTimestamp, timestamp);
+		if (step < -MAX_TIMESTAMP_STEP || step > MAX_TIMESTAMP_STEP)
+		{
+			dsyslog("permashift: time stamp discontinuity (%lld ticks)\n", (long long)step);
+			step = -1;
+			m_lastTimestamp = timestamp;
+		}
+		else if (step < 0)
+		{
+			// presentation order of a stream without DTS, time doesn't advance
+			step = 0;
+		}
+		else
+		{
+			m_lastTimestamp = timestamp;
+		}
+	}
+	else if (hasTimestamp)
+	{
+		m_lastTimestamp = timestamp;
+	}
+
+	if (step < 0)
+	{
+		// no usable time stamp, estimate the frame's duration
+		if (frameDetector != NULL && frameDetector->FramesPerSecond() > 0)
+		{
+			step = TIMESTAMP_FREQUENCY / frameDetector->FramesPerSecond();
+		}
+		else
+		{
+			step = (receiveTime - m_lastReceiveTime) * (TIMESTAMP_FREQUENCY / 1000);
+		}
+	}
 
-	return retVal;
+	m_lastReceiveTime = receiveTime;
+	m_streamTime += step;
+	return m_streamTime;
 }
 
 bool cBufferReceiver::GetUsedBufferSecs(int* secs)
 {
 	if (secs == NULL) return false;
 
-	// if we have got enough information, return number of frames in RAM divided by frames per second of video
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	// the index belongs to the recorder thread once the buffer is being saved
+	if (m_recordingMode != MemoryRecording) return false;
+
+	// if we have got time stamps, return time between oldest and newest frame
+	int frameCount = m_frameIndex.Count();
+	if (frameCount > 1 && m_frameIndex.Time(frameCount - 1) > m_frameIndex.Time(0))
+	{
+		*secs = (m_frameIndex.Time(frameCount - 1) - m_frameIndex.Time(0)) / TIMESTAMP_FREQUENCY;
+		return true;
+	}
+
+	// otherwise, return number of frames in RAM divided by frames per second of video
 	if (m_frameIndex.Count() > 0 && frameDetector != NULL && frameDetector->FramesPerSecond() > 0)
 	{
 		*secs = m_frameIndex.Count() / frameDetector->FramesPerSecond();
@@ -388,3 +822,186 @@ bool cBufferReceiver::GetUsedBufferSecs(int* secs)
 	// We leave secs as it is if we haven't got anything useful ro return.
 	return false;
 }
+
+bool cBufferReceiver::TimeToOffset(double secondsBack, uint64_t* offset, int* frame)
+{
+	if (offset == NULL || frame == NULL) return false;
+
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	// only the buffer of a pre-recording is kept unchanged for seeking
+	int frameCount = m_frameIndex.Count();
+	if (m_recordingMode != MemoryRecording || frameCount == 0) return false;
+
+	int64_t time = m_frameIndex.Time(frameCount - 1) - (int64_t)(secondsBack * TIMESTAMP_FREQUENCY);
+	*frame = min(m_frameIndex.FindTime(time), frameCount - 1);
+	*offset = m_frameIndex.Offset(*frame);
+	return true;
+}
+
+bool cBufferReceiver::OffsetToTime(uint64_t offset, double* secondsBack, int* frame)
+{
+	if (secondsBack == NULL || frame == NULL) return false;
+
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	int frameCount = m_frameIndex.Count();
+	if (m_recordingMode != MemoryRecording || frameCount == 0) return false;
+
+	// last frame starting at or before offset
+	int found = m_frameIndex.Find(offset + 1) - 1;
+	if (found < 0 || offset >= m_ringBuffer->BytesWritten()) return false;
+
+	*frame = found;
+	*secondsBack = (double)(m_frameIndex.Time(frameCount - 1) - m_frameIndex.Time(found)) / TIMESTAMP_FREQUENCY;
+	return true;
+}
+
+bool cBufferReceiver::GetClipFrames(double secondsBack, double seconds, cFrameIndex* clipIndex, uint64_t* endOffset)
+{
+	if (clipIndex == NULL || endOffset == NULL) return false;
+
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	int frameCount = m_frameIndex.Count();
+	if (m_recordingMode != MemoryRecording || frameCount < 2) return false;
+
+	// last frame at or before start time, back to its I frame (or on to the oldest one)
+	int64_t startTime = m_frameIndex.Time(frameCount - 1) - (int64_t)(secondsBack * TIMESTAMP_FREQUENCY);
+	int first = m_frameIndex.FindTime(startTime);
+	if (first > 0 && (first == frameCount || m_frameIndex.Time(first) > startTime))
+	{
+		first--;
+	}
+	while (first > 0 && !m_frameIndex.IFrame(first))
+	{
+		first--;
+	}
+	while (first < frameCount - 1 && !m_frameIndex.IFrame(first))
+	{
+		first++;
+	}
+
+	int end = frameCount - 1;
+	if (seconds > 0)
+	{
+		end = min(m_frameIndex.FindTime(m_frameIndex.Time(first) + (int64_t)(seconds * TIMESTAMP_FREQUENCY)), end);
+	}
+	if (first >= end || !clipIndex->Reserve(end - first)) return false;
+
+	clipIndex->Clear();
+	for (int frame = first; frame < end; frame++)
+	{
+		clipIndex->Add(m_frameIndex.IFrame(frame), m_frameIndex.Offset(frame), m_frameIndex.Time(frame), m_frameIndex.ReceiveTime(frame));
+	}
+	*endOffset = m_frameIndex.Offset(end);
+	return true;
+}
+
+int cBufferReceiver::ReadBuffer(uint64_t offset, uchar* data, int maxLength)
+{
+	if (data == NULL) return -1;
+
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	if (m_recordingMode != MemoryRecording || offset < m_ringBuffer->BytesDropped()) return -1;
+
+	return m_ringBuffer->CopyData(offset, data, maxLength);
+}
+
+bool cBufferReceiver::FindIFrame(int64_t time, bool forward, uint64_t* offset, int* length, int64_t* frameTime)
+{
+	if (offset == NULL || length == NULL || frameTime == NULL) return false;
+
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	int frameCount = m_iFrameIndex.Count();
+	if (m_recordingMode != MemoryRecording || frameCount == 0) return false;
+
+	int frame = m_iFrameIndex.FindTime(time);
+	if (!forward && (frame == frameCount || m_iFrameIndex.Time(frame) > time))
+	{
+		frame--;
+	}
+
+	// the newest I frame may not be complete yet
+	if (frame < 0 || frame >= frameCount || m_iFrameIndex.Length(frame) == 0) return false;
+
+	*offset = m_iFrameIndex.Offset(frame);
+	*length = m_iFrameIndex.Length(frame);
+	*frameTime = m_iFrameIndex.Time(frame);
+	return true;
+}
+
+bool cBufferReceiver::GetFramePosition(uint64_t offset, int* frame, int* frameCount, int64_t* time)
+{
+	if (frame == NULL || frameCount == NULL || time == NULL) return false;
+
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	*frameCount = m_frameIndex.Count();
+	if (m_recordingMode != MemoryRecording || *frameCount == 0) return false;
+
+	// last frame starting at or before offset, or oldest frame if offset has already been dropped
+	*frame = max(m_frameIndex.Find(offset + 1) - 1, 0);
+	*time = m_frameIndex.Time(*frame);
+	return true;
+}
+
+uint64_t cBufferReceiver::BufferedBytes()
+{
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	return m_recordingMode == MemoryRecording && m_ringBuffer != NULL ? m_ringBuffer->BytesAvailable() : 0;
+}
+
+void cBufferReceiver::GetStats(Permashift_Stats_v1* stats)
+{
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	stats->channelNumber = m_channel != NULL ? m_channel->Number() : 0;
+
+	// the buffer belongs to the recorder thread once it's being saved
+	if (m_recordingMode == MemoryRecording)
+	{
+		stats->bytesWritten = m_ringBuffer->BytesWritten();
+		stats->bytesDropped = m_ringBuffer->BytesDropped();
+		stats->bytesAvailable = m_ringBuffer->BytesAvailable();
+		stats->bytesInMemory = m_ringBuffer->BytesInMemory();
+		stats->frames = m_frameIndex.Count();
+		stats->iFrames = m_iFrameIndex.Count();
+
+		int frameCount = m_frameIndex.Count();
+		if (frameCount > 1 && m_frameIndex.Time(frameCount - 1) > m_frameIndex.Time(0))
+		{
+			stats->fillSecs = (double)(m_frameIndex.Time(frameCount - 1) - m_frameIndex.Time(0)) / TIMESTAMP_FREQUENCY;
+			stats->bitrate = (m_frameIndex.Offset(frameCount - 1) - m_frameIndex.Offset(0)) * 8 / stats->fillSecs;
+		}
+	}
+
+	uint64_t receiving = m_receiveStart != 0 ? cTimeMs::Now() - m_receiveStart : 0;
+	if (receiving > 0)
+	{
+		stats->receiveCallsPerSec = m_receiveCalls * 1000.0 / receiving;
+	}
+	stats->analysisLag = m_analysisLag;
+	stats->maxAnalysisLag = m_maxAnalysisLag;
+	stats->lockWaitUs = m_lockWaitUs;
+	stats->switchMs = m_switchMs;
+
+	if (m_bufferWriter != NULL)
+	{
+		m_bufferWriter->GetProgress(&stats->bytesToSave, &stats->bytesSaved, &stats->saveMBPerSec);
+	}
+}
+
+double cBufferReceiver::FramesPerSecond()
+{
+	cMutexLock lock(&m_bufferSwitchMutex);
+
+	if (frameDetector != NULL && frameDetector->FramesPerSecond() > 0)
+	{
+		return frameDetector->FramesPerSecond();
+	}
+	return DEFAULTFRAMESPERSECOND;
+}
@@ -2,29 +2,18 @@
 #define BUFFERRECEIVER_H
 
 #include "overwritingringbuffer.h"
+#include "frameindex.h"
 #include "bufferwriter.h"
+#include "tsscanner.h"
+#include "bufferanalyzer.h"
+#include "bufferfile.h"
 
 #include <vdr/recorder.h>
+#include <atomic>
 
 
 class cPluginPermashift;
-
-/// frame index data
-class tFrameInfo : public cListObject
-{
-public:
-
-	bool iFrame;		 ///< I frame or not
-	uint64_t offset;	 ///< offset, relative to first data written to buffer
-	unsigned int fileNo; ///< file number to write to (if splitting)
-
-	tFrameInfo(bool iFrame, uint64_t offset)
-	{
-		this->iFrame = iFrame;
-		this->offset = offset;
-		fileNo = 1;
-	}
-};
+struct Permashift_Stats_v1;
 
 /// recorder class using buffer, or file after switch
 class cBufferReceiver : public cRecorder
@@ -33,48 +22,125 @@ private:
 
 	/// syncs receive method vs. activation of file recording
 	cMutex m_bufferSwitchMutex;
-	
-	/// used by ActivatePreRecording() to wait for end of buffer switching and parts of file to be saved
+
+	/// used by ActivatePreRecording() to wait for the recorder thread to save the newest file (or all of them)
 	cCondWait m_syncCondition;
 
 	/// channel to record
 	const cChannel *m_channel;
 
 	/// phase of recording
-	enum
+	enum eRecordingMode
 	{
 		MemoryRecording,	///< recording to memory
-		SyncingPhase,		///< switching to file recording
 		FileRecording		///< recording to file
-	} m_recordingMode;
+	};
+
+	/// current phase, switched once (under m_bufferSwitchMutex) and read by the receiving thread without locking
+	std::atomic<eRecordingMode> m_recordingMode;
 
 	/// data container class
 	cOverwritingRingBuffer *m_ringBuffer;
 
-	/// list of frame information data for frames in buffer
-	/// (dropped frames will be dropped from this list as well)
-	cList<tFrameInfo> m_frameIndex;
+	/// index of frames in buffer
+	/// (dropped frames will be dropped from this index as well)
+	/// while recording to memory, file numbers count parts of the index, see m_filePart
+	cFrameIndex m_frameIndex;
+
+	/// part of index new frames belong to, a new part starts at the first I frame
+	/// after about a file's size, so frames are assigned to files as they arrive
+	uint16_t m_filePart;
+
+	/// buffer offset of first frame of current part
+	uint64_t m_filePartStart;
+
+	/// index of I frames in buffer, with their lengths once complete
+	/// (for jumping from GOP to GOP without looking at other frames)
+	cFrameIndex m_iFrameIndex;
+
+	/// last time stamp (DTS or PTS) the stream time has been taken from, -1 if none yet
+	int64_t m_lastTimestamp;
+
+	/// stream time of newest frame (90 kHz, starting at 0, never decreasing)
+	int64_t m_streamTime;
+
+	/// system time newest frame has been received at (ms)
+	uint64_t m_lastReceiveTime;
 
 	/// used to write buffer to file
 	cBufferWriter* m_bufferWriter;
 
-	/// used for keeping TS data in synchronization phase
+	/// queues TS data until it has been analyzed
+	/// (filled by the receiving thread, emptied by the analysis thread without locking,
+	/// or by the receiving thread after switching to file recording)
 	cRingBufferLinear m_syncBuffer;
 
+	/// finds packets in sync buffer the frame detector has to look at
+	cTsScanner m_tsScanner;
+
+	/// data left in sync buffer has been passed to the recorder after switching
+	bool m_syncBufferHandedOver;
+
+	/// number of times received data didn't fit into sync buffer
+	std::atomic<int> m_syncBufferOverflows;
+
+	/// thread analyzing received data
+	cBufferAnalyzer* m_analyzer;
+
+	/// analyzer has been created by us
+	bool m_ownAnalyzer;
+
+	/// bytes waiting for analysis at last and at worst analysis pass
+	std::atomic<int> m_analysisLag;
+	std::atomic<int> m_maxAnalysisLag;
+
+	/// calls of Receive() since receiving started, and its start time (ms, see cTimeMs::Now())
+	std::atomic<uint64_t> m_receiveCalls;
+	uint64_t m_receiveStart;
+
+	/// total time the analysis waited for m_bufferSwitchMutex (microseconds)
+	std::atomic<uint64_t> m_lockWaitUs;
+
+	/// time taken to switch to disk recording, including waiting for the analysis
+	/// and for the newest file (or all of the buffer) to be saved (ms), -1 if not switched
+	std::atomic<int> m_switchMs;
+
 	// option: should saving be done on-the-fly?
 	bool m_saveOnTheFly;
 
+	// option: how should saved data get to disc?
+	eSaveMode m_saveMode;
+
+	// option: how many files should be saved in parallel?
+	int m_saveWorkers;
+
+	/// time live view switched away from our channel (ms, see cTimeMs::Now()), 0 while it's watched
+	uint64_t m_unwatchedSince;
+
+	/// file keeping buffer and index across restarts, NULL if not persistent
+	cBufferFile* m_bufferFile;
+
+	/// buffer file is kept for resuming when we're deleted, rather than removed
+	bool m_keepBufferFile;
+
+	/// bytes written to buffer at last commit to buffer file
+	uint64_t m_committedBytes;
+
 	/// our owner, which needs to be informed when we're deleted
 	/// (probably not a good design...)
 	cPluginPermashift* m_owner;
 
 public:
 
-	cBufferReceiver();
+	/// buffer memory is taken from the given pool, or from a private one,
+	/// received data is analyzed by the given analyzer, or by a private one
+	cBufferReceiver(cSegmentPool* segmentPool = NULL, cBufferAnalyzer* analyzer = NULL);
 	~cBufferReceiver();
 
 	/// try to allocate the buffer, returns false if failed
-	bool Allocate(uint64_t bufferSize);
+	/// with a spill size, older data beyond the buffer size is evicted to a file in the given directory
+	/// (falling back to the buffer size in memory only if that's not possible)
+	bool Allocate(uint64_t bufferSize, uint64_t spillSize = 0, const char* spillDirectory = NULL);
 
 	/// set channel to receive
 	void SetChannel(const cChannel *channel);
@@ -82,6 +148,12 @@ public:
 	/// sets saving on the fly (only works as long as the recording has not been used)
 	void SetSavingOnTheFly(bool saveOnTheFly);
 
+	/// sets how saved data gets to disc (only works as long as the recording has not been used)
+	void SetSaveMode(eSaveMode saveMode);
+
+	/// sets number of files saved in parallel (only works as long as the recording has not been used)
+	void SetSaveWorkers(int saveWorkers);
+
 	/// connect to our owning class
 	void SetOwner(cPluginPermashift* owner);
 
@@ -91,12 +163,75 @@ public:
 	/// is receiver recording the given channel (and has not yet been used as recording)?
 	bool IsPreRecording(const cChannel *Channel);
 
+	/// channel being received
+	const cChannel* Channel() { return m_channel; }
+
+	/// sets whether our channel is watched live
+	void SetWatched(bool watched) { m_unwatchedSince = watched ? 0 : cTimeMs::Now(); }
+
+	/// time live view switched away from our channel (ms, see cTimeMs::Now()), 0 while it's watched
+	uint64_t UnwatchedSince() { return m_unwatchedSince; }
+
+	/// bytes of video in buffer
+	uint64_t BufferedBytes();
+
+	/// keeps buffer and frame index in a file in the given directory (named by channel),
+	/// resuming with the history found there if it's been kept for our channel
+	/// (to be called after Allocate() and SetChannel(), before receiving)
+	bool MakePersistent(const char* directory);
+
+	/// keeps buffer file for resuming when we're deleted (VDR shutting down)
+	void KeepBufferFile() { m_keepBufferFile = true; }
+
+	/// bytes of buffer memory mapped from the buffer file (not taken from the segment pool)
+	uint64_t FileBackedBytes();
+
 	/// saves the buffer contents to file and starts recording of future data
+	/// (returns once the newest file is saved, or all of them if not saving on the fly,
+	/// the rest is saved in the background)
 	bool ActivatePreRecording(const char* fileName, int Priority);
 
 	/// queries seconds of video recorded at the moment
 	bool GetUsedBufferSecs(int* secs);
 
+	/// finds frame being the given seconds before the newest one
+	/// returns its buffer offset (counting all bytes ever written) and frame number (0 being the oldest)
+	bool TimeToOffset(double secondsBack, uint64_t* offset, int* frame);
+
+	/// finds frame containing the given buffer offset
+	/// returns seconds it is before the newest frame and its frame number
+	bool OffsetToTime(uint64_t offset, double* secondsBack, int* frame);
+
+	/// copies the frames of a clip to the given index, starting at the I frame at or before
+	/// the given seconds before the newest frame and lasting the given seconds (0 for up to the newest frame),
+	/// the newest frame being left out as it may not be complete; returns the buffer offset the clip ends at
+	bool GetClipFrames(double secondsBack, double seconds, cFrameIndex* clipIndex, uint64_t* endOffset);
+
+	/// copies buffer data starting at the given offset, for playing it while still receiving
+	/// returns bytes copied, 0 if there's no data at offset yet, -1 if it's not in buffer (any more)
+	int ReadBuffer(uint64_t offset, uchar* data, int maxLength);
+
+	/// finds a completely received I frame (by binary search in I frame index), going forward
+	/// the first one at or after the given stream time, otherwise the last one at or before it
+	bool FindIFrame(int64_t time, bool forward, uint64_t* offset, int* length, int64_t* frameTime);
+
+	/// position of the frame containing the given buffer offset:
+	/// its frame number, the number of frames in buffer and its stream time
+	bool GetFramePosition(uint64_t offset, int* frame, int* frameCount, int64_t* time);
+
+	/// frame rate of channel (default rate if not known yet)
+	double FramesPerSecond();
+
+	/// analyzes data received in the meantime, moving it to the buffer
+	/// (called by the analysis thread)
+	void Analyze();
+
+	/// bytes received but not analyzed yet, at the last analysis and at worst
+	void GetAnalysisLag(int* lag, int* maxLag) { *lag = m_analysisLag; *maxLag = m_maxAnalysisLag; }
+
+	/// fills in statistics of buffer, analysis and saving (except those of the plugin)
+	void GetStats(Permashift_Stats_v1* stats);
+
 protected:
 
 	/// receiver (de-)activation
@@ -114,6 +249,24 @@ private:
 	// receiving thread when recording to file
 	void Action();
 
+	/// hands buffer data from the given offset on over to the recorder, cutting the buffer at the offset;
+	/// leaves out the given bytes at offset
+	/// (PAT and PMT injected in front of an I frame, as the recorder writes its own)
+	void HandOverData(uint64_t offset, int skip);
+
+	/// passes data left in sync buffer (not analyzed yet) to the recorder
+	void HandOverSyncBuffer();
+
+	/// advances stream time for a new frame, bridging time stamp wrap arounds and discontinuities
+	int64_t NextStreamTime(bool hasTimestamp, int64_t timestamp, uint64_t receiveTime);
+
+	/// commits state of buffer and index to buffer file, leaving out data that
+	/// may be overwritten by the given number of bytes until the next commit
+	void CommitBufferFile(uint64_t margin);
+
+	/// takes buffer and index state found in buffer file
+	void RestoreBufferFile(const cBufferFile::tState& state);
+
 };
 
 #endif // BUFFERRECEIVER_H
@@ -0,0 +1,616 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Replay of a transport stream through cBufferReceiver, built without VDR ("make replay").
+//
+// The stream is passed to the receiver like a device would, at a given multiple of
+// real time (taken from the video time stamps). At the given stream times the buffer
+// is turned into a recording, which goes on for a while and is stopped once the buffer
+// has been saved, then buffering starts over. This runs the whole memory to disc path
+// on any Linux box, with VDR's frame detector, recorder and files replaced by the
+// simpler ones in stubs/vdr.
+//
+// Each activation prints a line of JSON with the buffer's fill, each recording one
+// with the activation's latency and how long saving the buffer took. A last line sums
+// up CPU time per hour of stream, allocations and memory used.
+// CPU time and allocations include the replay itself reading and pacing the stream.
+
+#include "bufferreceiver.h"
+#include "bufferanalyzer.h"
+#include "segmentpool.h"
+#include "services.h"
+#include "latencyhistogram.h"
+#include "permashift.h"
+
+#include <vdr/device.h>
+#include <getopt.h>
+#include <atomic>
+#include <sys/resource.h>
+
+// most activations in a list option
+#define MAX_ACTIVATIONS 64
+
+// stream read at once (about 1 MB)
+#define READ_PACKETS 5577
+
+// packets passed to the device at once, as a DVB device's buffer would deliver them
+#define DEVICE_PACKETS 64
+
+// steps in stream time larger than this are taken as discontinuity (90 kHz)
+#define MAX_CLOCK_STEP (10 * TIMESTAMP_FREQUENCY)
+
+// longest wait for the buffer to be saved after a recording (ms)
+#define SAVE_TIMEOUT_MS 600000
+
+// priority of recordings
+#define RECORDING_PRIORITY 50
+
+
+cShutdownHandler ShutdownHandler;
+
+/// the replay's receivers have no plugin to tell
+void cPluginPermashift::BufferDeleted(cBufferReceiver* callingReceiver)
+{
+}
+
+
+/// allocations from the heap, counted by replacing glibc's functions
+static std::atomic<uint64_t> s_allocations(0);
+static std::atomic<uint64_t> s_allocatedBytes(0);
+
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* memory, size_t size);
+void __libc_free(void* memory);
+
+void* malloc(size_t size) noexcept
+{
+	s_allocations.fetch_add(1, std::memory_order_relaxed);
+	s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+	s_allocations.fetch_add(1, std::memory_order_relaxed);
+	s_allocatedBytes.fetch_add(count * size, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* memory, size_t size) noexcept
+{
+	s_allocations.fetch_add(1, std::memory_order_relaxed);
+	s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	return __libc_realloc(memory, size);
+}
+
+void free(void* memory) noexcept
+{
+	__libc_free(memory);
+}
+}
+
+
+/// options
+static const char* s_label = NULL;
+static double s_speed = 10;
+static uint64_t s_bufferSize = 100ull << 20;
+static double s_recordSecs = 10;
+static eSaveMode s_saveMode = smCached;
+static int s_saveWorkers = 1;
+static bool s_saveOnTheFly = false;
+
+
+static double CpuSeconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+/// transport stream file, read packet by packet and timed by its video time stamps
+class cStreamFile
+{
+private:
+	int m_file;
+	uchar* m_data;
+	int m_length;
+	int m_position;
+	int m_videoPid;
+	int64_t m_lastTimestamp;
+	int64_t m_streamTime;
+
+public:
+	cStreamFile() : m_file(-1), m_length(0), m_position(0), m_videoPid(0), m_lastTimestamp(-1), m_streamTime(0)
+	{
+		m_data = MALLOC(uchar, READ_PACKETS * TS_SIZE);
+	}
+
+	~cStreamFile()
+	{
+		if (m_file >= 0) close(m_file);
+		free(m_data);
+	}
+
+	bool Open(const char* fileName)
+	{
+		m_file = open(fileName, O_RDONLY);
+		if (m_file < 0)
+		{
+			esyslog("could not open %s (%d)", fileName, errno);
+			return false;
+		}
+		return true;
+	}
+
+	/// starts over at the beginning, timing the stream by the given video PID
+	void Rewind(int videoPid)
+	{
+		lseek(m_file, 0, SEEK_SET);
+		m_length = m_position = 0;
+		m_videoPid = videoPid;
+		m_lastTimestamp = -1;
+		m_streamTime = 0;
+	}
+
+	/// next packets (up to maxPackets), returns number of packets, 0 at end of file
+	int Next(const uchar** data, int maxPackets)
+	{
+		if (m_position + TS_SIZE > m_length)
+		{
+			// keep partial packet
+			int rest = m_length - m_position;
+			memmove(m_data, m_data + m_position, rest);
+			ssize_t r = read(m_file, m_data + rest, READ_PACKETS * TS_SIZE - rest);
+			m_length = rest + max(r, (ssize_t)0);
+			m_position = 0;
+
+			// lost sync (or packets of other sizes)
+			while (m_position + TS_SIZE <= m_length && m_data[m_position] != TS_SYNC_BYTE)
+			{
+				m_position++;
+			}
+		}
+
+		int packets = 0;
+		*data = m_data + m_position;
+		for (; packets < maxPackets && m_position + TS_SIZE <= m_length && m_data[m_position] == TS_SYNC_BYTE;
+			packets++, m_position += TS_SIZE)
+		{
+			const uchar* packet = m_data + m_position;
+			if (m_videoPid != 0 && TsPid(packet) == m_videoPid && TsPayloadStart(packet))
+			{
+				Time(packet);
+			}
+		}
+		return packets;
+	}
+
+	/// stream time of packets read so far (90 kHz, starting at 0)
+	int64_t StreamTime() { return m_streamTime; }
+
+private:
+
+	/// advances stream time by video time stamp (DTS or PTS)
+	void Time(const uchar* packet)
+	{
+		const uchar* pes = packet;
+		int pesLength = TsGetPayload(&pes);
+		if (pesLength < 14 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01 || !PesHasPts(pes))
+		{
+			return;
+		}
+		int64_t timestamp = PesHasDts(pes) && pesLength >= 19 ? PesGetDts(pes) : PesGetPts(pes);
+		if (m_lastTimestamp >= 0)
+		{
+			int64_t step = PtsDiff(m_lastTimestamp, timestamp);
+			if (step > 0 && step < MAX_CLOCK_STEP)
+			{
+				m_streamTime += step;
+			}
+		}
+		m_lastTimestamp = timestamp;
+	}
+};
+
+
+/// finds the first program's streams in PAT and PMT at the start of the stream,
+/// returns false if there's none with video
+static bool FindStreams(cStreamFile* stream, cChannel* channel)
+{
+	int pmtPid = -1;
+	int vpid = 0, vtype = 0;
+	int apids[MAXAPIDS + 1] = { 0 }, atypes[MAXAPIDS + 1] = { 0 }, dpids[MAXDPIDS + 1] = { 0 };
+	int audioCount = 0, dolbyCount = 0;
+
+	const uchar* data;
+	int packets;
+	int packetsLeft = 100000;
+	while (vpid == 0 && packetsLeft > 0 && (packets = stream->Next(&data, DEVICE_PACKETS)) > 0)
+	{
+		packetsLeft -= packets;
+		for (; packets > 0; packets--, data += TS_SIZE)
+		{
+			int pid = TsPid(data);
+			if (!TsPayloadStart(data) || (pid != PATPID && pid != pmtPid)) continue;
+
+			const uchar* payload = data;
+			int length = TsGetPayload(&payload);
+			if (length < 1 || payload[0] + 1 + 12 > length) continue;
+			const uchar* section = payload + 1 + payload[0];
+			int sectionEnd = min(3 + (((section[1] & 0x0F) << 8) | section[2]) - 4, (int)(payload + length - section));
+
+			if (pid == PATPID && section[0] == 0x00)
+			{
+				for (int entry = 8; entry + 4 <= sectionEnd; entry += 4)
+				{
+					if ((section[entry] << 8 | section[entry + 1]) != 0)
+					{
+						pmtPid = (section[entry + 2] & 0x1F) << 8 | section[entry + 3];
+						break;
+					}
+				}
+			}
+			else if (pid == pmtPid && section[0] == 0x02)
+			{
+				int entry = 12 + (((section[10] & 0x0F) << 8) | section[11]);
+				for (; entry + 5 <= sectionEnd; entry += 5 + (((section[entry + 3] & 0x0F) << 8) | section[entry + 4]))
+				{
+					int type = section[entry];
+					int esPid = (section[entry + 1] & 0x1F) << 8 | section[entry + 2];
+					int descriptor = entry + 5 < sectionEnd ? section[entry + 5] : 0;
+					if ((type == 0x01 || type == 0x02 || type == 0x1B || type == 0x24) && vpid == 0)
+					{
+						vpid = esPid;
+						vtype = type;
+					}
+					else if ((type == 0x03 || type == 0x04 || type == 0x0F || type == 0x11) && audioCount < MAXAPIDS)
+					{
+						apids[audioCount] = esPid;
+						atypes[audioCount++] = type;
+					}
+					else if (type == 0x06 && (descriptor == 0x6A || descriptor == 0x7A) && dolbyCount < MAXDPIDS)
+					{
+						dpids[dolbyCount++] = esPid;
+					}
+				}
+			}
+		}
+	}
+	channel->SetPids(vpid, vtype, apids, atypes, dpids);
+	return vpid != 0;
+}
+
+
+/// buffering receiver with the options given
+static cBufferReceiver* StartBuffer(cDevice* device, cSegmentPool* pool, cBufferAnalyzer* analyzer, const cChannel* channel)
+{
+	cBufferReceiver* receiver = new cBufferReceiver(pool, analyzer);
+	if (!receiver->Allocate(s_bufferSize / TS_SIZE * TS_SIZE))
+	{
+		esyslog("could not allocate buffer of %llu MB", (unsigned long long)(s_bufferSize >> 20));
+		delete receiver;
+		return NULL;
+	}
+	receiver->SetChannel(channel);
+	receiver->SetSavingOnTheFly(s_saveOnTheFly);
+	receiver->SetSaveMode(s_saveMode);
+	receiver->SetSaveWorkers(s_saveWorkers);
+	device->AttachReceiver(receiver);
+	return receiver;
+}
+
+/// is the buffer of the promoted receiver saved?
+static bool Saved(cBufferReceiver* receiver)
+{
+	Permashift_Stats_v1 stats;
+	memset(&stats, 0, sizeof(stats));
+	receiver->GetStats(&stats);
+	return stats.bytesToSave > 0 && stats.bytesSaved >= stats.bytesToSave;
+}
+
+/// parses a comma separated list of stream times (seconds, "end" for end of stream), returns number of times
+static int ParseTimes(const char* list, double* times)
+{
+	int count = 0;
+	char* end;
+	for (const char* time = list; *time != 0 && count < MAX_ACTIVATIONS; time = *end == ',' ? end + 1 : end)
+	{
+		if (strncmp(time, "end", 3) == 0)
+		{
+			times[count++] = -1;
+			end = (char*)time + 3;
+			continue;
+		}
+		double value = strtod(time, &end);
+		if (end == time || value < 0) return 0;
+		times[count++] = value;
+	}
+	return count;
+}
+
+/// removes recording directories made by the replay
+static void RemoveRecording(const char* directory)
+{
+	cReadDir dir(directory);
+	struct dirent* entry;
+	while ((entry = dir.Next()) != NULL)
+	{
+		unlink(AddDirectory(directory, entry->d_name));
+	}
+	rmdir(directory);
+}
+
+static void Usage(const char* name)
+{
+	fprintf(stderr,
+		"usage: %s [options] FILE.ts\n"
+		"  -s SPEED             multiple of real time the stream is passed at, 0 for as fast as possible (default 10)\n"
+		"  -b MB                buffer size (default 100)\n"
+		"  -a SECS[,SECS...]    stream times to turn the buffer into a recording at, \"end\" for end of stream (default end)\n"
+		"  -r SECS              stream time each recording goes on for (default 10)\n"
+		"  -m MODE              save mode: cached, uncached or direct (default cached)\n"
+		"  -w WORKERS           files saved in parallel (default 1)\n"
+		"  -F                   save buffer on the fly, file by file\n"
+		"  -o DIR               directory for recordings (default: temporary, removed afterwards)\n"
+		"  -l LABEL             label added to each result (e.g. commit id)\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	double activations[MAX_ACTIVATIONS] = { -1 };
+	int activationCount = 1;
+	const char* outputDirectory = NULL;
+
+	int c;
+	while ((c = getopt(argc, argv, "s:b:a:r:m:w:Fo:l:h")) != -1)
+	{
+		switch (c)
+		{
+		case 's':
+			s_speed = atof(optarg);
+			break;
+		case 'b':
+			s_bufferSize = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'a':
+			activationCount = ParseTimes(optarg, activations);
+			break;
+		case 'r':
+			s_recordSecs = atof(optarg);
+			break;
+		case 'm':
+			s_saveMode = strcmp(optarg, "direct") == 0 ? smDirect : strcmp(optarg, "uncached") == 0 ? smUncached : smCached;
+			break;
+		case 'w':
+			s_saveWorkers = atoi(optarg);
+			break;
+		case 'F':
+			s_saveOnTheFly = true;
+			break;
+		case 'o':
+			outputDirectory = optarg;
+			break;
+		case 'l':
+			s_label = optarg;
+			break;
+		default:
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 1 || activationCount == 0 || s_bufferSize == 0 || s_speed < 0 || s_recordSecs < 0)
+	{
+		Usage(argv[0]);
+		return 2;
+	}
+	const char* fileName = argv[optind];
+
+	// activations in order of stream time, end of stream last
+	for (int i = 0; i < activationCount; i++)
+	{
+		for (int j = i + 1; j < activationCount; j++)
+		{
+			if (activations[i] < 0 || (activations[j] >= 0 && activations[j] < activations[i]))
+			{
+				double activation = activations[i];
+				activations[i] = activations[j];
+				activations[j] = activation;
+			}
+		}
+	}
+
+	cStreamFile stream;
+	cChannel channel;
+	if (!stream.Open(fileName)) return 1;
+	if (!FindStreams(&stream, &channel))
+	{
+		esyslog("no video stream found in %s", fileName);
+		return 1;
+	}
+	channel.SetNumber(1);
+
+	char temporaryDirectory[] = "/tmp/permashift-replay-XXXXXX";
+	bool removeRecordings = outputDirectory == NULL;
+	if (outputDirectory == NULL)
+	{
+		outputDirectory = mkdtemp(temporaryDirectory);
+	}
+	if (outputDirectory == NULL || !MakeDirs(outputDirectory, true))
+	{
+		esyslog("could not make directory for recordings");
+		return 1;
+	}
+
+	cString labelField = s_label != NULL ? cString::sprintf("\"label\":\"%s\",", s_label) : cString("");
+
+	cDevice device;
+	cSegmentPool pool;
+	cBufferAnalyzer analyzer;
+	cBufferReceiver* receiver = StartBuffer(&device, &pool, &analyzer, &channel);
+	if (receiver == NULL) return 1;
+
+	uint64_t startNs = MonotonicNanoSeconds();
+	double startCpu = CpuSeconds();
+	uint64_t startAllocations = s_allocations;
+	uint64_t startAllocatedBytes = s_allocatedBytes;
+
+	int nextActivation = 0;
+	int recordings = 0;
+	int failed = 0;
+	int maxAnalysisLag = 0;
+
+	// stream time the current recording has started at, -1 while buffering
+	int64_t recordingStart = -1;
+
+	// time the recording has been activated at, time taken by activation, time the buffer has been saved at (ns)
+	uint64_t activatedAt = 0;
+	uint64_t activationNs = 0;
+	uint64_t savedAt = 0;
+
+	stream.Rewind(channel.Vpid());
+	const uchar* data;
+	int packets;
+	while (receiver != NULL)
+	{
+		packets = stream.Next(&data, DEVICE_PACKETS);
+		int64_t streamTime = stream.StreamTime();
+
+		// keep pace
+		if (s_speed > 0)
+		{
+			int64_t ahead = (int64_t)(streamTime * 1e9 / TIMESTAMP_FREQUENCY / s_speed) - (int64_t)(MonotonicNanoSeconds() - startNs);
+			if (ahead > 1000000)
+			{
+				struct timespec wait = { (time_t)(ahead / 1000000000), (long)(ahead % 1000000000) };
+				nanosleep(&wait, NULL);
+			}
+		}
+
+		if (recordingStart < 0)
+		{
+			// buffering, until it's time for a recording
+			bool activate = nextActivation < activationCount &&
+				(packets == 0 ? true : activations[nextActivation] >= 0 && streamTime >= activations[nextActivation] * TIMESTAMP_FREQUENCY);
+			if (activate)
+			{
+				Permashift_Stats_v1 stats;
+				memset(&stats, 0, sizeof(stats));
+				receiver->GetStats(&stats);
+				maxAnalysisLag = max(maxAnalysisLag, stats.maxAnalysisLag);
+
+				cString recordingName = cString::sprintf("%s/replay-%d.rec", outputDirectory, ++recordings);
+				MakeDirs(recordingName, true);
+				cRecordingInfo info(recordingName);
+				info.Write();
+
+				activatedAt = MonotonicNanoSeconds();
+				receiver->ActivatePreRecording(recordingName, RECORDING_PRIORITY);
+				activationNs = MonotonicNanoSeconds() - activatedAt;
+
+				nextActivation++;
+				recordingStart = streamTime;
+				savedAt = 0;
+				printf("{\"benchmark\":\"replay\",%s\"event\":\"activation\",\"recording\":%d,\"stream_s\":%.1f,\"buffer_mb\":%.1f,\"buffer_s\":%.1f}\n",
+					*labelField, recordings, streamTime / (double)TIMESTAMP_FREQUENCY, stats.bytesAvailable / 1048576.0, stats.fillSecs);
+				fflush(stdout);
+			}
+		}
+		else
+		{
+			// recording, until the given time has passed (or the stream has ended) and the buffer has been saved
+			if (savedAt == 0 && Saved(receiver))
+			{
+				savedAt = MonotonicNanoSeconds();
+			}
+			bool recorded = packets == 0 || streamTime - recordingStart >= s_recordSecs * TIMESTAMP_FREQUENCY;
+			if (recorded)
+			{
+				uint64_t waitStart = MonotonicNanoSeconds();
+				while (savedAt == 0 && MonotonicNanoSeconds() - waitStart < SAVE_TIMEOUT_MS * 1000000ull)
+				{
+					cCondWait::SleepMs(5);
+					if (Saved(receiver))
+					{
+						savedAt = MonotonicNanoSeconds();
+					}
+				}
+
+				Permashift_Stats_v1 stats;
+				memset(&stats, 0, sizeof(stats));
+				receiver->GetStats(&stats);
+				if (savedAt == 0) failed++;
+
+				printf("{\"benchmark\":\"replay\",%s\"event\":\"recording\",\"recording\":%d,\"activation_ms\":%.3f,\"switch_ms\":%d,"
+					"\"save_ms\":%.1f,\"saved_mb\":%.1f,\"save_mb_per_s\":%.1f,\"saved\":%s}\n",
+					*labelField, recordings, activationNs / 1e6, stats.switchMs,
+					savedAt != 0 ? (savedAt - activatedAt) / 1e6 : -1.0,
+					stats.bytesSaved / 1048576.0, stats.saveMBPerSec, savedAt != 0 ? "true" : "false");
+				fflush(stdout);
+
+				device.Detach(receiver);
+				delete receiver;
+				receiver = NULL;
+				recordingStart = -1;
+
+				if (removeRecordings)
+				{
+					RemoveRecording(cString::sprintf("%s/replay-%d.rec", outputDirectory, recordings));
+				}
+				if (packets == 0 || nextActivation >= activationCount) break;
+
+				// buffering starts over
+				receiver = StartBuffer(&device, &pool, &analyzer, &channel);
+			}
+		}
+
+		if (packets == 0)
+		{
+			if (recordingStart < 0) break;
+			continue;
+		}
+		device.Distribute(data, packets * TS_SIZE);
+	}
+
+	if (receiver != NULL)
+	{
+		device.Detach(receiver);
+		delete receiver;
+	}
+
+	double wallSecs = (MonotonicNanoSeconds() - startNs) / 1e9;
+	double cpuSecs = CpuSeconds() - startCpu;
+	double streamSecs = stream.StreamTime() / (double)TIMESTAMP_FREQUENCY;
+	double streamHours = max(streamSecs, 1.0) / 3600;
+	uint64_t allocations = s_allocations - startAllocations;
+	uint64_t allocatedBytes = s_allocatedBytes - startAllocatedBytes;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\"benchmark\":\"replay\",%s\"event\":\"summary\",\"speed\":%.1f,\"buffer_mb\":%llu,\"save_mode\":%d,\"save_workers\":%d,"
+		"\"save_on_the_fly\":%s,\"recordings\":%d,\"stream_s\":%.1f,\"wall_s\":%.3f,\"achieved_speed\":%.1f,"
+		"\"cpu_s\":%.3f,\"cpu_s_per_stream_hour\":%.2f,\"allocations\":%llu,\"allocated_mb\":%.1f,\"allocations_per_stream_hour\":%.0f,"
+		"\"max_rss_mb\":%.1f,\"max_analysis_lag\":%d,\"emergency_exit\":%s}\n",
+		*labelField, s_speed, (unsigned long long)(s_bufferSize >> 20), s_saveMode, s_saveWorkers,
+		s_saveOnTheFly ? "true" : "false", recordings, streamSecs, wallSecs, streamSecs / max(wallSecs, 1e-3),
+		cpuSecs, cpuSecs / streamHours, (unsigned long long)allocations, allocatedBytes / 1048576.0, allocations / streamHours,
+		usage.ru_maxrss / 1024.0, maxAnalysisLag, ShutdownHandler.EmergencyExitRequested() ? "true" : "false");
+
+#ifdef PERMASHIFT_LATENCY_HISTOGRAMS
+	fprintf(stderr, "%s\n", *DumpLatencyHistograms());
+#endif
+
+	if (removeRecordings)
+	{
+		rmdir(outputDirectory);
+	}
+	return failed > 0 || ShutdownHandler.EmergencyExitRequested() ? 1 : 0;
+}
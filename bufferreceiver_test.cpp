@@ -0,0 +1,203 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Built against the stand-ins of VDR's headers in stubs ("make bufferreceiver_test").
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE BufferReceiver
+
+#include "bufferreceiver.h"
+#include "segmentpool.h"
+#include "bufferanalyzer.h"
+#include "permashift.h"
+
+#include <vdr/shutdown.h>
+#include <boost/test/unit_test.hpp>
+
+#define VIDEO_PID 0x100
+#define AUDIO_PID 0x101
+
+// packets of frames, each frame being long enough for the frame detector to see its start
+#define I_FRAME_PACKETS 150
+#define FRAME_PACKETS 110
+
+// frames per group of pictures
+#define GOP_LENGTH 12
+
+// time stamp step per frame (25 fps)
+#define FRAME_TICKS 3600
+
+
+cShutdownHandler ShutdownHandler;
+
+/// the test's receivers have no plugin to tell
+void cPluginPermashift::BufferDeleted(cBufferReceiver* callingReceiver)
+{
+}
+
+
+/// receiver the test passes data to, like a device would
+class cTestReceiver : public cBufferReceiver
+{
+private:
+	cChannel m_channel;
+	int m_frames;
+	uchar m_continuityCounter;
+
+public:
+	cTestReceiver(cSegmentPool* pool, cBufferAnalyzer* analyzer) : cBufferReceiver(pool, analyzer), m_frames(0), m_continuityCounter(0)
+	{
+		int apids[] = { AUDIO_PID, 0 };
+		int atypes[] = { 0x04, 0 };
+		int dpids[] = { 0 };
+		m_channel.SetPids(VIDEO_PID, 0x02, apids, atypes, dpids);
+		m_channel.SetNumber(1);
+		BOOST_REQUIRE(Allocate(16 * 1024 * 1024));
+		SetChannel(&m_channel);
+	}
+
+	/// bytes the receiver puts in front of each I frame (PAT and PMT)
+	int PatPmtLength()
+	{
+		cPatPmtGenerator patPmtGenerator(&m_channel);
+		int packets = 1;
+		int Index = 0;
+		while (patPmtGenerator.GetPmt(Index) != NULL)
+		{
+			packets++;
+		}
+		return packets * TS_SIZE;
+	}
+
+	/// passes the next MPEG-2 frame of the stream, packet by packet like a device,
+	/// and analyzes what can be analyzed
+	void ReceiveFrame(bool independent)
+	{
+		int packets = independent ? I_FRAME_PACKETS : FRAME_PACKETS;
+		uchar* data = MALLOC(uchar, packets * TS_SIZE);
+		for (int packet = 0; packet < packets; packet++)
+		{
+			uchar* p = data + packet * TS_SIZE;
+			memset(p, 0xFF, TS_SIZE);
+			p[0] = TS_SYNC_BYTE;
+			p[1] = (packet == 0 ? 0x40 : 0x00) | (VIDEO_PID >> 8);
+			p[2] = VIDEO_PID & 0xFF;
+			p[3] = 0x10 | (m_continuityCounter++ & 0x0F);
+		}
+
+		// PES header with PTS, followed by a picture start code of the frame's type
+		int64_t pts = (int64_t)m_frames * FRAME_TICKS + 90000;
+		uchar pes[] = { 0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x80, 0x80, 0x05,
+			(uchar)(0x21 | ((pts >> 29) & 0x0E)), (uchar)(pts >> 22), (uchar)(0x01 | ((pts >> 14) & 0xFE)),
+			(uchar)(pts >> 7), (uchar)(0x01 | ((pts << 1) & 0xFE)),
+			0x00, 0x00, 0x01, 0x00, 0x00, (uchar)((independent ? 1 : 2) << 3) };
+		memcpy(data + 4, pes, sizeof(pes));
+
+		for (int packet = 0; packet < packets; packet++)
+		{
+			Receive(data + packet * TS_SIZE, TS_SIZE);
+		}
+		free(data);
+		Analyze();
+		m_frames++;
+	}
+
+	/// passes a number of whole groups of pictures
+	void ReceiveGops(int gops)
+	{
+		for (int frame = 0; frame < gops * GOP_LENGTH; frame++)
+		{
+			ReceiveFrame(frame % GOP_LENGTH == 0);
+		}
+	}
+};
+
+
+struct tReceiverFixture
+{
+	cSegmentPool pool;
+	cBufferAnalyzer analyzer;
+	cTestReceiver receiver;
+	uint64_t offset;
+	int length;
+	int64_t frameTime;
+
+	tReceiverFixture() : receiver(&pool, &analyzer), offset(0), length(0), frameTime(0) {}
+};
+
+
+BOOST_FIXTURE_TEST_CASE(IFrameLengthSetByNextFrame, tReceiverFixture)
+{
+	BOOST_CHECK(!receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+
+	// newest I frame isn't complete yet
+	receiver.ReceiveFrame(true);
+	BOOST_CHECK(!receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+	BOOST_CHECK(!receiver.FindIFrame(INT64_MIN, true, &offset, &length, &frameTime));
+
+	// up to the next frame, including PAT and PMT
+	receiver.ReceiveFrame(false);
+	BOOST_REQUIRE(receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(offset, 0);
+	BOOST_CHECK_EQUAL(length, receiver.PatPmtLength() + I_FRAME_PACKETS * TS_SIZE);
+	BOOST_CHECK_EQUAL(frameTime, 0);
+
+	// length isn't touched by frames after the next one
+	receiver.ReceiveFrame(false);
+	BOOST_REQUIRE(receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(length, receiver.PatPmtLength() + I_FRAME_PACKETS * TS_SIZE);
+
+	// newest I frame incomplete again
+	receiver.ReceiveFrame(true);
+	BOOST_CHECK(!receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+	BOOST_REQUIRE(receiver.FindIFrame(2 * FRAME_TICKS, false, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(offset, 0);
+	receiver.ReceiveFrame(false);
+	BOOST_REQUIRE(receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(offset, receiver.PatPmtLength() + (I_FRAME_PACKETS + 2 * FRAME_PACKETS) * TS_SIZE);
+	BOOST_CHECK_EQUAL(length, receiver.PatPmtLength() + I_FRAME_PACKETS * TS_SIZE);
+	BOOST_CHECK_EQUAL(frameTime, 3 * FRAME_TICKS);
+}
+
+BOOST_FIXTURE_TEST_CASE(FindIFrameForwardAndBackward, tReceiverFixture)
+{
+	receiver.ReceiveGops(4);
+	receiver.ReceiveFrame(true);
+	receiver.ReceiveFrame(false);
+	uint64_t gopLength = receiver.PatPmtLength() + (I_FRAME_PACKETS + (GOP_LENGTH - 1) * FRAME_PACKETS) * TS_SIZE;
+
+	// I frames at the time searched for are found both ways
+	for (int gop = 0; gop <= 4; gop++)
+	{
+		for (int forward = 0; forward <= 1; forward++)
+		{
+			BOOST_REQUIRE(receiver.FindIFrame(gop * GOP_LENGTH * FRAME_TICKS, forward, &offset, &length, &frameTime));
+			BOOST_CHECK_EQUAL(offset, gop * gopLength);
+			BOOST_CHECK_EQUAL(frameTime, gop * GOP_LENGTH * FRAME_TICKS);
+			BOOST_CHECK_EQUAL(length, receiver.PatPmtLength() + I_FRAME_PACKETS * TS_SIZE);
+		}
+	}
+
+	// between I frames, the next one going forward, the last one going backward
+	BOOST_REQUIRE(receiver.FindIFrame(13 * FRAME_TICKS, true, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(frameTime, 24 * FRAME_TICKS);
+	BOOST_CHECK_EQUAL(offset, 2 * gopLength);
+	BOOST_REQUIRE(receiver.FindIFrame(13 * FRAME_TICKS, false, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(frameTime, 12 * FRAME_TICKS);
+	BOOST_CHECK_EQUAL(offset, gopLength);
+	BOOST_REQUIRE(receiver.FindIFrame(47 * FRAME_TICKS, true, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(frameTime, 48 * FRAME_TICKS);
+
+	// ends of buffer
+	BOOST_REQUIRE(receiver.FindIFrame(INT64_MIN, true, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(frameTime, 0);
+	BOOST_CHECK(!receiver.FindIFrame(-1, false, &offset, &length, &frameTime));
+	BOOST_REQUIRE(receiver.FindIFrame(INT64_MAX, false, &offset, &length, &frameTime));
+	BOOST_CHECK_EQUAL(frameTime, 48 * FRAME_TICKS);
+	BOOST_CHECK(!receiver.FindIFrame(49 * FRAME_TICKS, true, &offset, &length, &frameTime));
+}
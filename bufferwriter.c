@@ -6,31 +6,87 @@
  */
 
 
-#define VIDEO_FILE_SIZE (5 * 1024 * 1024)
-#define SAVING_HEAP_SIZE (unsigned int)(1 * 1024 * 1024)
+// time to wait for a write to complete when all writes are in flight
+#define WRITE_WAIT_MS 100
+// alignment of file offsets, lengths and memory for direct I/O
+#define DIRECT_IO_ALIGNMENT 4096
 
 // copied from recording.c
 #define RECORDFILESUFFIXTS      "/%05d.ts"
 #define RECORDFILESUFFIXLEN 20 // some additional bytes for safety...
+#define INDEXFILESUFFIX     "/index"
 
 
 #include "bufferwriter.h"
-#include "bufferreceiver.h"
+#include "overwritingringbuffer.h"
+#include "frameindex.h"
+#include "asyncwriter.h"
+#include "latencyhistogram.h"
 
+#include <vdr/recording.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
 
-cBufferWriter::cBufferWriter(cOverwritingRingBuffer* ringBuffer, cList<tFrameInfo>* memoryIndex, const char* fileName, bool multipleChunks) :
-m_ringBuffer(ringBuffer), m_frameIndex(memoryIndex), m_currentFile(NULL), m_firstChunkInFile(true), m_currentFileOffset(0)
+
+static const char* SaveModeNames[smCount] = { "cached", "uncached", "direct I/O" };
+
+
+cBufferWriter::cBufferWriter(cOverwritingRingBuffer* ringBuffer, cFrameIndex* memoryIndex, const char* fileName, bool multipleChunks,
+	eSaveMode saveMode, int workers) :
+m_ringBuffer(ringBuffer), m_frameIndex(memoryIndex), m_files(NULL), m_nextFile(0), m_filesLeft(0),
+m_workers(constrain(workers, 1, MAX_SAVE_WORKERS)), m_failed(false),
+m_requestCount(max(ASYNC_WRITES_IN_FLIGHT, 2 * m_workers)), m_saveMode(saveMode), m_pacer(m_requestCount),
+m_throughputLogged(false), m_firstFrameOffset(0), m_bytesToSaveTotal(0), m_bytesSaved(0), m_saveDuration(0)
 {
+	// two writes in flight per file saved in parallel
+	m_engine = new cAsyncWriter(m_requestCount);
+	m_chunks = MALLOC(tChunk, m_requestCount);
+	m_bounceBuffers = MALLOC(uchar*, m_requestCount);
+	m_bounceBuffersUsed = MALLOC(bool, m_requestCount);
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		m_chunks[request].file = -1;
+		m_chunks[request].bounceBuffer = -1;
+		m_bounceBuffers[request] = NULL;
+		m_bounceBuffersUsed[request] = false;
+	}
+	m_dropChunk.file = -1;
+
+	// direct I/O needs aligned memory, room for the longest chunk plus padding
+	if (m_saveMode == smDirect)
+	{
+		for (int buffer = 0; buffer < m_requestCount; buffer++)
+		{
+			void* memory;
+			if (posix_memalign(&memory, DIRECT_IO_ALIGNMENT, SAVE_CHUNK_MAX + 2 * DIRECT_IO_ALIGNMENT) != 0)
+			{
+				esyslog("permashift: out of memory for direct I/O, saving uncached");
+				m_saveMode = smUncached;
+				break;
+			}
+			m_bounceBuffers[buffer] = (uchar*)memory;
+		}
+	}
+
 	// copy target file name
 	m_fileName = MALLOC(char, strlen(fileName) + RECORDFILESUFFIXLEN);
 	strcpy(m_fileName, fileName);
 	m_fileNumber = m_fileName + strlen(fileName);
 
-	// calculate number of files to be used
+	// calculate number of files to be used, one per part of the index starting at its first I frame
 	m_fileCount = 1;
 	if (multipleChunks)
 	{
-		m_fileCount = max(1, (int)(m_ringBuffer->BytesAvailable() / VIDEO_FILE_SIZE));
+		int firstIFrame = 0;
+		while (firstIFrame < m_frameIndex->Count() && !m_frameIndex->IFrame(firstIFrame))
+		{
+			firstIFrame++;
+		}
+		if (firstIFrame < m_frameIndex->Count())
+		{
+			m_fileCount = (uint16_t)(m_frameIndex->FileNo(m_frameIndex->Count() - 1) - m_frameIndex->FileNo(firstIFrame)) + 1;
+		}
 	}
 
 	// reserve files for our memory buffer by creating them
@@ -49,10 +105,35 @@ m_ringBuffer(ringBuffer), m_frameIndex(memoryIndex), m_currentFile(NULL), m_firs
 		fwrite(dummyText, sizeof(dummyText), 1, tempFile);
 		fclose(tempFile);
 	}
+	m_filesLeft = m_fileCount;
 }
 
 cBufferWriter::~cBufferWriter()
 {
+	// waits for writes in flight
+	delete m_engine;
+
+	// close files still open
+	if (m_files != NULL)
+	{
+		for (unsigned int fileNo = 1; fileNo <= m_fileCount; fileNo++)
+		{
+			if (m_files[fileNo - 1].file >= 0)
+			{
+				close(m_files[fileNo - 1].file);
+			}
+		}
+		free(m_files);
+		m_files = NULL;
+	}
+	free(m_chunks);
+	for (int buffer = 0; buffer < m_requestCount; buffer++)
+	{
+		free(m_bounceBuffers[buffer]);
+	}
+	free(m_bounceBuffers);
+	free(m_bounceBuffersUsed);
+
 	if (m_fileName != NULL)
 	{
 		free(m_fileName);
@@ -62,170 +143,512 @@ cBufferWriter::~cBufferWriter()
 
 bool cBufferWriter::Finished()
 {
-	return m_fileCount == 0;
+	return (m_filesLeft == 0 || m_failed) && m_engine->Pending() == 0;
 }
 
 bool cBufferWriter::Initialize()
 {
 	// delete indices up to first I frame
-	tFrameInfo* frameInfo = m_frameIndex->First();
-	while (frameInfo != NULL && !frameInfo->iFrame)
+	while (m_frameIndex->Count() > 0 && !m_frameIndex->IFrame(0))
 	{
-		m_frameIndex->Del(frameInfo);
-		frameInfo = m_frameIndex->First();
+		m_frameIndex->DropFirst();
 	}
-	if (frameInfo == NULL)
+	if (m_frameIndex->Count() == 0)
 	{
 		return false;
 	}
 
 	// throw away video data up to first I frame
-	m_firstFrameOffset = frameInfo->offset;
+	m_firstFrameOffset = m_frameIndex->Offset(0);
 	m_ringBuffer->DropData(m_firstFrameOffset - m_ringBuffer->BytesDropped());
 
 	// all data left after dropping has to be saved
 	m_bytesToSaveTotal = m_ringBuffer->BytesAvailable();
 
-	// assign frames to files
-	if (m_fileCount > 1)
+	// assign frames to files, the newest part going to the last file
+	// (parts having arrived or been dropped since the files were counted go to the first one)
+	unsigned int newestPart = m_frameIndex->FileNo(m_frameIndex->Count() - 1);
+	for (int frame = 0; frame < m_frameIndex->Count(); frame++)
 	{
-		unsigned int approxFileSize = (m_frameIndex->Last()->offset - m_firstFrameOffset) / m_fileCount;
-		unsigned int fileIndex = 1;
-		do
-		{
-			frameInfo->fileNo = fileIndex;
-			frameInfo = (tFrameInfo*)frameInfo->Next();
-			if (frameInfo == NULL) break;
-			// if we're not at the last file...
-			if (fileIndex <= m_fileCount)
-			{
-				// check if we're at the first I frame after the approximate file size
-				if (frameInfo->iFrame && frameInfo->offset - m_firstFrameOffset > (uint64_t)fileIndex * approxFileSize)
-				{
-					fileIndex++;
-				}
-			}
-		}
-		while (frameInfo != NULL);
+		unsigned int partsBack = (uint16_t)(newestPart - m_frameIndex->FileNo(frame));
+		m_frameIndex->SetFileNo(frame, partsBack < m_fileCount ? m_fileCount - partsBack : 1);
 	}
 
-	m_firstChunkInFile = true;
 	m_bytesSaved = 0;
+	m_saveTimer.Set();
+	m_throughputLogged = false;
 
 	return true;
 }
 
 
-void cBufferWriter::SaveAll()
+
+void cBufferWriter::WriteIndex(cIndexFile* index, const char* recordingName)
 {
-	if (m_fileName == NULL) return;
+	int frameCount = m_frameIndex->Count();
+	tIndexTs* records = MALLOC(tIndexTs, frameCount);
+	int indexFile = -1;
+	if (records != NULL)
+	{
+		// appending to the index file VDR has opened, before any frame has been recorded
+		cString indexFileName = cString::sprintf("%s%s", recordingName, INDEXFILESUFFIX);
+		indexFile = open(indexFileName, O_WRONLY | O_CREAT | O_APPEND, DEFFILEMODE);
+		if (indexFile < 0)
+		{
+			esyslog("permashift: could not open index '%s' (%d)!", *indexFileName, errno);
+		}
+	}
 
-	// write video file
-	uchar* data;
-	uint64_t bytesRead = 0;
-	FILE* outFile = fopen(m_fileName, "wb");
-	while ((bytesRead = m_ringBuffer->ReadData(&data, VIDEO_FILE_SIZE)) > 0)
+	// offsets count from the first frame in each file
+	uint64_t firstByte = frameCount > 0 ? m_frameIndex->Offset(0) : 0;
+	unsigned int currentFileNo = 0;
+	for (int frame = 0; frame < frameCount; frame++)
+	{
+		if (m_frameIndex->FileNo(frame) > currentFileNo)
+		{
+			currentFileNo = m_frameIndex->FileNo(frame);
+			firstByte = m_frameIndex->Offset(frame);
+		}
+		if (indexFile >= 0)
+		{
+			records[frame].offset = m_frameIndex->Offset(frame) - firstByte;
+			records[frame].reserved = 0;
+			records[frame].independent = m_frameIndex->IFrame(frame);
+			records[frame].number = currentFileNo;
+		}
+		else
+		{
+			index->Write(m_frameIndex->IFrame(frame), currentFileNo, m_frameIndex->Offset(frame) - firstByte);
+		}
+	}
+
+	if (indexFile >= 0)
 	{
-		if (fwrite(data, bytesRead, 1, outFile) != 1)
+		if (safe_write(indexFile, records, frameCount * sizeof(tIndexTs)) < 0)
 		{
-			esyslog("Error writing file %s!", m_fileName);
-			break;
+			esyslog("permashift: could not write index (%d)!", errno);
 		}
+		close(indexFile);
 	}
-	fclose(outFile);
+	free(records);
+}
+
+
+bool cBufferWriter::PrepareFiles()
+{
+	m_files = MALLOC(tFile, m_fileCount);
+	if (m_files == NULL)
+	{
+		return false;
+	}
+
+	// pin data of each file, starting with the newest
+	uint64_t fileEnd = m_ringBuffer->BytesAvailable();
+	for (unsigned int fileNo = m_fileCount; fileNo >= 1; fileNo--)
+	{
+		// find frames of file
+		int firstFrame = m_frameIndex->Count() - 1;
+		while (firstFrame > 0 && m_frameIndex->FileNo(firstFrame - 1) >= fileNo)
+		{
+			firstFrame--;
+		}
+		uint64_t fileStart = fileNo == 1 ? 0 : min(m_frameIndex->Offset(firstFrame) - m_firstFrameOffset, fileEnd);
+
+		tFile* file = &m_files[fileNo - 1];
+		file->file = -1;
+		file->length = fileEnd - fileStart;
+		file->unsaved = file->length;
+		file->inFlight = 0;
+		file->pin = m_ringBuffer->PinData(fileStart, file->length);
+		if (file->pin < 0 && file->length > 0)
+		{
+			esyslog("permashift: could not pin data of file %u!", fileNo);
+			return false;
+		}
+
+		// delete frame infos for this file from index
+		m_frameIndex->DropLast(m_frameIndex->Count() - firstFrame);
+		fileEnd = fileStart;
+	}
+
+	// data is only kept by the pins from now on
+	m_ringBuffer->DropData(m_ringBuffer->BytesAvailable());
+	m_nextFile = m_fileCount;
+	return true;
+}
+
+
+bool cBufferWriter::SaveAll()
+{
+	LATENCY_PROBE(lpSaveAll);
+
+	if (m_fileName == NULL) return false;
+
+	// no pacing, the engine's queue is the only limit
+	while (SaveChunk())
+	{
+	}
+	if (Finished()) return false;
+
+	// all writes in flight, wait for one of them
+	m_engine->WaitForCompletion(WRITE_WAIT_MS);
+	ReapCompletions();
+	return !Finished();
 }
 
 
 void cBufferWriter::SaveFile()
 {
-	if (m_fileName == NULL) return;
+	if (m_fileName == NULL || m_filesLeft == 0) return;
+
+	if (m_files == NULL && !PrepareFiles())
+	{
+		// give up
+		m_failed = true;
+		return;
+	}
 
-	do
+	// hand all chunks of the newest file to the engine and wait until they're written
+	tFile* newestFile = &m_files[m_fileCount - 1];
+	while (!m_failed && (m_nextFile == m_fileCount || newestFile->unsaved > 0 || newestFile->inFlight > 0))
 	{
-		SaveChunk();
+		if ((m_nextFile == m_fileCount || newestFile->unsaved > 0) && SaveChunk())
+		{
+			continue;
+		}
+
+		// all writes in flight, wait for one of them
+		m_engine->WaitForCompletion(WRITE_WAIT_MS);
+		ReapCompletions();
 	}
-	while (!m_firstChunkInFile && !Finished());
 }
 
 
-void cBufferWriter::SaveChunk()
+bool cBufferWriter::SaveChunk()
 {
-	if (m_fileName == NULL) return;
+	LATENCY_PROBE(lpSaveChunk);
 
-	if (m_firstChunkInFile)
+	if (m_fileName == NULL) return false;
+
+	ReapCompletions();
+	if (m_failed || m_filesLeft == 0 || !m_engine->CanWrite()) return false;
+
+	if (m_files == NULL && !PrepareFiles())
 	{
-		StartNewFile();
+		// give up
+		m_failed = true;
+		return false;
 	}
 
-	uchar* data;
-	uint64_t bytesRead = 0;
-	if ((bytesRead = m_ringBuffer->ReadDataFromEnd(&data, min(m_currentFileOffset, (uint64_t)(SAVING_HEAP_SIZE)))) > 0)
+	// a worker is free when all data of its file has been handed to the engine
+	int busyWorkers = 0;
+	for (unsigned int fileNo = m_fileCount; fileNo > m_nextFile; fileNo--)
+	{
+		if (m_files[fileNo - 1].unsaved > 0)
+		{
+			busyWorkers++;
+		}
+	}
+	if (busyWorkers < m_workers && m_nextFile > 0)
 	{
-		m_currentFileOffset -= bytesRead;
-		fseek(m_currentFile, m_currentFileOffset, SEEK_SET);
-		if (fwrite(data, bytesRead, 1, m_currentFile) != 1)
+		if (!StartFile(m_nextFile))
 		{
-			esyslog("Error writing file %s!", m_fileName);
 			// give up
-			m_fileCount = 0;
+			m_failed = true;
+			return false;
+		}
+		m_nextFile--;
+	}
+
+	// continue file with fewest writes in flight
+	unsigned int nextChunkFile = 0;
+	for (unsigned int fileNo = m_fileCount; fileNo > m_nextFile; fileNo--)
+	{
+		tFile* file = &m_files[fileNo - 1];
+		if (file->unsaved > 0 && (nextChunkFile == 0 || file->inFlight < m_files[nextChunkFile - 1].inFlight))
+		{
+			nextChunkFile = fileNo;
 		}
-		m_bytesSaved += bytesRead;
 	}
+	if (nextChunkFile == 0)
+	{
+		return false;
+	}
+	return SaveChunk(nextChunkFile);
+}
 
-	if (m_currentFileOffset == 0)
+
+bool cBufferWriter::SaveChunk(unsigned int fileNo)
+{
+	tFile* file = &m_files[fileNo - 1];
+
+	tChunk chunk;
+	chunk.file = file->file;
+	chunk.fileNo = fileNo;
+	chunk.bounceBuffer = -1;
+	chunk.length = NextChunkLength(file->unsaved);
+	chunk.offset = file->unsaved - chunk.length;
+	chunk.fileLength = 0;
+
+	const uchar* writeData = NULL;
+	uint64_t writeLength = chunk.length;
+	uchar* data;
+	if (m_saveMode == smDirect)
 	{
-		fclose(m_currentFile);
+		// copy to aligned memory, padding the end of the file to full blocks
+		// (there's a free bounce buffer for every free engine request)
+		chunk.bounceBuffer = 0;
+		while (m_bounceBuffersUsed[chunk.bounceBuffer])
+		{
+			chunk.bounceBuffer++;
+		}
+		uchar* alignedData = m_bounceBuffers[chunk.bounceBuffer];
+		uint64_t bytesCopied = 0;
+		while (bytesCopied < chunk.length)
+		{
+			uint64_t bytesRead = m_ringBuffer->PinnedData(file->pin, chunk.offset + bytesCopied, &data, chunk.length - bytesCopied);
+			if (bytesRead == 0) break;
+			memcpy(alignedData + bytesCopied, data, bytesRead);
+			bytesCopied += bytesRead;
+		}
+		if (bytesCopied < chunk.length)
+		{
+			esyslog("permashift: data of file %u missing in buffer!", fileNo);
+			m_failed = true;
+			return false;
+		}
+		m_bounceBuffersUsed[chunk.bounceBuffer] = true;
 
-		m_fileCount--;
-		m_firstChunkInFile = true;
+		writeLength = (chunk.length + DIRECT_IO_ALIGNMENT - 1) & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1);
+		if (writeLength > chunk.length)
+		{
+			memset(alignedData + chunk.length, 0, writeLength - chunk.length);
+			chunk.fileLength = chunk.offset + chunk.length;
+		}
+		writeData = alignedData;
+	}
+	else
+	{
+		// write straight from the buffer, data at a segment border is not contiguous
+		// without mirrored memory, so take the part in the last segment only
+		uint64_t bytesRead;
+		while ((bytesRead = m_ringBuffer->PinnedData(file->pin, chunk.offset, &data, chunk.length)) < chunk.length && bytesRead > 0)
+		{
+			chunk.offset += bytesRead;
+			chunk.length -= bytesRead;
+		}
+		if (bytesRead == 0)
+		{
+			esyslog("permashift: data of file %u missing in buffer!", fileNo);
+			m_failed = true;
+			return false;
+		}
+		writeData = data;
+		writeLength = chunk.length;
 	}
 
-	if (bytesRead == 0)
+	int request = m_engine->Write(chunk.file, writeData, writeLength, chunk.offset);
+	m_chunks[request] = chunk;
+	m_pacer.Submitted(cTimeMs::Now());
+	file->unsaved = chunk.offset;
+	file->inFlight++;
+	m_bytesSaved += chunk.length;
+	return true;
+}
+
+
+void cBufferWriter::ReapCompletions()
+{
+	int request;
+	int64_t result;
+	uint64_t completionTime;
+	while (m_engine->Reap(&request, &result, &completionTime))
+	{
+		tChunk* chunk = &m_chunks[request];
+		m_pacer.Completed(chunk->length, completionTime);
+		if (result < 0)
+		{
+			esyslog("permashift: error writing buffer to disc (%d)!", (int)-result);
+			// give up
+			m_failed = true;
+		}
+		else if (chunk->fileLength > 0 && ftruncate(chunk->file, chunk->fileLength) != 0)
+		{
+			// cut off padding of direct I/O
+			esyslog("permashift: could not resize file after direct I/O (%d)!", errno);
+			// give up
+			m_failed = true;
+		}
+		else if (m_saveMode == smUncached)
+		{
+			DropFromCache(*chunk);
+		}
+
+		if (chunk->bounceBuffer >= 0)
+		{
+			m_bounceBuffersUsed[chunk->bounceBuffer] = false;
+			chunk->bounceBuffer = -1;
+		}
+		chunk->file = -1;
+		m_files[chunk->fileNo - 1].inFlight--;
+		ReleaseSaved(chunk->fileNo);
+	}
+
+	LogThroughput();
+}
+
+
+void cBufferWriter::SavePaced(int bytesWaiting, int bufferSize)
+{
+	if (m_fileName == NULL) return;
+
+	m_pacer.SetBacklog(bytesWaiting, bufferSize);
+	ReapCompletions();
+	while (m_engine->Pending() < m_pacer.WritesAllowed() && SaveChunk())
 	{
-		// give up
-		m_fileCount = 0;
 	}
 }
 
 
-void cBufferWriter::StartNewFile()
+void cBufferWriter::ReleaseSaved(unsigned int fileNo)
 {
-	// find frames for next file
-	tFrameInfo* frameInfo = m_frameIndex->Last();
-	while (frameInfo != NULL)
+	tFile* file = &m_files[fileNo - 1];
+
+	// keep data not handed to the engine yet and data of writes in flight
+	uint64_t keep = file->unsaved;
+	for (int request = 0; request < m_requestCount; request++)
 	{
-		tFrameInfo* previousFrameInfo = (tFrameInfo*) frameInfo->Prev();
-		if (previousFrameInfo == NULL || previousFrameInfo->fileNo < m_fileCount)
+		tChunk* chunk = &m_chunks[request];
+		if (chunk->file >= 0 && chunk->fileNo == fileNo)
 		{
-			break;
+			keep = max(keep, chunk->offset + chunk->length);
 		}
-		frameInfo = previousFrameInfo;
 	}
+	m_ringBuffer->ShrinkPin(file->pin, keep);
+	if (keep == 0)
+	{
+		file->pin = -1;
+	}
+
+	// close file when it's complete
+	if (file->unsaved == 0 && file->inFlight == 0 && file->file >= 0)
+	{
+		if (m_saveMode == smUncached)
+		{
+			// drop whatever is left of the file in page cache
+			posix_fadvise(file->file, 0, 0, POSIX_FADV_DONTNEED);
+			if (m_dropChunk.file == file->file)
+			{
+				m_dropChunk.file = -1;
+			}
+		}
+		close(file->file);
+		file->file = -1;
+		m_filesLeft--;
+	}
+}
+
+
+void cBufferWriter::DropFromCache(const tChunk& chunk)
+{
+	// start writing back this chunk, so its pages are clean when they're dropped along with the next chunk
+	sync_file_range(chunk.file, chunk.offset, chunk.length, SYNC_FILE_RANGE_WRITE);
+
+	// dirty pages can't be dropped, so drop the previous chunk, which has been written back by now
+	if (m_dropChunk.file >= 0)
+	{
+		posix_fadvise(m_dropChunk.file, m_dropChunk.offset, m_dropChunk.length, POSIX_FADV_DONTNEED);
+	}
+	m_dropChunk = chunk;
+}
+
+
+uint64_t cBufferWriter::NextChunkLength(uint64_t unsaved)
+{
+	uint64_t chunkLength = m_pacer.ChunkLength();
+	if (m_saveMode != smDirect || unsaved <= chunkLength)
+	{
+		return min(unsaved, chunkLength);
+	}
+
+	// direct I/O needs chunks starting at aligned file offsets
+	return unsaved - ((unsaved - chunkLength) & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1));
+}
+
 
-	// calculate file length
-	m_currentFileOffset = (m_bytesToSaveTotal - m_bytesSaved) - (frameInfo->offset - m_firstFrameOffset);
+void cBufferWriter::GetProgress(uint64_t* bytesToSave, uint64_t* bytesSaved, double* throughput)
+{
+	*bytesToSave = m_bytesToSaveTotal;
+	*bytesSaved = m_bytesSaved;
+	uint64_t elapsed = m_saveDuration != 0 ? (uint64_t)m_saveDuration : max(m_saveTimer.Elapsed(), (uint64_t)1);
+	*throughput = *bytesSaved / 1048.576 / elapsed;
+}
+
+void cBufferWriter::LogThroughput()
+{
+	if (m_throughputLogged || m_failed || !Finished() || m_bytesSaved == 0) return;
+
+	m_throughputLogged = true;
+	uint64_t elapsed = max(m_saveTimer.Elapsed(), (uint64_t)1);
+	m_saveDuration = elapsed;
+	dsyslog("permashift: saved %llu bytes of buffer in %llu ms (%.1f MB/s, disc %.1f MB/s, %s)",
+		(unsigned long long)m_bytesSaved, (unsigned long long)elapsed, m_bytesSaved / 1048.576 / elapsed,
+		m_pacer.Bandwidth() / 1048576, SaveModeNames[m_saveMode]);
+}
+
+
+int cBufferWriter::OpenFile(uint64_t length)
+{
+	int flags = O_WRONLY;
+	if (m_saveMode == smDirect)
+	{
+		flags |= O_DIRECT;
+	}
+	int file = open(m_fileName, flags);
+	if (file < 0 && m_saveMode == smDirect && errno == EINVAL)
+	{
+		esyslog("permashift: no direct I/O for '%s', saving uncached", m_fileName);
+		m_saveMode = smUncached;
+		file = open(m_fileName, O_WRONLY);
+	}
+	if (file < 0)
+	{
+		esyslog("permashift: could not open file '%s' (%d)!", m_fileName, errno);
+		return -1;
+	}
+
+	// reserve disc space in one piece, so the file doesn't get fragmented by writing it backwards
+	if (m_saveMode != smCached && fallocate(file, 0, 0, length) != 0)
+	{
+		dsyslog("permashift: could not preallocate file '%s' (%d), creating it sparse", m_fileName, errno);
+	}
 
-	// delete frame infos for this file from list
-	while (frameInfo != NULL)
+	// set file to full size (creating a sparse file if not preallocated),
+	// so we can write its end first
+	if (ftruncate(file, length) != 0)
 	{
-		tFrameInfo* nextFrameInfo = (tFrameInfo*) frameInfo->Next();
-		m_frameIndex->Del(frameInfo);
-		frameInfo = nextFrameInfo;
+		esyslog("permashift: could not resize file '%s' (%d)!", m_fileName, errno);
+		close(file);
+		return -1;
 	}
-	m_firstChunkInFile = false;
+	return file;
+}
 
-	// allocate video file in full size (hopefully creating a sparse file),
-	// so we can seek to the end later on
-	sprintf(m_fileNumber, RECORDFILESUFFIXTS, m_fileCount);
+
+bool cBufferWriter::StartFile(unsigned int fileNo)
+{
+	tFile* file = &m_files[fileNo - 1];
+
+	// open file in full size
+	sprintf(m_fileNumber, RECORDFILESUFFIXTS, fileNo);
 	dsyslog("permashift: new file for backwards saving of past video data '%s'", m_fileName);
-	int retVal = truncate(m_fileName, m_currentFileOffset);
-	if (retVal != 0)
+	file->file = OpenFile(file->length);
+	if (file->file < 0)
 	{
-		esyslog("permashift: could not resize file '%s' (%d/%d)!", m_fileName, retVal, errno);
-		// give up
-		m_fileCount = 0;
+		return false;
 	}
 
-	// open file
-	m_currentFile = fopen(m_fileName, "r+b");
+	// nothing to write to an empty file
+	ReleaseSaved(fileNo);
+	return true;
 }
@@ -10,19 +10,75 @@
 
 #include <vdr/tools.h>
 
+#include "savepacer.h"
+
+#include <atomic>
+
 class cOverwritingRingBuffer;
-class tFrameInfo;
+class cFrameIndex;
+class cAsyncWriter;
+class cIndexFile;
+
+/// approximate size of files the buffer is saved to
+#define VIDEO_FILE_SIZE (5 * 1024 * 1024)
+
+/// most files saved in parallel
+#define MAX_SAVE_WORKERS 8
+
+// index record of TS recordings, copied from recording.c
+struct tIndexTs {
+  uint64_t offset:40; // up to 1TB per file (not using off_t here - must definitely be exactly 64 bit!)
+  int reserved:7;     // reserved for future use
+  int independent:1;  // marks frames that can be displayed by themselves (for trick modes)
+  uint16_t number:16; // up to 64K files per recording
+  };
+
+/// how saved data gets to disc
+enum eSaveMode
+{
+	smCached,		///< through page cache, files are created sparse
+	smUncached,		///< files are preallocated, data is dropped from page cache once written
+	smDirect,		///< files are preallocated, data bypasses page cache (O_DIRECT)
+	smCount
+};
 
 /// write ring buffer contents to disc, all at once or step by step
+///
+/// Either way, saving hands chunks to an asynchronous writer engine, so it never waits for the disc.
+/// When saving starts, the data of each file is pinned in the ring buffer. Files are written
+/// backwards, the newest first, by a number of workers in parallel (each owning one file).
+/// The pinned range of a file shrinks as its chunks complete, giving memory back right away.
+/// Direct I/O writes from aligned copies of the data.
 class cBufferWriter
 {
 private:
 
+	/// a file being saved
+	struct tFile
+	{
+		int file;				///< file descriptor, -1 if not open
+		int pin;				///< ring buffer pin of data not written yet, -1 if none
+		uint64_t length;		///< file length
+		uint64_t unsaved;		///< bytes at start of file not handed to engine yet
+		int inFlight;			///< chunks being written
+	};
+
+	/// a chunk being written by the engine
+	struct tChunk
+	{
+		int file;				///< file descriptor written to, -1 if chunk is not used
+		unsigned int fileNo;	///< number of file written to
+		int bounceBuffer;		///< aligned copy of data (direct I/O), -1 if none
+		off_t offset;			///< file offset of chunk
+		uint64_t length;		///< chunk length
+		uint64_t fileLength;	///< file length to truncate to when written (direct I/O padding), 0 if not needed
+	};
+
 	/// data source
 	cOverwritingRingBuffer* m_ringBuffer;
 
 	/// frame index of source data
-	cList<tFrameInfo>* m_frameIndex;
+	cFrameIndex* m_frameIndex;
 
 	/// number of files to be written
 	unsigned int m_fileCount;
@@ -31,30 +87,73 @@ private:
 	/// pointer to file number in file name
 	char* m_fileNumber;
 
-	/// file currently written
-	FILE* m_currentFile;
+	/// files to be written (file number 1 at index 0), NULL until data has been pinned
+	tFile* m_files;
+
+	/// number of next file to be started, 0 if all have been started
+	unsigned int m_nextFile;
+
+	/// number of files not completely written
+	unsigned int m_filesLeft;
+
+	/// number of files saved in parallel
+	int m_workers;
+
+	/// saving has failed, giving up
+	bool m_failed;
+
+	/// engine for writing chunks asynchronously
+	cAsyncWriter* m_engine;
+
+	/// number of engine requests
+	int m_requestCount;
+
+	/// chunk of each engine request
+	tChunk* m_chunks;
+
+	/// how data is written
+	eSaveMode m_saveMode;
+
+	/// aligned buffers for direct I/O, one per engine request
+	uchar** m_bounceBuffers;
+
+	/// bounce buffers in use
+	bool* m_bounceBuffersUsed;
 
-	/// next chunk of data goes to a new file
-	bool m_firstChunkInFile;
+	/// chunk whose data is dropped from page cache next (uncached saving), file is -1 if none
+	tChunk m_dropChunk;
 
-	/// byte offset of last chunk written in current file
-	uint64_t m_currentFileOffset;
+	/// decides chunk length and writes in flight
+	cSavePacer m_pacer;
+
+	/// time since saving started
+	cTimeMs m_saveTimer;
+
+	/// throughput has been logged
+	bool m_throughputLogged;
 
 	/// buffer offset of very first frame in index
 	uint64_t m_firstFrameOffset;
 
 	/// total numbers of bytes to save
-	uint64_t m_bytesToSaveTotal;
+	/// (this and the following are read by other threads for statistics)
+	std::atomic<uint64_t> m_bytesToSaveTotal;
 
 	/// bytes saved until now
-	uint64_t m_bytesSaved;
+	std::atomic<uint64_t> m_bytesSaved;
+
+	/// time saving took (ms), 0 until done
+	std::atomic<uint64_t> m_saveDuration;
 
 public:
 
 	/// Constructor.
 	/// Precalculates number of files needed (although the data will be complete only later on),
 	/// and reserves these files by writing dummy stuff to them.
-	cBufferWriter(cOverwritingRingBuffer* ringBuffer, cList<tFrameInfo>* memoryIndex, const char* fileName, bool multipleChunks);
+	/// If saving to multiple files, the file numbers in the frame index are expected to count
+	/// parts of about VIDEO_FILE_SIZE, each becoming a file.
+	cBufferWriter(cOverwritingRingBuffer* ringBuffer, cFrameIndex* memoryIndex, const char* fileName, bool multipleChunks,
+		eSaveMode saveMode = smCached, int workers = 1);
 
 	virtual ~cBufferWriter();
 
@@ -62,22 +161,61 @@ public:
 	/// Dumps some memory indices and buffer data. Assigns indices to file numbers.
 	bool Initialize();
 
-	/// Save a complete file
+	/// Writes the index of the recording for all frames to be saved, at once
+	/// (falls back to writing frame by frame through index).
+	void WriteIndex(cIndexFile* index, const char* recordingName);
+
+	/// Save the newest file, waiting until all of its chunks have been written
 	void SaveFile();
 
-	/// Save one chunk of a file
-	void SaveChunk();
+	/// Start saving one chunk, without waiting for the write to complete.
+	/// Returns false if no chunk could be started (too many writes in flight, or finished).
+	bool SaveChunk();
 
-	/// Save all data at once
-	void SaveAll();
+	/// Process writes completed in the meantime, giving their buffer memory back.
+	void ReapCompletions();
 
-	/// Is all saving done?
+	/// Start saving as many chunks as the recorder's backlog (bytes waiting in its ring buffer of given size) allows,
+	/// without waiting for writes to complete.
+	void SavePaced(int bytesWaiting, int bufferSize);
+
+	/// Start saving as many chunks as the engine takes, regardless of the recorder's backlog,
+	/// then wait for one write to complete; returns false once Finished().
+	bool SaveAll();
+
+	/// Is all saving done (including writes in flight)?
 	bool Finished();
 
+	/// Bytes to save and saved until now, and throughput (MB/s) of saving until now
+	/// (may be called by other threads)
+	void GetProgress(uint64_t* bytesToSave, uint64_t* bytesSaved, double* throughput);
+
 private:
 
+	/// Pin data of each file in ring buffer, to be saved in any order
+	bool PrepareFiles();
+
 	/// Prepare saving to a new file
-	void StartNewFile();
+	bool StartFile(unsigned int fileNo);
+
+	/// Start saving the last unsaved chunk of a file
+	bool SaveChunk(unsigned int fileNo);
+
+	/// Give memory of saved data back, close file when completely written
+	void ReleaseSaved(unsigned int fileNo);
+
+	/// Open file for current save mode, preallocating it unless saving through page cache.
+	/// Returns -1 on error.
+	int OpenFile(uint64_t length);
+
+	/// Bytes to save in the next chunk of a file with the given bytes left
+	uint64_t NextChunkLength(uint64_t unsaved);
+
+	/// Drops written data from page cache after starting its writeback (uncached saving)
+	void DropFromCache(const tChunk& chunk);
+
+	/// Logs save throughput once all data has been written
+	void LogThroughput();
 
 };
 
@@ -0,0 +1,352 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// time to wait for a write to complete when all writes are in flight
+#define WRITE_WAIT_MS 100
+
+// copied from recording.c
+#define NAMEFORMATTS        "%s/%s/%4d-%02d-%02d.%02d.%02d.%d-%d.rec"
+#define RECORDFILESUFFIXTS  "/%05d.ts"
+#define RECORDFILESUFFIXLEN 20 // some additional bytes for safety...
+#define INDEXFILESUFFIX     "/index"
+
+
+#include "clipexporter.h"
+#include "bufferreceiver.h"
+#include "bufferwriter.h"
+#include "asyncwriter.h"
+#include "permashift.h"
+
+#include <vdr/config.h>
+#include <vdr/recording.h>
+#include <vdr/videodir.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+
+cClipExporter::cClipExporter(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver, const char* title) :
+cThread("permashift export"), m_plugin(plugin), m_bufferReceiver(bufferReceiver), m_title(title), m_endOffset(0),
+m_framesPerSecond(DEFAULTFRAMESPERSECOND), m_engine(NULL), m_requestCount(ASYNC_WRITES_IN_FLIGHT), m_pacer(m_requestCount),
+m_state(esFailed), m_bytesToExport(0), m_bytesExported(0)
+{
+	m_chunks = MALLOC(tChunk, m_requestCount);
+	m_copies = MALLOC(uchar*, m_requestCount);
+	m_copiesUsed = MALLOC(bool, m_requestCount);
+	for (int request = 0; request < m_requestCount; request++)
+	{
+		m_chunks[request].copy = -1;
+		m_copies[request] = NULL;
+		m_copiesUsed[request] = false;
+	}
+}
+
+cClipExporter::~cClipExporter()
+{
+	Cancel(3);
+
+	free(m_chunks);
+	for (int copy = 0; copy < m_requestCount; copy++)
+	{
+		free(m_copies[copy]);
+	}
+	free(m_copies);
+	free(m_copiesUsed);
+}
+
+bool cClipExporter::Export(double secondsBack, double seconds)
+{
+	int channelNumber = 0;
+	cString title = m_title;
+	{
+		cBufferAccess access(m_plugin, m_bufferReceiver);
+		if (access.Receiver() == NULL || !access.Receiver()->GetClipFrames(secondsBack, seconds, &m_frameIndex, &m_endOffset))
+		{
+			return false;
+		}
+		m_framesPerSecond = access.Receiver()->FramesPerSecond();
+		const cChannel* channel = access.Receiver()->Channel();
+		if (channel != NULL)
+		{
+			channelNumber = channel->Number();
+			if (isempty(title))
+			{
+				title = channel->Name();
+			}
+		}
+	}
+	if (isempty(title))
+	{
+		title = "permashift";
+	}
+	m_title = title;
+
+	// the recording starts when its first frame has been received
+	uint64_t now = cTimeMs::Now();
+	uint64_t receiveTime = m_frameIndex.ReceiveTime(0);
+	time_t startTime = time(NULL) - (now > receiveTime ? (now - receiveTime) / 1000 : 0);
+	m_recordingName = MakeRecordingName(title, startTime, channelNumber);
+
+	// never touch a recording we haven't made
+	if (access(m_recordingName, F_OK) == 0)
+	{
+		esyslog("permashift: recording '%s' exists already, clip not exported!", *m_recordingName);
+		return false;
+	}
+
+	AssignFiles();
+	m_bytesToExport = m_endOffset - m_frameIndex.Offset(0);
+	m_bytesExported = 0;
+	m_state = esExporting;
+	dsyslog("permashift: exporting clip of %d frames (%llu bytes) to '%s'", m_frameIndex.Count(),
+		(unsigned long long)m_bytesToExport, *m_recordingName);
+
+	Start();
+	return true;
+}
+
+void cClipExporter::GetProgress(uint64_t* bytesToExport, uint64_t* bytesExported)
+{
+	*bytesToExport = m_bytesToExport;
+	*bytesExported = m_bytesExported;
+}
+
+cString cClipExporter::MakeRecordingName(const char* title, time_t startTime, int channelNumber)
+{
+	char* name = ExchangeChars(strdup(title), true);
+	struct tm tm_r;
+	struct tm* t = localtime_r(&startTime, &tm_r);
+	cString recordingName = cString::sprintf(NAMEFORMATTS,
+#if VDRVERSNUM > 20101
+		cVideoDirectory::Name(),
+#else
+		VideoDirectory,
+#endif
+		name, t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min, channelNumber, InstanceId);
+	free(name);
+	return recordingName;
+}
+
+void cClipExporter::AssignFiles()
+{
+	// like VDR's recorder, every file starts with an I frame
+	off_t maxFileSize = MEGABYTE(off_t(Setup.MaxVideoFileSize));
+	m_fileStarts.Clear();
+	m_fileStarts.Append(m_frameIndex.Offset(0));
+	for (int frame = 0; frame < m_frameIndex.Count(); frame++)
+	{
+		uint64_t offset = m_frameIndex.Offset(frame);
+		if (m_frameIndex.IFrame(frame) && offset - m_fileStarts[m_fileStarts.Size() - 1] >= (uint64_t)maxFileSize)
+		{
+			m_fileStarts.Append(offset);
+		}
+		m_frameIndex.SetFileNo(frame, m_fileStarts.Size());
+	}
+}
+
+bool cClipExporter::CreateRecording()
+{
+	if (!MakeDirs(m_recordingName, true))
+	{
+		return false;
+	}
+
+	// index in one go, offsets count from the first frame in each file
+	int frameCount = m_frameIndex.Count();
+	tIndexTs* records = MALLOC(tIndexTs, frameCount);
+	if (records == NULL)
+	{
+		esyslog("permashift: out of memory for index of clip!");
+		return false;
+	}
+	for (int frame = 0; frame < frameCount; frame++)
+	{
+		unsigned int fileNo = m_frameIndex.FileNo(frame);
+		records[frame].offset = m_frameIndex.Offset(frame) - m_fileStarts[fileNo - 1];
+		records[frame].reserved = 0;
+		records[frame].independent = m_frameIndex.IFrame(frame);
+		records[frame].number = fileNo;
+	}
+	cString indexFileName = cString::sprintf("%s%s", *m_recordingName, INDEXFILESUFFIX);
+	int indexFile = open(indexFileName, O_WRONLY | O_CREAT | O_TRUNC, DEFFILEMODE);
+	bool indexWritten = indexFile >= 0 && safe_write(indexFile, records, frameCount * sizeof(tIndexTs)) >= 0;
+	if (!indexWritten)
+	{
+		esyslog("permashift: could not write index '%s' (%d)!", *indexFileName, errno);
+	}
+	if (indexFile >= 0)
+	{
+		close(indexFile);
+	}
+	free(records);
+	if (!indexWritten)
+	{
+		return false;
+	}
+
+	cRecordingInfo recordingInfo(m_recordingName);
+	recordingInfo.SetFramesPerSecond(m_framesPerSecond);
+	recordingInfo.SetData(m_title, NULL, NULL);
+	if (!recordingInfo.Write())
+	{
+		esyslog("permashift: could not write info of '%s'!", *m_recordingName);
+		return false;
+	}
+
+	// files are written front to back, so they're not created at full size
+	char* fileName = MALLOC(char, strlen(m_recordingName) + RECORDFILESUFFIXLEN);
+	m_files.Clear();
+	for (int fileNo = 1; fileNo <= m_fileStarts.Size(); fileNo++)
+	{
+		sprintf(fileName, "%s" RECORDFILESUFFIXTS, *m_recordingName, fileNo);
+		int file = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, DEFFILEMODE);
+		if (file < 0)
+		{
+			esyslog("permashift: could not open file '%s' (%d)!", fileName, errno);
+			break;
+		}
+		m_files.Append(file);
+	}
+	free(fileName);
+	return m_files.Size() == m_fileStarts.Size();
+}
+
+uint64_t cClipExporter::ExportChunk(uint64_t offset)
+{
+	// file of chunk, which must not reach into the next one
+	int file = m_fileStarts.Size() - 1;
+	while (file > 0 && m_fileStarts[file] > offset)
+	{
+		file--;
+	}
+	uint64_t fileEnd = file + 1 < m_fileStarts.Size() ? m_fileStarts[file + 1] : m_endOffset;
+	uint64_t length = min(m_pacer.ChunkLength(), fileEnd - offset);
+
+	// there's a free copy for every free engine request
+	int copy = 0;
+	while (m_copiesUsed[copy])
+	{
+		copy++;
+	}
+	if (m_copies[copy] == NULL && (m_copies[copy] = MALLOC(uchar, SAVE_CHUNK_MAX)) == NULL)
+	{
+		esyslog("permashift: out of memory for exporting clip!");
+		return 0;
+	}
+
+	int bytesCopied;
+	{
+		cBufferAccess access(m_plugin, m_bufferReceiver);
+		if (access.Receiver() == NULL)
+		{
+			esyslog("permashift: buffer has gone away while exporting clip!");
+			return 0;
+		}
+		bytesCopied = access.Receiver()->ReadBuffer(offset, m_copies[copy], (int)length);
+	}
+	if (bytesCopied <= 0)
+	{
+		esyslog("permashift: clip has been overwritten in buffer before it could be exported!");
+		return 0;
+	}
+
+	int request = m_engine->Write(m_files[file], m_copies[copy], bytesCopied, offset - m_fileStarts[file]);
+	m_chunks[request].copy = copy;
+	m_chunks[request].length = bytesCopied;
+	m_copiesUsed[copy] = true;
+	m_pacer.Submitted(cTimeMs::Now());
+	return bytesCopied;
+}
+
+bool cClipExporter::ReapCompletions()
+{
+	bool ok = true;
+	int request;
+	int64_t result;
+	uint64_t completionTime;
+	while (m_engine->Reap(&request, &result, &completionTime))
+	{
+		tChunk* chunk = &m_chunks[request];
+		m_pacer.Completed(chunk->length, completionTime);
+		if (result < 0)
+		{
+			esyslog("permashift: error writing clip to disc (%d)!", (int)-result);
+			ok = false;
+		}
+		else
+		{
+			m_bytesExported += chunk->length;
+		}
+		m_copiesUsed[chunk->copy] = false;
+		chunk->copy = -1;
+	}
+	return ok;
+}
+
+void cClipExporter::Action()
+{
+	m_exportTimer.Set();
+	m_engine = new cAsyncWriter(m_requestCount);
+	bool ok = CreateRecording();
+
+	// oldest data first, as it's overwritten first
+	uint64_t offset = m_frameIndex.Offset(0);
+	while (ok && offset < m_endOffset && Running())
+	{
+		if (!ReapCompletions())
+		{
+			ok = false;
+		}
+		else if (!m_engine->CanWrite() || m_engine->Pending() >= m_pacer.WritesAllowed())
+		{
+			m_engine->WaitForCompletion(WRITE_WAIT_MS);
+		}
+		else
+		{
+			uint64_t bytesCopied = ExportChunk(offset);
+			ok = bytesCopied > 0;
+			offset += bytesCopied;
+		}
+	}
+
+	// wait for writes in flight
+	while (m_engine->Pending() > 0)
+	{
+		m_engine->WaitForCompletion(WRITE_WAIT_MS);
+		ok = ReapCompletions() && ok;
+	}
+	delete m_engine;
+	m_engine = NULL;
+	for (int file = 0; file < m_files.Size(); file++)
+	{
+		if (close(m_files[file]) != 0)
+		{
+			esyslog("permashift: error closing clip file (%d)!", errno);
+			ok = false;
+		}
+	}
+	m_files.Clear();
+
+	if (!ok || offset < m_endOffset)
+	{
+		esyslog("permashift: exporting clip failed, removing '%s'", *m_recordingName);
+		RemoveFileOrDir(m_recordingName);
+		m_state = esFailed;
+		return;
+	}
+
+	dsyslog("permashift: exported %llu bytes of buffer in %llu ms to '%s'", (unsigned long long)m_bytesExported,
+		(unsigned long long)m_exportTimer.Elapsed(), *m_recordingName);
+#if VDRVERSNUM > 20300
+	LOCK_RECORDINGS_WRITE;
+	Recordings->AddByName(m_recordingName);
+#else
+	Recordings.AddByName(m_recordingName);
+#endif
+	m_state = esDone;
+}
@@ -0,0 +1,155 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef CLIPEXPORTER_H_
+#define CLIPEXPORTER_H_
+
+#include <vdr/thread.h>
+#include <vdr/tools.h>
+
+#include "frameindex.h"
+#include "savepacer.h"
+
+#include <atomic>
+
+class cPluginPermashift;
+class cBufferReceiver;
+class cAsyncWriter;
+
+/// exports part of a buffer as a recording of its own, while buffering goes on
+///
+/// The frames of the clip are taken from the buffer's index when the export starts.
+/// The data is copied from the buffer chunk by chunk, the oldest first (as it's overwritten
+/// first), and written by an asynchronous writer engine, so the buffer is never changed and
+/// never locked for long. The buffer is only accessed through the plugin, like by the player.
+/// If the data is overwritten before it's been copied, or the buffer goes away, the export
+/// fails and the recording is removed again.
+class cClipExporter : public cThread
+{
+public:
+
+	/// state of export
+	enum eState
+	{
+		esExporting,	///< being written
+		esDone,			///< recording complete
+		esFailed		///< given up, recording removed
+	};
+
+private:
+
+	/// plugin granting access to the buffer
+	cPluginPermashift* m_plugin;
+
+	/// receiver whose buffer is exported (never dereferenced without access granted by plugin)
+	cBufferReceiver* m_bufferReceiver;
+
+	/// name of recording, empty for the channel's name
+	cString m_title;
+
+	/// directory of recording
+	cString m_recordingName;
+
+	/// frames of clip, with the files they go to
+	cFrameIndex m_frameIndex;
+
+	/// buffer offset clip ends at
+	uint64_t m_endOffset;
+
+	/// frame rate of channel
+	double m_framesPerSecond;
+
+	/// buffer offset each file starts at (file number 1 at index 0)
+	cVector<uint64_t> m_fileStarts;
+
+	/// descriptor of each file, -1 if not open
+	cVector<int> m_files;
+
+	/// a chunk being written by the engine
+	struct tChunk
+	{
+		int copy;			///< copy of data written, -1 if chunk is not used
+		uint64_t length;	///< chunk length
+	};
+
+	/// engine for writing chunks asynchronously, NULL while not exporting
+	cAsyncWriter* m_engine;
+
+	/// number of engine requests
+	int m_requestCount;
+
+	/// chunk of each engine request
+	tChunk* m_chunks;
+
+	/// data copied from buffer, one per engine request (allocated when needed)
+	uchar** m_copies;
+
+	/// copies in use
+	bool* m_copiesUsed;
+
+	/// decides chunk length and writes in flight
+	cSavePacer m_pacer;
+
+	/// time since export started
+	cTimeMs m_exportTimer;
+
+	/// state of export (read by other threads)
+	std::atomic<eState> m_state;
+
+	/// total number of bytes to export and bytes exported until now (read by other threads)
+	std::atomic<uint64_t> m_bytesToExport;
+	std::atomic<uint64_t> m_bytesExported;
+
+	/// builds name of recording directory, VDR style, for the given start time
+	cString MakeRecordingName(const char* title, time_t startTime, int channelNumber);
+
+	/// assigns frames to files, starting a new one at the first I frame after VDR's maximum file size
+	void AssignFiles();
+
+	/// creates recording directory, writes index and info and creates the video files
+	bool CreateRecording();
+
+	/// copies the next chunk from the buffer and starts writing it,
+	/// returns bytes copied, 0 on error
+	uint64_t ExportChunk(uint64_t offset);
+
+	/// processes writes completed in the meantime, returns false on error
+	bool ReapCompletions();
+
+protected:
+
+	/// export thread
+	virtual void Action();
+
+public:
+
+	/// create exporter of the buffer of the given receiver, to a recording named by the given title
+	/// (NULL for the channel's name)
+	cClipExporter(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver, const char* title);
+
+	/// stops export (removing the recording if it's not complete) and destroys exporter
+	virtual ~cClipExporter();
+
+	/// takes the frames from the given seconds before the newest frame in buffer, lasting the
+	/// given seconds (0 for up to the newest frame), and starts exporting them in the background
+	/// returns false if there's no such part in buffer
+	bool Export(double secondsBack, double seconds);
+
+	/// state of export
+	eState State() { return m_state; }
+
+	/// directory of recording
+	const char* RecordingName() { return m_recordingName; }
+
+	/// bytes to export and exported until now
+	/// (may be called by other threads)
+	void GetProgress(uint64_t* bytesToExport, uint64_t* bytesExported);
+
+};
+
+#endif /* CLIPEXPORTER_H_ */
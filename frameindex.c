@@ -0,0 +1,219 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "frameindex.h"
+
+
+/// capacity of a new index
+#define INITIAL_FRAME_CAPACITY 1024
+
+
+cFrameIndex::cFrameIndex() :
+m_offsets(NULL), m_flags(NULL), m_fileNos(NULL), m_lengths(NULL), m_times(NULL), m_receiveTimes(NULL), m_capacity(0), m_first(0), m_count(0), m_attached(false)
+{
+}
+
+cFrameIndex::~cFrameIndex()
+{
+	Free();
+}
+
+void cFrameIndex::Free()
+{
+	if (!m_attached)
+	{
+		free(m_offsets);
+		free(m_flags);
+		free(m_fileNos);
+		free(m_lengths);
+		free(m_times);
+		free(m_receiveTimes);
+	}
+	m_offsets = NULL;
+	m_flags = NULL;
+	m_fileNos = NULL;
+	m_lengths = NULL;
+	m_times = NULL;
+	m_receiveTimes = NULL;
+	m_capacity = 0;
+	m_attached = false;
+}
+
+bool cFrameIndex::Resize(int capacity)
+{
+	uint64_t* offsets = MALLOC(uint64_t, capacity);
+	uchar* flags = MALLOC(uchar, capacity);
+	uint16_t* fileNos = MALLOC(uint16_t, capacity);
+	uint32_t* lengths = MALLOC(uint32_t, capacity);
+	int64_t* times = MALLOC(int64_t, capacity);
+	uint64_t* receiveTimes = MALLOC(uint64_t, capacity);
+	if (offsets == NULL || flags == NULL || fileNos == NULL || lengths == NULL || times == NULL || receiveTimes == NULL)
+	{
+		esyslog("permashift: out of memory for frame index!");
+		free(offsets);
+		free(flags);
+		free(fileNos);
+		free(lengths);
+		free(times);
+		free(receiveTimes);
+		return false;
+	}
+
+	// copy frames to start of new arrays
+	for (int frame = 0; frame < m_count; frame++)
+	{
+		int position = Position(frame);
+		offsets[frame] = m_offsets[position];
+		flags[frame] = m_flags[position];
+		fileNos[frame] = m_fileNos[position];
+		lengths[frame] = m_lengths[position];
+		times[frame] = m_times[position];
+		receiveTimes[frame] = m_receiveTimes[position];
+	}
+
+	Free();
+	m_offsets = offsets;
+	m_flags = flags;
+	m_fileNos = fileNos;
+	m_lengths = lengths;
+	m_times = times;
+	m_receiveTimes = receiveTimes;
+	m_capacity = capacity;
+	m_first = 0;
+	return true;
+}
+
+bool cFrameIndex::Reserve(int frameCount)
+{
+	// attached memory can't grow
+	if (m_attached)
+	{
+		return frameCount <= m_capacity;
+	}
+
+	int capacity = max(m_capacity, INITIAL_FRAME_CAPACITY);
+	while (capacity < frameCount)
+	{
+		capacity *= 2;
+	}
+	if (capacity == m_capacity)
+	{
+		return true;
+	}
+	dsyslog("permashift: frame index capacity %d\n", capacity);
+	return Resize(capacity);
+}
+
+uint64_t cFrameIndex::MemorySize(int capacity)
+{
+	return (uint64_t)capacity * (sizeof(*m_offsets) + sizeof(*m_times) + sizeof(*m_receiveTimes) +
+		sizeof(*m_lengths) + sizeof(*m_fileNos) + sizeof(*m_flags));
+}
+
+void cFrameIndex::Attach(uchar* memory, int capacity)
+{
+	Free();
+
+	// arrays ordered by alignment
+	m_offsets = (uint64_t*)memory;
+	m_times = (int64_t*)(m_offsets + capacity);
+	m_receiveTimes = (uint64_t*)(m_times + capacity);
+	m_lengths = (uint32_t*)(m_receiveTimes + capacity);
+	m_fileNos = (uint16_t*)(m_lengths + capacity);
+	m_flags = (uchar*)(m_fileNos + capacity);
+	m_capacity = capacity;
+	m_attached = true;
+	m_first = 0;
+	m_count = 0;
+}
+
+void cFrameIndex::Restore(int first, int count)
+{
+	if (first < 0 || first >= m_capacity || count < 0 || count > m_capacity)
+	{
+		Clear();
+		return;
+	}
+	m_first = first;
+	m_count = count;
+}
+
+bool cFrameIndex::Add(bool iFrame, uint64_t offset, int64_t time, uint64_t receiveTime)
+{
+	if (m_count == m_capacity && !Reserve(m_count + 1))
+	{
+		if (!m_attached || m_capacity == 0)
+		{
+			return false;
+		}
+		// attached index is full, make room by dropping the oldest frame
+		DropFirst();
+	}
+
+	int position = Position(m_count);
+	m_offsets[position] = offset;
+	m_flags[position] = iFrame ? IndependentFrame : 0;
+	m_fileNos[position] = 1;
+	m_lengths[position] = 0;
+	m_times[position] = time;
+	m_receiveTimes[position] = receiveTime;
+	m_count++;
+	return true;
+}
+
+void cFrameIndex::DropFirst(int count)
+{
+	count = min(count, m_count);
+	if (count <= 0) return;
+
+	m_first = Position(count);
+	m_count -= count;
+}
+
+void cFrameIndex::DropLast(int count)
+{
+	m_count -= min(count, m_count);
+}
+
+int cFrameIndex::Find(uint64_t offset)
+{
+	int low = 0;
+	int high = m_count;
+	while (low < high)
+	{
+		int middle = low + (high - low) / 2;
+		if (Offset(middle) < offset)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+int cFrameIndex::FindTime(int64_t time)
+{
+	int low = 0;
+	int high = m_count;
+	while (low < high)
+	{
+		int middle = low + (high - low) / 2;
+		if (Time(middle) < time)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
@@ -0,0 +1,132 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef FRAMEINDEX_H_
+#define FRAMEINDEX_H_
+
+#include <vdr/tools.h>
+
+/// stream time ticks per second
+#define TIMESTAMP_FREQUENCY 90000
+
+/// index of frames in buffer, kept in circular arrays (one per attribute)
+///
+/// Frames are addressed by their position in the index, 0 being the oldest.
+/// Adding and dropping frames at either end doesn't allocate memory, unless
+/// the index has to grow.
+///
+/// The arrays can be placed in memory given by the caller (a mapped file, see cBufferFile).
+/// Such an index doesn't grow, adding to a full index drops the oldest frame.
+class cFrameIndex
+{
+private:
+
+	uint64_t* m_offsets;	///< offset, relative to first data written to buffer
+	uchar* m_flags;			///< frame flags (I frame or not)
+	uint16_t* m_fileNos;	///< file number to write to (if splitting)
+	uint32_t* m_lengths;	///< frame length, 0 if not known (yet)
+	int64_t* m_times;		///< stream time (90 kHz, unwrapped, never decreasing)
+	uint64_t* m_receiveTimes;	///< system time of reception (ms, see cTimeMs::Now())
+
+	int m_capacity;			///< number of frames fitting into arrays (power of two)
+	int m_first;			///< array position of oldest frame
+	int m_count;			///< number of frames in index
+	bool m_attached;		///< arrays are in memory given by Attach()
+
+	/// array position of frame
+	int Position(int frame) { return (m_first + frame) & (m_capacity - 1); }
+
+	/// (re)allocates arrays for given capacity, keeping frames in index
+	bool Resize(int capacity);
+
+	/// frees arrays (unless attached)
+	void Free();
+
+public:
+
+	/// frame flags
+	enum
+	{
+		IndependentFrame = 0x01		///< I frame
+	};
+
+	/// create empty index
+	cFrameIndex();
+
+	/// destroy index and its arrays
+	virtual ~cFrameIndex();
+
+	/// makes room for at least the given number of frames
+	bool Reserve(int frameCount);
+
+	/// bytes of memory needed for arrays of the given capacity
+	static uint64_t MemorySize(int capacity);
+
+	/// places arrays in given memory (of MemorySize() bytes, capacity being a power of two),
+	/// dropping all frames; frames found there can be restored with Restore()
+	void Attach(uchar* memory, int capacity);
+
+	/// takes frames found in attached memory, starting at given array position
+	void Restore(int first, int count);
+
+	/// array position of oldest frame (see Restore())
+	int First() { return m_first; }
+
+	/// adds a frame at the end, returns false if out of memory
+	bool Add(bool iFrame, uint64_t offset, int64_t time = 0, uint64_t receiveTime = 0);
+
+	/// number of frames in index
+	int Count() { return m_count; }
+
+	/// buffer offset of frame
+	uint64_t Offset(int frame) { return m_offsets[Position(frame)]; }
+
+	/// is frame an I frame?
+	bool IFrame(int frame) { return (m_flags[Position(frame)] & IndependentFrame) != 0; }
+
+	/// file number frame will be written to
+	unsigned int FileNo(int frame) { return m_fileNos[Position(frame)]; }
+
+	/// sets file number frame will be written to
+	void SetFileNo(int frame, unsigned int fileNo) { m_fileNos[Position(frame)] = fileNo; }
+
+	/// length of frame, 0 if it has not been set
+	uint32_t Length(int frame) { return m_lengths[Position(frame)]; }
+
+	/// sets length of frame (when it is complete)
+	void SetLength(int frame, uint32_t length) { m_lengths[Position(frame)] = length; }
+
+	/// stream time of frame (90 kHz)
+	int64_t Time(int frame) { return m_times[Position(frame)]; }
+
+	/// system time frame has been received at (ms)
+	uint64_t ReceiveTime(int frame) { return m_receiveTimes[Position(frame)]; }
+
+	/// drops oldest frames
+	void DropFirst(int count = 1);
+
+	/// drops newest frames
+	void DropLast(int count = 1);
+
+	/// drops all frames starting before given buffer offset
+	void DropBefore(uint64_t offset) { DropFirst(Find(offset)); }
+
+	/// drops all frames
+	void Clear() { m_first = 0; m_count = 0; }
+
+	/// binary search for first frame starting at or after given buffer offset,
+	/// returns Count() if there's none
+	int Find(uint64_t offset);
+
+	/// binary search for first frame at or after given stream time,
+	/// returns Count() if there's none
+	int FindTime(int64_t time);
+
+};
+
+#endif /* FRAMEINDEX_H_ */
@@ -0,0 +1,137 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE FrameIndex
+
+#include "frameindex.h"
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_CASE(WrapAndGrow)
+{
+	cFrameIndex index;
+
+	// fill, drop half, fill again beyond initial capacity
+	for (uint64_t frame = 0; frame < 1000; frame++)
+	{
+		BOOST_REQUIRE(index.Add(frame % 10 == 0, frame * 100));
+	}
+	index.DropFirst(500);
+	for (uint64_t frame = 1000; frame < 3000; frame++)
+	{
+		BOOST_REQUIRE(index.Add(frame % 10 == 0, frame * 100));
+	}
+
+	BOOST_CHECK_EQUAL(index.Count(), 2500);
+	for (int frame = 0; frame < index.Count(); frame++)
+	{
+		BOOST_CHECK_EQUAL(index.Offset(frame), (uint64_t)(frame + 500) * 100);
+		BOOST_CHECK_EQUAL(index.IFrame(frame), (frame + 500) % 10 == 0);
+	}
+}
+
+
+BOOST_AUTO_TEST_CASE(FindAndDrop)
+{
+	cFrameIndex index;
+	for (uint64_t frame = 0; frame < 100; frame++)
+	{
+		index.Add(false, frame * 188);
+	}
+
+	BOOST_CHECK_EQUAL(index.Find(0), 0);
+	BOOST_CHECK_EQUAL(index.Find(188 * 10), 10);
+	BOOST_CHECK_EQUAL(index.Find(188 * 10 + 1), 11);
+	BOOST_CHECK_EQUAL(index.Find(188 * 100), 100);
+
+	index.DropBefore(188 * 10 + 1);
+	BOOST_CHECK_EQUAL(index.Count(), 89);
+	BOOST_CHECK_EQUAL(index.Offset(0), 188 * 11);
+
+	index.SetFileNo(88, 3);
+	index.DropLast(10);
+	BOOST_CHECK_EQUAL(index.Count(), 79);
+	BOOST_CHECK_EQUAL(index.Offset(78), 188 * 89);
+	BOOST_CHECK_EQUAL(index.FileNo(78), 1);
+}
+
+
+BOOST_AUTO_TEST_CASE(FindTime)
+{
+	cFrameIndex index;
+	for (int64_t frame = 0; frame < 100; frame++)
+	{
+		index.Add(false, frame * 188, 1000 + frame * 3600, 5000 + frame * 40);
+	}
+	index.DropFirst(20);
+
+	BOOST_CHECK_EQUAL(index.FindTime(0), 0);
+	BOOST_CHECK_EQUAL(index.FindTime(1000 + 50 * 3600), 30);
+	BOOST_CHECK_EQUAL(index.FindTime(1000 + 50 * 3600 + 1), 31);
+	BOOST_CHECK_EQUAL(index.FindTime(1000 + 100 * 3600), 80);
+	BOOST_CHECK_EQUAL(index.ReceiveTime(30), 5000 + 50 * 40);
+}
+
+
+BOOST_AUTO_TEST_CASE(LengthsSurviveGrowing)
+{
+	cFrameIndex index;
+
+	// complete each frame when the next one arrives, as done for I frames
+	for (uint64_t frame = 0; frame < 3000; frame++)
+	{
+		if (index.Count() > 0)
+		{
+			index.SetLength(index.Count() - 1, frame * 1000 - index.Offset(index.Count() - 1));
+		}
+		BOOST_REQUIRE(index.Add(true, frame * 1000, frame * 3600 * 12));
+		if (frame == 1500)
+		{
+			index.DropFirst(1000);
+		}
+	}
+
+	BOOST_CHECK_EQUAL(index.Count(), 2000);
+	BOOST_CHECK_EQUAL(index.Length(index.Count() - 1), 0);
+	for (int frame = 0; frame < index.Count() - 1; frame++)
+	{
+		BOOST_CHECK_EQUAL(index.Length(frame), 1000);
+	}
+	BOOST_CHECK_EQUAL(index.Offset(index.FindTime(2500 * 3600 * 12)), 2500 * 1000);
+}
+
+
+BOOST_AUTO_TEST_CASE(AttachedIndexDropsOldest)
+{
+	uchar memory[cFrameIndex::MemorySize(64)];
+	cFrameIndex index;
+	index.Attach(memory, 64);
+
+	// full index doesn't grow, but makes room for new frames
+	for (uint64_t frame = 0; frame < 100; frame++)
+	{
+		BOOST_REQUIRE(index.Add(frame % 10 == 0, frame * 1000, frame * 3600));
+	}
+	BOOST_CHECK_EQUAL(index.Count(), 64);
+	BOOST_CHECK_EQUAL(index.Offset(0), 36 * 1000);
+	BOOST_CHECK(!index.Reserve(65));
+
+	// another index finds the frames in the same memory
+	cFrameIndex restored;
+	restored.Attach(memory, 64);
+	restored.Restore(index.First(), index.Count());
+	BOOST_CHECK_EQUAL(restored.Count(), 64);
+	for (int frame = 0; frame < restored.Count(); frame++)
+	{
+		BOOST_CHECK_EQUAL(restored.Offset(frame), index.Offset(frame));
+		BOOST_CHECK_EQUAL(restored.IFrame(frame), index.IFrame(frame));
+		BOOST_CHECK_EQUAL(restored.Time(frame), index.Time(frame));
+	}
+}
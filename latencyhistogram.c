@@ -0,0 +1,81 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "latencyhistogram.h"
+
+// names of probes in dumps
+static const char* s_probeNames[lpCount] = { "receive", "analyze", "activate", "write_data", "save_chunk", "save_all" };
+
+
+cLatencyHistogram g_latencyHistograms[lpCount];
+
+
+void cLatencyHistogram::Add(uint64_t ns)
+{
+	m_buckets[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(ns, std::memory_order_relaxed);
+
+	uint64_t longest = m_max.load(std::memory_order_relaxed);
+	while (ns > longest && !m_max.compare_exchange_weak(longest, ns, std::memory_order_relaxed))
+	{
+	}
+}
+
+void cLatencyHistogram::Reset()
+{
+	for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		m_buckets[bucket] = 0;
+	}
+	m_count = 0;
+	m_sum = 0;
+	m_max = 0;
+}
+
+cString cLatencyHistogram::Dump(const char* name)
+{
+	uint64_t count = Count();
+	cString dump = cString::sprintf("%s: count %llu, mean %.1f us, max %.1f us", name, (unsigned long long)count,
+		count > 0 ? m_sum / 1000.0 / count : 0.0, m_max / 1000.0);
+	for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		uint64_t bucketCount = Count(bucket);
+		if (bucketCount == 0) continue;
+
+		// upper bound of bucket, the last one has none
+		if (bucket < LATENCY_BUCKETS - 1)
+		{
+			dump = cString::sprintf("%s\n  < %.3f us: %llu", *dump, (1ull << bucket) / 1000.0, (unsigned long long)bucketCount);
+		}
+		else
+		{
+			dump = cString::sprintf("%s\n  longer: %llu", *dump, (unsigned long long)bucketCount);
+		}
+	}
+	return dump;
+}
+
+
+cString DumpLatencyHistograms()
+{
+	cString dump = "";
+	for (int probe = 0; probe < lpCount; probe++)
+	{
+		dump = cString::sprintf("%s%s%s", *dump, probe > 0 ? "\n" : "", *g_latencyHistograms[probe].Dump(s_probeNames[probe]));
+	}
+	return dump;
+}
+
+void ResetLatencyHistograms()
+{
+	for (int probe = 0; probe < lpCount; probe++)
+	{
+		g_latencyHistograms[probe].Reset();
+	}
+}
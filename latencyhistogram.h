@@ -0,0 +1,104 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef LATENCYHISTOGRAM_H_
+#define LATENCYHISTOGRAM_H_
+
+#include <vdr/tools.h>
+#include <atomic>
+#include <time.h>
+
+/// number of histogram buckets, the last one taking all longer durations
+#define LATENCY_BUCKETS 32
+
+/// code paths measured
+enum eLatencyProbe
+{
+	lpReceive,				///< cBufferReceiver::Receive()
+	lpAnalyze,				///< analysis pass of cBufferReceiver (memory recording phase)
+	lpActivate,				///< cBufferReceiver::ActivatePreRecording()
+	lpWriteData,			///< cOverwritingRingBuffer::WriteData()
+	lpSaveChunk,			///< cBufferWriter::SaveChunk()
+	lpSaveAll,				///< cBufferWriter::SaveAll()
+	lpCount
+};
+
+/// monotonic time (ns), used for all latency and wait measurements of the plugin
+inline uint64_t MonotonicNanoSeconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// histogram of durations in buckets of powers of two (nanoseconds)
+///
+/// Bucket 0 counts durations below 1 ns, bucket i those from 2^(i-1) to 2^i ns.
+/// Adding is lock-free, so any thread may add while another one dumps.
+class cLatencyHistogram
+{
+private:
+
+	std::atomic<uint64_t> m_buckets[LATENCY_BUCKETS];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;			///< total of all durations (ns)
+	std::atomic<uint64_t> m_max;			///< longest duration (ns)
+
+public:
+
+	cLatencyHistogram() { Reset(); }
+
+	/// bucket counting the given duration
+	static int Bucket(uint64_t ns) { return ns == 0 ? 0 : min(64 - __builtin_clzll(ns), LATENCY_BUCKETS - 1); }
+
+	/// counts a duration
+	void Add(uint64_t ns);
+
+	/// number of durations in bucket
+	uint64_t Count(int bucket) { return m_buckets[bucket].load(std::memory_order_relaxed); }
+
+	/// number of all durations
+	uint64_t Count() { return m_count.load(std::memory_order_relaxed); }
+
+	/// forgets all durations
+	void Reset();
+
+	/// text listing count, mean and maximum, and the buckets used
+	cString Dump(const char* name);
+};
+
+/// adds the lifetime of a scope to a histogram
+class cLatencyTimer
+{
+private:
+	cLatencyHistogram* m_histogram;
+	uint64_t m_start;
+
+public:
+	cLatencyTimer(cLatencyHistogram* histogram) : m_histogram(histogram), m_start(MonotonicNanoSeconds()) {}
+	~cLatencyTimer() { m_histogram->Add(MonotonicNanoSeconds() - m_start); }
+};
+
+/// histograms of all probes
+extern cLatencyHistogram g_latencyHistograms[lpCount];
+
+/// text of all histograms used
+cString DumpLatencyHistograms();
+
+/// forgets durations of all histograms
+void ResetLatencyHistograms();
+
+/// Measures the rest of the enclosing scope for the given probe, when built with
+/// PERMASHIFT_LATENCY_HISTOGRAMS (LATENCY=1 in Makefile). Otherwise there's no code at all.
+#ifdef PERMASHIFT_LATENCY_HISTOGRAMS
+#define LATENCY_PROBE(probe) cLatencyTimer latencyTimer(&g_latencyHistograms[probe])
+#else
+#define LATENCY_PROBE(probe)
+#endif
+
+#endif /* LATENCYHISTOGRAM_H_ */
@@ -0,0 +1,43 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE LatencyHistogram
+
+#include "latencyhistogram.h"
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_CASE(BucketsArePowersOfTwo)
+{
+	BOOST_CHECK_EQUAL(cLatencyHistogram::Bucket(0), 0);
+	BOOST_CHECK_EQUAL(cLatencyHistogram::Bucket(1), 1);
+	BOOST_CHECK_EQUAL(cLatencyHistogram::Bucket(1023), 10);
+	BOOST_CHECK_EQUAL(cLatencyHistogram::Bucket(1024), 11);
+	BOOST_CHECK_EQUAL(cLatencyHistogram::Bucket(~0ull), LATENCY_BUCKETS - 1);
+}
+
+BOOST_AUTO_TEST_CASE(CountsDurations)
+{
+	cLatencyHistogram histogram;
+	for (int i = 0; i < 100; i++)
+	{
+		histogram.Add(1500);
+	}
+	histogram.Add(5000000);
+	BOOST_CHECK_EQUAL(histogram.Count(), 101);
+	BOOST_CHECK_EQUAL(histogram.Count(cLatencyHistogram::Bucket(1500)), 100);
+	BOOST_CHECK_EQUAL(histogram.Count(cLatencyHistogram::Bucket(5000000)), 1);
+	BOOST_TEST_MESSAGE(*histogram.Dump("test"));
+	BOOST_CHECK(strstr(histogram.Dump("test"), "max 5000.0 us") != NULL);
+
+	histogram.Reset();
+	BOOST_CHECK_EQUAL(histogram.Count(), 0);
+	BOOST_CHECK_EQUAL(histogram.Count(cLatencyHistogram::Bucket(1500)), 0);
+}
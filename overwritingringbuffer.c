@@ -7,10 +7,35 @@
 
 
 #include "overwritingringbuffer.h"
+#include "asyncwriter.h"
+#include "latencyhistogram.h"
 
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 
-cOverwritingRingBuffer::cOverwritingRingBuffer(uint64_t bufferSize) :
-m_buffer(NULL), m_bufferLength(bufferSize), m_dataStart(0), m_dataLength(0), m_dataWritten(0)
+
+/// least common multiple, used for combining page size and block size
+static uint64_t LeastCommonMultiple(uint64_t a, uint64_t b)
+{
+	uint64_t x = a, y = b;
+	while (y != 0)
+	{
+		uint64_t rest = x % y;
+		x = y;
+		y = rest;
+	}
+	return a / x * b;
+}
+
+
+cOverwritingRingBuffer::cOverwritingRingBuffer(uint64_t bufferSize, cSegmentPool* pool) :
+m_buffer(NULL), m_bufferLength(bufferSize), m_mirrored(false), m_dataStart(0), m_dataLength(0), m_dataWritten(0),
+m_pool(pool), m_ownPool(false), m_segmentSize(0), m_segmentCount(0), m_segmentSlots(NULL), m_segmentMemory(NULL),
+m_readPosition(0), m_readLength(0), m_residentSegments(0), m_file(-1), m_fileOffset(0),
+m_spillFile(-1), m_spillStates(NULL), m_spillEngine(NULL), m_spillsInFlight(0), m_spillSegment(0), m_dropSegment(-1),
+m_memorySegments(0), m_spillBehind(false)
 {
 	if (bufferSize > 0)
 	{
@@ -21,44 +46,366 @@ m_buffer(NULL), m_bufferLength(bufferSize), m_dataStart(0), m_dataLength(0), m_d
 cOverwritingRingBuffer::~cOverwritingRingBuffer()
 {
 	dsyslog("permashift: OverwritingRingBuffer, free \n");
-	free(m_buffer);
+	Deallocate();
+	if (m_ownPool)
+	{
+		delete m_pool;
+	}
 }
 
-bool cOverwritingRingBuffer::Allocate(uint64_t bufferSize)
+bool cOverwritingRingBuffer::Allocate(uint64_t bufferSize, uint64_t blockSize)
 {
-	m_bufferLength = bufferSize;
-
 	dsyslog("permashift: OverwritingRingBuffer, Allocate \n");
-	uchar* tempBuffer = (uchar*)realloc(m_buffer, m_bufferLength);
-	if (tempBuffer == NULL)
+
+	Deallocate();
+
+	// a mirrored buffer has to consist of whole pages
+	uint64_t mirrorGranularity = LeastCommonMultiple(sysconf(_SC_PAGESIZE), blockSize);
+	if (m_pool == NULL)
+	{
+		m_pool = new cSegmentPool(BUFFER_SEGMENT_SIZE, bufferSize >= mirrorGranularity);
+		m_ownPool = true;
+	}
+	m_segmentSize = m_pool->SegmentSize();
+
+	if (m_pool->MemoryFile() >= 0)
+	{
+		if (!AllocateMirrored(max(bufferSize / mirrorGranularity, (uint64_t)1) * mirrorGranularity))
+		{
+			m_bufferLength = 0;
+			return false;
+		}
+	}
+	else
+	{
+		m_bufferLength = bufferSize / blockSize * blockSize;
+	}
+
+	// prepare segment table, memory will follow data
+	m_segmentCount = (m_bufferLength + m_segmentSize - 1) / m_segmentSize;
+	m_segmentSlots = MALLOC(int, m_segmentCount);
+	m_segmentMemory = MALLOC(uchar*, m_segmentCount);
+	if (m_segmentSlots == NULL || m_segmentMemory == NULL)
 	{
-		// if it fails, free "old" memory and report error
 		dsyslog("permashift: OverwritingRingBuffer, free due to problem\n");
-		free(m_buffer);
-		m_bufferLength = 0;
+		Deallocate();
+		return false;
+	}
+	for (int segment = 0; segment < m_segmentCount; segment++)
+	{
+		m_segmentSlots[segment] = -1;
+		m_segmentMemory[segment] = NULL;
+	}
+
+	return true;
+}
+
+bool cOverwritingRingBuffer::AllocateMirrored(uint64_t bufferSize)
+{
+	// reserve address space for both copies, segments are mapped into both halves later on
+	uchar* area = (uchar*)mmap(NULL, 2 * bufferSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+	{
+		esyslog("permashift: could not reserve address space for buffer (%d)!", errno);
+		return false;
 	}
-	m_buffer = tempBuffer;
 
-	return m_buffer != NULL;
+	m_buffer = area;
+	m_bufferLength = bufferSize;
+	m_mirrored = true;
+	dsyslog("permashift: OverwritingRingBuffer, using mirrored memory\n");
+	return true;
 }
 
-void cOverwritingRingBuffer::WriteData(uchar* Data, uint64_t Length)
+void cOverwritingRingBuffer::Deallocate()
 {
-	if (Length > m_bufferLength) return;
+	// segments being spilled have to stay until written
+	DisableSpill();
+
+	for (int segment = 0; segment < m_segmentCount; segment++)
+	{
+		if (m_segmentSlots[segment] >= 0)
+		{
+			ReleaseSegment(segment);
+		}
+	}
+	free(m_segmentSlots);
+	free(m_segmentMemory);
+	m_segmentSlots = NULL;
+	m_segmentMemory = NULL;
+	m_segmentCount = 0;
+	m_file = -1;
+
+	if (m_mirrored)
+	{
+		munmap(m_buffer, 2 * m_bufferLength);
+		m_mirrored = false;
+	}
+	m_buffer = NULL;
+
+	// whatever was in the buffer is gone
+	m_dataStart = 0;
+	m_dataLength = 0;
+	m_readLength = 0;
+	m_pinPositions.Clear();
+	m_pinLengths.Clear();
+}
+
+bool cOverwritingRingBuffer::SegmentOverlaps(int segment, uint64_t position, uint64_t length)
+{
+	if (length == 0) return false;
+
+	uint64_t segmentStart = SegmentStart(segment);
+	uint64_t segmentEnd = segmentStart + SegmentLength(segment);
+	uint64_t end = position + length;
+	if (end <= m_bufferLength)
+	{
+		return segmentStart < end && segmentEnd > position;
+	}
+	// range wraps around
+	return segmentEnd > position || segmentStart < end - m_bufferLength;
+}
+
+bool cOverwritingRingBuffer::AcquireSegments(uint64_t position, uint64_t length)
+{
+	uint64_t bytesChecked = 0;
+	while (bytesChecked < length)
+	{
+		uint64_t bufferPosition = (position + bytesChecked) % m_bufferLength;
+		int segment = bufferPosition / m_segmentSize;
+		if (m_segmentMemory[segment] == NULL && !AcquireSegment(segment))
+		{
+			return false;
+		}
+		bytesChecked += SegmentStart(segment) + SegmentLength(segment) - bufferPosition;
+	}
+	return true;
+}
+
+bool cOverwritingRingBuffer::AcquireSegment(int segment)
+{
+	if (m_file >= 0)
+	{
+		return AcquireFileSegment(segment);
+	}
+
+	bool reused = false;
+	int slot = m_pool->Get(&reused);
+	if (slot < 0)
+	{
+		return false;
+	}
+
+	if (m_mirrored)
+	{
+		// map segment into both halves, reused memory is present already, so map its pages right away
+		uchar* address = m_buffer + SegmentStart(segment);
+		uint64_t length = SegmentLength(segment);
+		int flags = MAP_SHARED | MAP_FIXED | (reused ? MAP_POPULATE : 0);
+		if (mmap(address, length, PROT_READ | PROT_WRITE, flags, m_pool->MemoryFile(), m_pool->Offset(slot)) == MAP_FAILED ||
+			mmap(address + m_bufferLength, length, PROT_READ | PROT_WRITE, flags, m_pool->MemoryFile(), m_pool->Offset(slot)) == MAP_FAILED)
+		{
+			esyslog("permashift: could not map buffer segment (%d)!", errno);
+			mmap(address, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+			m_pool->Put(slot);
+			return false;
+		}
+		m_segmentMemory[segment] = address;
+	}
+	else
+	{
+		m_segmentMemory[segment] = m_pool->Memory(slot);
+	}
+	m_segmentSlots[segment] = slot;
+	m_residentSegments++;
+	return true;
+}
+
+bool cOverwritingRingBuffer::AcquireFileSegment(int segment)
+{
+	// shared mappings, so data written ends up in the file
+	uint64_t length = SegmentLength(segment);
+	off_t offset = m_fileOffset + SegmentStart(segment);
+	uchar* address = NULL;
+	if (m_mirrored)
+	{
+		address = m_buffer + SegmentStart(segment);
+		if (mmap(address, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_file, offset) == MAP_FAILED ||
+			mmap(address + m_bufferLength, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_file, offset) == MAP_FAILED)
+		{
+			esyslog("permashift: could not map buffer file segment (%d)!", errno);
+			mmap(address, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+			return false;
+		}
+	}
+	else
+	{
+		address = (uchar*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, offset);
+		if (address == MAP_FAILED)
+		{
+			esyslog("permashift: could not map buffer file segment (%d)!", errno);
+			return false;
+		}
+	}
+	m_segmentMemory[segment] = address;
+	m_segmentSlots[segment] = segment;
+	m_residentSegments++;
+	return true;
+}
+
+void cOverwritingRingBuffer::ReleaseSegment(int segment)
+{
+	if (m_mirrored)
+	{
+		// replace both mappings by reserved address space
+		uchar* address = m_buffer + SegmentStart(segment);
+		uint64_t length = SegmentLength(segment);
+		mmap(address, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		mmap(address + m_bufferLength, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	}
+	else if (m_file >= 0)
+	{
+		munmap(m_segmentMemory[segment], SegmentLength(segment));
+	}
+	if (m_file < 0)
+	{
+		m_pool->Put(m_segmentSlots[segment]);
+	}
+	m_segmentSlots[segment] = -1;
+	m_segmentMemory[segment] = NULL;
+	m_residentSegments--;
+}
+
+void cOverwritingRingBuffer::ReleaseUnusedSegments()
+{
+	if (m_spillFile >= 0)
+	{
+		ReapSpilled();
+	}
+
+	for (int segment = 0; segment < m_segmentCount; segment++)
+	{
+		// spilled data can be loaded again, data being spilled has to stay until written
+		eSpillState spillState = m_spillFile >= 0 ? (eSpillState)m_spillStates[segment] : ssMemory;
+		if (m_segmentSlots[segment] >= 0 && spillState != ssWriting &&
+			(spillState == ssSpilled || !SegmentOverlaps(segment, m_dataStart, m_dataLength)) &&
+			!SegmentOverlaps(segment, m_readPosition, m_readLength) &&
+			!SegmentPinned(segment))
+		{
+			ReleaseSegment(segment);
+		}
+	}
+}
+
+bool cOverwritingRingBuffer::SegmentPinned(int segment)
+{
+	for (int pin = 0; pin < m_pinLengths.Size(); pin++)
+	{
+		if (SegmentOverlaps(segment, m_pinPositions[pin], m_pinLengths[pin]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+int cOverwritingRingBuffer::AddPin(uint64_t position, uint64_t length)
+{
+	// reuse an unused pin if possible
+	int pin = 0;
+	while (pin < m_pinLengths.Size() && m_pinLengths[pin] != 0)
+	{
+		pin++;
+	}
+	if (pin == m_pinLengths.Size())
+	{
+		m_pinPositions.Append(0);
+		m_pinLengths.Append(0);
+	}
+	m_pinPositions[pin] = position;
+	m_pinLengths[pin] = length;
+	return pin;
+}
+
+int cOverwritingRingBuffer::PinReadData()
+{
+	if (m_readLength == 0) return -1;
+
+	return AddPin(m_readPosition, m_readLength);
+}
+
+int cOverwritingRingBuffer::PinData(uint64_t start, uint64_t length)
+{
+	if (length == 0 || start + length > m_dataLength) return -1;
+
+	return AddPin((m_dataStart + start) % m_bufferLength, length);
+}
+
+uint64_t cOverwritingRingBuffer::PinnedData(int pin, uint64_t offset, uchar** Data, uint64_t MaxLength)
+{
+	if (pin < 0 || pin >= m_pinLengths.Size() || offset >= m_pinLengths[pin]) return 0;
+
+	uint64_t position = (m_pinPositions[pin] + offset) % m_bufferLength;
+	uint64_t bytesReturned = ContiguousLength(position, min(MaxLength, m_pinLengths[pin] - offset));
+	if (bytesReturned > 0)
+	{
+		int segment = position / m_segmentSize;
+		*Data = m_segmentMemory[segment] + position - SegmentStart(segment);
+	}
+	return bytesReturned;
+}
+
+void cOverwritingRingBuffer::ShrinkPin(int pin, uint64_t length)
+{
+	if (pin < 0 || pin >= m_pinLengths.Size() || length >= m_pinLengths[pin]) return;
+
+	m_pinLengths[pin] = length;
+	ReleaseUnusedSegments();
+}
+
+void cOverwritingRingBuffer::Unpin(int pin)
+{
+	if (pin < 0 || pin >= m_pinLengths.Size()) return;
+
+	m_pinLengths[pin] = 0;
+	ReleaseUnusedSegments();
+}
+
+bool cOverwritingRingBuffer::WriteData(uchar* Data, uint64_t Length)
+{
+	LATENCY_PROBE(lpWriteData);
+
+	if (Length > m_bufferLength) return false;
 
-	uint64_t previousDataLength = m_dataLength;
 	uint64_t dataEnd = (m_dataStart + m_dataLength) % m_bufferLength;
-	if (dataEnd + Length <= m_bufferLength)
+	if (m_spillFile >= 0)
 	{
-		// fits without wrap-around
+		PrepareSpilledWrite(dataEnd, Length);
+	}
+	uint64_t previousDataLength = m_dataLength;
+	if (!AcquireSegments(dataEnd, Length))
+	{
+		esyslog("permashift: out of buffer memory, dropping %llu bytes!", (unsigned long long)Length);
+		return false;
+	}
+
+	if (m_mirrored)
+	{
+		// contiguous even if wrapping around
 		memcpy(m_buffer + dataEnd, Data, Length);
 	}
 	else
 	{
-		// write with wrap-around
-		uint64_t bytesTillEnd = m_bufferLength - dataEnd;
-		memcpy(m_buffer + dataEnd, Data, bytesTillEnd);
-		memcpy(m_buffer, Data + bytesTillEnd, Length - bytesTillEnd);
+		// write piecewise up to the end of each segment
+		uint64_t bytesCopied = 0;
+		while (bytesCopied < Length)
+		{
+			uint64_t bufferPosition = (dataEnd + bytesCopied) % m_bufferLength;
+			int segment = bufferPosition / m_segmentSize;
+			uint64_t bytesToCopy = min(Length - bytesCopied, SegmentStart(segment) + SegmentLength(segment) - bufferPosition);
+			memcpy(m_segmentMemory[segment] + bufferPosition - SegmentStart(segment), Data + bytesCopied, bytesToCopy);
+			bytesCopied += bytesToCopy;
+		}
 	}
 
 	if (m_dataLength + Length <= m_bufferLength)
@@ -83,21 +430,33 @@ void cOverwritingRingBuffer::WriteData(uchar* Data, uint64_t Length)
 	{
 		dsyslog("permashift: %d MB live video data in buffer \n", 100 * (uint)(m_dataLength / (100ull * 1024 * 1024)));
 	}
+
+	if (m_spillFile >= 0)
+	{
+		Spill();
+	}
+	return true;
 }
 
 uint64_t cOverwritingRingBuffer::ReadData(uchar** Data, uint64_t MaxLength)
 {
-	*Data = m_buffer + m_dataStart;
-	uint64_t bytesReturned = 0;
-	uint64_t bytesTillEnd = min(m_dataLength, m_bufferLength - m_dataStart);
-	if (bytesTillEnd < MaxLength)
+	// data passed last time may be given back now
+	m_readLength = 0;
+	ReleaseUnusedSegments();
+
+	if (m_dataLength == 0)
 	{
-		bytesReturned = bytesTillEnd;
+		return 0;
 	}
-	else
+
+	uint64_t bytesReturned = ContiguousLength(m_dataStart, min(MaxLength, m_dataLength));
+	if (bytesReturned == 0)
 	{
-		bytesReturned = MaxLength;
+		return 0;
 	}
+	*Data = m_segmentMemory[m_dataStart / m_segmentSize] + m_dataStart % m_segmentSize;
+	m_readPosition = m_dataStart;
+	m_readLength = bytesReturned;
 	m_dataStart = (m_dataStart + bytesReturned) % m_bufferLength;
 	m_dataLength -= bytesReturned;
 	return bytesReturned;
@@ -105,20 +464,36 @@ uint64_t cOverwritingRingBuffer::ReadData(uchar** Data, uint64_t MaxLength)
 
 uint64_t cOverwritingRingBuffer::ReadDataFromEnd(uchar** Data, uint64_t MaxLength)
 {
+	// data passed last time may be given back now
+	m_readLength = 0;
+	ReleaseUnusedSegments();
+
+	if (m_dataLength == 0)
+	{
+		return 0;
+	}
+
 	uint64_t bytesReturned = 0;
-	if (m_dataStart + m_dataLength > m_bufferLength)
+	if (m_mirrored && m_spillFile < 0)
 	{
-		uint64_t bytesFromStart = m_dataLength - (m_bufferLength - m_dataStart);
-		bytesReturned = min(MaxLength, bytesFromStart);
-		*Data = m_buffer + (m_dataStart + m_dataLength) % m_bufferLength - bytesReturned;
+		bytesReturned = min(MaxLength, m_dataLength);
 	}
 	else
 	{
-		bytesReturned = min(MaxLength, m_dataLength);
-		*Data = m_buffer + m_dataStart + m_dataLength - bytesReturned;
+		// only the part in the segment holding the last byte is contiguous
+		uint64_t dataEnd = (m_dataStart + m_dataLength - 1) % m_bufferLength + 1;
+		int segment = (dataEnd - 1) / m_segmentSize;
+		if (m_segmentMemory[segment] == NULL && !LoadSegment(segment))
+		{
+			return 0;
+		}
+		uint64_t bytesInSegment = dataEnd - SegmentStart(segment);
+		bytesReturned = min(MaxLength, min(bytesInSegment, m_dataLength));
 	}
 	m_dataLength -= bytesReturned;
-	*Data = m_buffer + (m_dataStart + m_dataLength) % m_bufferLength;
+	m_readPosition = (m_dataStart + m_dataLength) % m_bufferLength;
+	m_readLength = bytesReturned;
+	*Data = m_segmentMemory[m_readPosition / m_segmentSize] + m_readPosition % m_segmentSize;
 	return bytesReturned;
 }
 
@@ -145,4 +520,324 @@ void cOverwritingRingBuffer::DropData(uint64_t bytesToDrop)
 		m_dataStart = 0;
 		m_dataLength = 0;
 	}
+	ReleaseUnusedSegments();
+}
+
+void cOverwritingRingBuffer::Truncate(uint64_t offset)
+{
+	if (offset < BytesDropped() || offset > BytesWritten())
+	{
+		return;
+	}
+
+	// writing goes on at offset
+	m_dataLength -= m_dataWritten - offset;
+	m_dataWritten = offset;
+	ReleaseUnusedSegments();
+}
+
+uint64_t cOverwritingRingBuffer::CopyData(uint64_t offset, uchar* data, uint64_t maxLength)
+{
+	if (offset < BytesDropped() || offset >= BytesWritten())
+	{
+		return 0;
+	}
+
+	uint64_t length = min(maxLength, BytesWritten() - offset);
+	uint64_t position = (m_dataStart + (offset - BytesDropped())) % m_bufferLength;
+
+	// copy piecewise up to the end of each segment
+	uint64_t bytesCopied = 0;
+	while (bytesCopied < length)
+	{
+		int segment = position / m_segmentSize;
+		uint64_t bytesToCopy = min(length - bytesCopied, SegmentStart(segment) + SegmentLength(segment) - position);
+		if (m_segmentMemory[segment] != NULL)
+		{
+			memcpy(data + bytesCopied, m_segmentMemory[segment] + position - SegmentStart(segment), bytesToCopy);
+		}
+		else if (!ReadSpilled(position, data + bytesCopied, bytesToCopy))
+		{
+			break;
+		}
+		bytesCopied += bytesToCopy;
+		position = (position + bytesToCopy) % m_bufferLength;
+	}
+	return bytesCopied;
+}
+
+
+bool cOverwritingRingBuffer::AttachFile(int file, off_t offset)
+{
+	if (m_segmentCount == 0 || m_residentSegments > 0 || m_spillFile >= 0 || offset % sysconf(_SC_PAGESIZE) != 0)
+	{
+		return false;
+	}
+	m_file = file;
+	m_fileOffset = offset;
+	return true;
+}
+
+void cOverwritingRingBuffer::GetPersistentState(uint64_t margin, uint64_t* dataStart, uint64_t* dataLength, uint64_t* dataWritten)
+{
+	// the oldest data gets overwritten first
+	uint64_t overwritten = 0;
+	if (m_dataLength + margin > m_bufferLength)
+	{
+		overwritten = min(m_dataLength, m_dataLength + margin - m_bufferLength);
+	}
+	*dataStart = (m_dataStart + overwritten) % m_bufferLength;
+	*dataLength = m_dataLength - overwritten;
+	*dataWritten = m_dataWritten;
+}
+
+bool cOverwritingRingBuffer::Restore(uint64_t dataStart, uint64_t dataLength, uint64_t dataWritten)
+{
+	if (m_file < 0 || dataStart >= m_bufferLength || dataLength > m_bufferLength || dataLength > dataWritten ||
+		(dataWritten - dataLength) % m_bufferLength != dataStart)
+	{
+		return false;
+	}
+
+	// the data is mapped, not copied
+	if (!AcquireSegments(dataStart, dataLength))
+	{
+		return false;
+	}
+	m_dataStart = dataStart;
+	m_dataLength = dataLength;
+	m_dataWritten = dataWritten;
+	return true;
+}
+
+uint64_t cOverwritingRingBuffer::ContiguousLength(uint64_t position, uint64_t length)
+{
+	int segment = position / m_segmentSize;
+	if (m_segmentMemory[segment] == NULL && !LoadSegment(segment))
+	{
+		return 0;
+	}
+
+	// without spilling, all data is present and mirrored memory makes it contiguous
+	if (m_mirrored && m_spillFile < 0)
+	{
+		return length;
+	}
+
+	uint64_t contiguous = SegmentStart(segment) + SegmentLength(segment) - position;
+	if (m_mirrored)
+	{
+		// following segments are contiguous as long as they are present
+		while (contiguous < length)
+		{
+			int next = (position + contiguous) % m_bufferLength / m_segmentSize;
+			if (m_segmentMemory[next] == NULL) break;
+			contiguous += SegmentLength(next);
+		}
+	}
+	return min(contiguous, length);
+}
+
+
+bool cOverwritingRingBuffer::EnableSpill(const char* directory, uint64_t memoryLength)
+{
+	DisableSpill();
+	if (m_segmentCount == 0 || directory == NULL || m_file >= 0) return false;
+
+	// the file is unlinked right away, so it's gone with the buffer, even after a crash
+	char fileName[PATH_MAX];
+	snprintf(fileName, sizeof(fileName), "%s/permashift-spill-XXXXXX", directory);
+	int file = mkstemp(fileName);
+	if (file < 0)
+	{
+		esyslog("permashift: could not create spill file in %s (%d)!", directory, errno);
+		return false;
+	}
+	unlink(fileName);
+
+	// reserve disc space, so writing never fails for lack of it and the file isn't fragmented
+	int error = posix_fallocate(file, 0, m_bufferLength);
+	if (error != 0)
+	{
+		esyslog("permashift: could not preallocate %llu MB spill file (%d)!", (unsigned long long)(m_bufferLength / (1024 * 1024)), error);
+		close(file);
+		return false;
+	}
+
+	m_spillStates = MALLOC(uchar, m_segmentCount);
+	if (m_spillStates == NULL)
+	{
+		close(file);
+		return false;
+	}
+	memset(m_spillStates, ssMemory, m_segmentCount);
+
+	m_spillFile = file;
+	m_spillEngine = new cAsyncWriter(SPILL_WRITES_IN_FLIGHT);
+	m_spillsInFlight = 0;
+	m_spillSegment = m_dataStart / m_segmentSize;
+	m_dropSegment = -1;
+	m_memorySegments = max((int)(memoryLength / m_segmentSize), 2);
+	m_spillBehind = false;
+	dsyslog("permashift: keeping %d MB of buffer in memory, spilling up to %llu MB to disc\n",
+		(int)(m_memorySegments * m_segmentSize / (1024 * 1024)), (unsigned long long)(m_bufferLength / (1024 * 1024)));
+
+	// more than the memory limit may be present already
+	Spill();
+	return true;
+}
+
+void cOverwritingRingBuffer::DisableSpill()
+{
+	if (m_spillFile < 0) return;
+
+	delete m_spillEngine;
+	m_spillEngine = NULL;
+	m_spillsInFlight = 0;
+	close(m_spillFile);
+	m_spillFile = -1;
+
+	// spilled data is gone with the file
+	for (int segment = 0; segment < m_segmentCount; segment++)
+	{
+		if (m_spillStates[segment] == ssSpilled && m_segmentMemory[segment] == NULL &&
+			SegmentOverlaps(segment, m_dataStart, m_dataLength))
+		{
+			DropData(m_dataLength);
+			break;
+		}
+	}
+	free(m_spillStates);
+	m_spillStates = NULL;
+}
+
+bool cOverwritingRingBuffer::LoadSegment(int segment)
+{
+	if (m_spillFile < 0 || m_spillStates[segment] != ssSpilled || !AcquireSegment(segment))
+	{
+		return false;
+	}
+	if (!ReadSpilled(SegmentStart(segment), m_segmentMemory[segment], SegmentLength(segment)))
+	{
+		ReleaseSegment(segment);
+		return false;
+	}
+	return true;
+}
+
+bool cOverwritingRingBuffer::ReadSpilled(uint64_t position, uchar* data, uint64_t length)
+{
+	if (m_spillFile < 0 || m_spillStates[position / m_segmentSize] != ssSpilled)
+	{
+		return false;
+	}
+
+	uint64_t bytesRead = 0;
+	while (bytesRead < length)
+	{
+		ssize_t result = pread(m_spillFile, data + bytesRead, length - bytesRead, position + bytesRead);
+		if (result <= 0)
+		{
+			if (result < 0 && errno == EINTR) continue;
+			esyslog("permashift: could not read spill file (%d)!", result < 0 ? errno : 0);
+			return false;
+		}
+		bytesRead += result;
+	}
+	return true;
+}
+
+void cOverwritingRingBuffer::PrepareSpilledWrite(uint64_t position, uint64_t length)
+{
+	uint64_t bytesChecked = 0;
+	while (bytesChecked < length)
+	{
+		uint64_t bufferPosition = (position + bytesChecked) % m_bufferLength;
+		int segment = bufferPosition / m_segmentSize;
+		uint64_t segmentEnd = SegmentStart(segment) + SegmentLength(segment);
+		if (m_segmentMemory[segment] == NULL && SegmentOverlaps(segment, m_dataStart, m_dataLength))
+		{
+			// newer data is always in memory, so old data in here starts at data start
+			DropData((segmentEnd + m_bufferLength - m_dataStart) % m_bufferLength);
+		}
+		m_spillStates[segment] = ssMemory;
+		bytesChecked += segmentEnd - bufferPosition;
+	}
+}
+
+void cOverwritingRingBuffer::Spill()
+{
+	if (ReapSpilled())
+	{
+		ReleaseUnusedSegments();
+	}
+
+	// evict in order of writing, up to the segment being filled
+	int fillSegment = (m_dataStart + m_dataLength) % m_bufferLength / m_segmentSize;
+	for (int checked = 0; checked < m_segmentCount && m_spillSegment != fillSegment &&
+		m_residentSegments - m_spillsInFlight > m_memorySegments && m_spillEngine->CanWrite(); checked++)
+	{
+		int segment = m_spillSegment;
+		if (m_segmentMemory[segment] != NULL && m_spillStates[segment] == ssMemory &&
+			SegmentOverlaps(segment, m_dataStart, m_dataLength))
+		{
+			int request = m_spillEngine->Write(m_spillFile, m_segmentMemory[segment], SegmentLength(segment), SegmentStart(segment));
+			if (request < 0) break;
+			m_spillRequests[request] = segment;
+			m_spillStates[segment] = ssWriting;
+			m_spillsInFlight++;
+		}
+		m_spillSegment = (segment + 1) % m_segmentCount;
+	}
+
+	// memory must stay bounded, so if the disc can't keep up, drop the oldest data not spilled yet
+	// (and everything older, as data has to be contiguous)
+	if (m_residentSegments > 2 * m_memorySegments + SPILL_WRITES_IN_FLIGHT && m_spillSegment != fillSegment &&
+		SegmentOverlaps(m_spillSegment, m_dataStart, m_dataLength))
+	{
+		if (!m_spillBehind)
+		{
+			esyslog("permashift: spilling buffer to disc can't keep up, dropping oldest data!");
+			m_spillBehind = true;
+		}
+		DropData((SegmentStart(m_spillSegment) + SegmentLength(m_spillSegment) + m_bufferLength - m_dataStart) % m_bufferLength);
+		m_spillSegment = (m_spillSegment + 1) % m_segmentCount;
+	}
+	else if (m_residentSegments <= m_memorySegments)
+	{
+		m_spillBehind = false;
+	}
+}
+
+bool cOverwritingRingBuffer::ReapSpilled()
+{
+	bool reaped = false;
+	int request;
+	int64_t result;
+	while (m_spillEngine->Reap(&request, &result))
+	{
+		int segment = m_spillRequests[request];
+		m_spillsInFlight--;
+		reaped = true;
+
+		// segment may have been written to again in the meantime
+		if (m_spillStates[segment] != ssWriting) continue;
+
+		if (result != (int64_t)SegmentLength(segment))
+		{
+			esyslog("permashift: could not write spill file (%d)!", result < 0 ? (int)-result : 0);
+			m_spillStates[segment] = ssMemory;
+			continue;
+		}
+		m_spillStates[segment] = ssSpilled;
+
+		// start writing back this segment, and drop the previous one from page cache, which has been written back by now
+		sync_file_range(m_spillFile, SegmentStart(segment), SegmentLength(segment), SYNC_FILE_RANGE_WRITE);
+		if (m_dropSegment >= 0)
+		{
+			posix_fadvise(m_spillFile, SegmentStart(m_dropSegment), SegmentLength(m_dropSegment), POSIX_FADV_DONTNEED);
+		}
+		m_dropSegment = segment;
+	}
+	return reaped;
 }
@@ -11,43 +11,150 @@
 
 #include <vdr/tools.h>
 
+#include "segmentpool.h"
+
+class cAsyncWriter;
+
+/// segments being written to the spill file at once
+#define SPILL_WRITES_IN_FLIGHT 4
+
 /// ring buffer overwriting oldest data when full
+///
+/// The buffer is made of segments taken from a pool when data arrives
+/// and handed back when they don't contain data anymore.
+///
+/// Optionally, only the newest part of the buffer is kept in memory. Older segments
+/// are evicted to a spill file covering the whole buffer (each segment at its buffer offset),
+/// so the file is written sequentially, one segment at a time, by an asynchronous writer.
+/// Data read from spilled segments is loaded back into memory transparently.
+///
+/// Alternatively, segments can be mapped from a file (each segment at its buffer offset),
+/// so the buffer's data survives a restart of VDR (see cBufferFile).
 class cOverwritingRingBuffer
 {
 private:
 
-	uchar* m_buffer;			///< data container
+	/// where the data of a segment is kept
+	enum eSpillState
+	{
+		ssMemory,		///< in memory only (or no data)
+		ssWriting,		///< in memory, being written to spill file
+		ssSpilled		///< in spill file (and possibly loaded back into memory)
+	};
+
+	uchar* m_buffer;			///< data container (address space of mirrored segments)
 	uint64_t m_bufferLength;	///< size of buffer
+	bool m_mirrored;			///< buffer memory is mapped twice, back to back
 	uint64_t m_dataStart;		///< offset of data start
 	uint64_t m_dataLength;		///< used bytes in buffer
 	uint64_t m_dataWritten;		///< total bytes written to buffer (lifetime)
 
+	cSegmentPool* m_pool;		///< source of segment memory
+	bool m_ownPool;				///< pool has been created by us
+	uint64_t m_segmentSize;		///< size of a segment (the last one may be shorter)
+	int m_segmentCount;			///< number of segments making up the buffer
+	int* m_segmentSlots;		///< pool slot of each segment, -1 if not present
+	uchar** m_segmentMemory;	///< memory of each segment, NULL if not present
+
+	uint64_t m_readPosition;	///< buffer offset of data last passed to a reader
+	uint64_t m_readLength;		///< length of data last passed to a reader
+
+	cVector<uint64_t> m_pinPositions;	///< buffer offsets of data pinned by readers
+	cVector<uint64_t> m_pinLengths;		///< lengths of data pinned by readers, 0 for unused pins
+
+	int m_residentSegments;		///< segments with memory
+
+	int m_file;					///< file segments are mapped from instead of taking them from the pool, -1 if none
+	off_t m_fileOffset;			///< file offset of buffer start
+
+	int m_spillFile;			///< file older segments are evicted to, -1 if the buffer is kept in memory
+	uchar* m_spillStates;		///< spill state of each segment
+	cAsyncWriter* m_spillEngine;	///< writes evicted segments
+	int m_spillRequests[SPILL_WRITES_IN_FLIGHT];	///< segment written by each engine request
+	int m_spillsInFlight;		///< segments being written
+	int m_spillSegment;			///< next segment to be evicted, in order of writing
+	int m_dropSegment;			///< segment spilled last, to be dropped from page cache next, -1 if none
+	int m_memorySegments;		///< segments kept in memory before evicting
+	bool m_spillBehind;			///< spilling can't keep up, oldest data is dropped
+
 public:
 
 	/// create buffer object and allocate data buffer
-	cOverwritingRingBuffer(uint64_t bufferSize);
+	/// segments are taken from the given pool, or from a private one
+	cOverwritingRingBuffer(uint64_t bufferSize, cSegmentPool* pool = NULL);
 
 	/// destroy buffer object and deallocate data buffer
 	virtual ~cOverwritingRingBuffer();
 
 	/// (re)allocates buffer - only needed if size 0 has been given to constructor
+	/// buffer size is rounded down to a multiple of blockSize (and of the page size if mirrored)
+	/// segment memory is only taken when data is written
 	/// returns false and deallocates whole buffer if out of memory
-	bool Allocate(uint64_t bufferSize);
+	bool Allocate(uint64_t bufferSize, uint64_t blockSize = 1);
+
+	/// keeps only about the newest memoryLength bytes in memory, evicting older segments to a preallocated
+	/// spill file in the given directory (to be called after Allocate(), the file is as large as the buffer)
+	/// returns false if the spill file could not be created
+	bool EnableSpill(const char* directory, uint64_t memoryLength);
+
+	/// maps segments from the given file (at offset plus buffer offset) instead of taking them from the pool
+	/// (to be called after Allocate(), while the buffer is empty; the file is not closed by the buffer)
+	bool AttachFile(int file, off_t offset);
+
+	/// data state to be restored after a crash (see Restore()), leaving out the oldest data
+	/// if it may be overwritten by the given number of bytes still to be written
+	void GetPersistentState(uint64_t margin, uint64_t* dataStart, uint64_t* dataLength, uint64_t* dataWritten);
+
+	/// takes data found in the file attached, as described by GetPersistentState()
+	bool Restore(uint64_t dataStart, uint64_t dataLength, uint64_t dataWritten);
 
 	/// writes data to the buffer, dropping old data if necessary
-	void WriteData(uchar* Data, uint64_t Length);
+	/// returns false if no memory could be provided for the data
+	bool WriteData(uchar* Data, uint64_t Length);
 
 	/// fetches and removes up to maxLength bytes from the buffer
-	/// the pointer provided is not to be deleted by the caller
+	/// the pointer provided is not to be deleted by the caller and is valid until the next call
+	/// (without mirrored memory, reads stop at the end of a segment)
 	uint64_t ReadData(uchar** Data, uint64_t MaxLength);
 
 	/// fetches and removes up to maxLength bytes from the end of the buffer
-	/// the pointer provided is not to be deleted by the caller
+	/// the pointer provided is not to be deleted by the caller and is valid until the next call
+	/// (without mirrored memory, reads stop at the start of a segment)
 	uint64_t ReadDataFromEnd(uchar** Data, uint64_t MaxLength);
 
 	/// drops oldest bytes from buffer
 	void DropData(uint64_t bytesToDrop);
 
+	/// cuts all data from the given offset (counting all bytes written) on, as if it had never been written:
+	/// BytesWritten() goes back to offset, so the cut bytes don't count as dropped
+	/// and offsets of the data kept stay valid (nothing is cut if offset is not in buffer)
+	void Truncate(uint64_t offset);
+
+	/// keeps memory of the data passed by the last read valid beyond the next call,
+	/// until Unpin() is called with the pin returned (-1 if there's nothing to pin)
+	int PinReadData();
+
+	/// keeps memory of the given range valid (start counting from oldest byte available),
+	/// even after the data has been dropped, until Unpin() is called with the pin returned
+	/// returns -1 if the range is not in buffer
+	int PinData(uint64_t start, uint64_t length);
+
+	/// fetches up to maxLength bytes of pinned data, starting at offset within pinned range
+	/// the pointer provided is valid as long as the data is pinned
+	/// (without mirrored memory, data fetched stops at the end of a segment)
+	uint64_t PinnedData(int pin, uint64_t offset, uchar** Data, uint64_t MaxLength);
+
+	/// keeps only the given number of bytes at the start of pinned range, giving memory of the rest back
+	/// (shrinking to 0 bytes is the same as unpinning)
+	void ShrinkPin(int pin, uint64_t length);
+
+	/// gives memory of pinned data back
+	void Unpin(int pin);
+
+	/// copies up to maxLength bytes starting at the given offset (counting all bytes written),
+	/// leaving them in the buffer; returns bytes copied, 0 if offset is not in buffer
+	uint64_t CopyData(uint64_t offset, uchar* data, uint64_t maxLength);
+
 	/// bytes available
 	uint64_t BytesAvailable() { return m_dataLength; }
 
@@ -57,6 +164,79 @@ public:
 	/// total bytes dropped in buffer lifetime
 	uint64_t BytesDropped() { return BytesWritten() - BytesAvailable(); }
 
+	/// is any range of data in the buffer contiguous in memory?
+	bool Mirrored() { return m_mirrored; }
+
+	/// are older segments evicted to a spill file?
+	bool Spilling() { return m_spillFile >= 0; }
+
+	/// bytes of segment memory taken by the buffer
+	uint64_t BytesInMemory() { return m_residentSegments * m_segmentSize; }
+
+	/// size of buffer
+	uint64_t Size() { return m_bufferLength; }
+
+private:
+
+	/// reserves address space for mapping each segment twice, back to back
+	bool AllocateMirrored(uint64_t bufferSize);
+
+	/// releases buffer memory, whichever way it has been allocated
+	void Deallocate();
+
+	/// offset of a segment in the buffer
+	uint64_t SegmentStart(int segment) { return (uint64_t)segment * m_segmentSize; }
+
+	/// length of a segment
+	uint64_t SegmentLength(int segment) { return min(m_segmentSize, m_bufferLength - SegmentStart(segment)); }
+
+	/// does a segment overlap the given (possibly wrapping) range of the buffer?
+	bool SegmentOverlaps(int segment, uint64_t position, uint64_t length);
+
+	/// makes sure memory is present for the given range of the buffer
+	bool AcquireSegments(uint64_t position, uint64_t length);
+
+	/// takes memory for a segment from the pool
+	bool AcquireSegment(int segment);
+
+	/// maps a segment from the file attached
+	bool AcquireFileSegment(int segment);
+
+	/// gives memory of a segment back to the pool
+	void ReleaseSegment(int segment);
+
+	/// gives back all segments neither containing data nor being read
+	void ReleaseUnusedSegments();
+
+	/// does a segment contain pinned data?
+	bool SegmentPinned(int segment);
+
+	/// pins given range of buffer, returns pin
+	int AddPin(uint64_t position, uint64_t length);
+
+	/// bytes contiguous in memory from given buffer offset on (up to length),
+	/// loading a spilled segment at that offset; returns 0 if the data could not be loaded
+	uint64_t ContiguousLength(uint64_t position, uint64_t length);
+
+	/// closes spill file, waiting for writes in flight
+	void DisableSpill();
+
+	/// reads a spilled segment back into memory
+	bool LoadSegment(int segment);
+
+	/// copies spilled data from the spill file
+	bool ReadSpilled(uint64_t position, uchar* data, uint64_t length);
+
+	/// prepares segments for writing the given range: older data sharing these segments
+	/// is only in the spill file and gets dropped, copies in the spill file become outdated
+	void PrepareSpilledWrite(uint64_t position, uint64_t length);
+
+	/// evicts oldest segments beyond the memory limit to the spill file
+	void Spill();
+
+	/// processes completed spill writes, returns true if any have completed
+	bool ReapSpilled();
+
 };
 
 #endif /* OVERWRITINGRINGBUFFER_H_ */
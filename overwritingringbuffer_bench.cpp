@@ -0,0 +1,284 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Throughput benchmark of cOverwritingRingBuffer, built without VDR ("make bench").
+//
+// For each buffer and chunk size, the buffer is written over twice, then read,
+// read from the end and dropped chunk by chunk. Each of these prints one line
+// of JSON with throughput, CPU cycles per byte and page faults, so results can
+// be collected per commit and compared.
+
+#include "overwritingringbuffer.h"
+#include "latencyhistogram.h"
+
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TS_PACKET_SIZE 188
+
+// most sizes given in a list option
+#define MAX_SIZES 16
+
+
+/// CPU cycles of this thread, from the performance counters if the kernel grants them,
+/// from the time stamp counter otherwise
+class cCycleCounter
+{
+private:
+	int m_perfEvent;
+
+public:
+	cCycleCounter()
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		m_perfEvent = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	~cCycleCounter()
+	{
+		if (m_perfEvent >= 0) close(m_perfEvent);
+	}
+
+	uint64_t Read()
+	{
+		uint64_t cycles = 0;
+		if (m_perfEvent >= 0)
+		{
+			if (read(m_perfEvent, &cycles, sizeof(cycles)) != sizeof(cycles)) cycles = 0;
+			return cycles;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		cycles = __rdtsc();
+#endif
+		return cycles;
+	}
+
+	const char* Source()
+	{
+		if (m_perfEvent >= 0) return "perf";
+#if defined(__x86_64__) || defined(__i386__)
+		return "tsc";
+#else
+		return "none";
+#endif
+	}
+};
+
+
+/// what a measurement has cost
+struct tCost
+{
+	uint64_t ns;
+	uint64_t cycles;
+	long minorFaults;
+	long majorFaults;
+};
+
+static cCycleCounter s_cycleCounter;
+
+static void Snapshot(tCost* cost)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	cost->ns = MonotonicNanoSeconds();
+	cost->cycles = s_cycleCounter.Read();
+	cost->minorFaults = usage.ru_minflt;
+	cost->majorFaults = usage.ru_majflt;
+}
+
+
+/// options
+static const char* s_label = NULL;
+static bool s_mirrored = true;
+
+/// sink for data read
+static volatile unsigned int s_sink;
+
+
+static void Report(const char* operation, uint64_t bufferSize, uint64_t chunkSize, uint64_t bytes, const tCost& start)
+{
+	tCost end;
+	Snapshot(&end);
+	double seconds = max(end.ns - start.ns, (uint64_t)1) / 1e9;
+	printf("{\"benchmark\":\"ringbuffer\",%s%s%s\"op\":\"%s\",\"buffer_mb\":%llu,\"chunk\":%llu,\"mirrored\":%s,"
+		"\"bytes\":%llu,\"seconds\":%.6f,\"gb_per_s\":%.3f,\"cycles_per_byte\":%.4f,\"cycles_source\":\"%s\","
+		"\"minor_faults\":%ld,\"major_faults\":%ld}\n",
+		s_label != NULL ? "\"label\":\"" : "", s_label != NULL ? s_label : "", s_label != NULL ? "\"," : "",
+		operation, (unsigned long long)((bufferSize + (1 << 19)) >> 20), (unsigned long long)chunkSize, s_mirrored ? "true" : "false",
+		(unsigned long long)bytes, seconds, bytes / seconds / 1e9,
+		bytes > 0 ? (double)(end.cycles - start.cycles) / bytes : 0.0, s_cycleCounter.Source(),
+		end.minorFaults - start.minorFaults, end.majorFaults - start.majorFaults);
+	fflush(stdout);
+}
+
+static void Fill(cOverwritingRingBuffer* buffer, uchar* chunk, uint64_t chunkSize, uint64_t bytes)
+{
+	for (uint64_t written = 0; written < bytes; written += chunkSize)
+	{
+		buffer->WriteData(chunk, chunkSize);
+	}
+}
+
+/// runs all operations on a buffer of the given size, returns false if it can't be allocated
+static bool Benchmark(uint64_t bufferSize, uint64_t chunkSize, uint64_t writeSize)
+{
+	// a new pool for each run, so each starts with memory to be faulted in
+	cSegmentPool pool(BUFFER_SEGMENT_SIZE, s_mirrored);
+	cOverwritingRingBuffer buffer(0, &pool);
+	if (!buffer.Allocate(bufferSize / TS_PACKET_SIZE * TS_PACKET_SIZE, TS_PACKET_SIZE))
+	{
+		esyslog("could not allocate buffer of %llu MB", (unsigned long long)(bufferSize >> 20));
+		return false;
+	}
+	bufferSize = buffer.Size();
+	chunkSize = min(chunkSize, bufferSize);
+
+	uchar* chunk = MALLOC(uchar, chunkSize);
+	for (uint64_t i = 0; i < chunkSize; i++)
+	{
+		chunk[i] = (uchar)i;
+	}
+	tCost start;
+
+	// writing, overwriting once the buffer is full
+	uint64_t written = 0;
+	Snapshot(&start);
+	for (; written < writeSize; written += chunkSize)
+	{
+		buffer.WriteData(chunk, chunkSize);
+	}
+	Report("write", bufferSize, chunkSize, written, start);
+
+	// reading hands out pointers to the data, like the buffer's consumers get it
+	uchar* data;
+	uint64_t count;
+	uint64_t bytes = 0;
+	unsigned int checksum = 0;
+	Snapshot(&start);
+	while ((count = buffer.ReadData(&data, chunkSize)) > 0)
+	{
+		checksum += data[0] + data[count - 1];
+		bytes += count;
+	}
+	Report("read", bufferSize, chunkSize, bytes, start);
+
+	Fill(&buffer, chunk, chunkSize, bufferSize);
+	bytes = 0;
+	Snapshot(&start);
+	while ((count = buffer.ReadDataFromEnd(&data, chunkSize)) > 0)
+	{
+		checksum += data[0] + data[count - 1];
+		bytes += count;
+	}
+	Report("read_from_end", bufferSize, chunkSize, bytes, start);
+
+	Fill(&buffer, chunk, chunkSize, bufferSize);
+	bytes = buffer.BytesAvailable();
+	Snapshot(&start);
+	while (buffer.BytesAvailable() > 0)
+	{
+		buffer.DropData(chunkSize);
+	}
+	Report("drop", bufferSize, chunkSize, bytes, start);
+
+	free(chunk);
+
+	// keeps the compiler from dropping the reads
+	s_sink = checksum;
+	return true;
+}
+
+/// parses a comma separated list of sizes in the given unit, returns number of sizes
+static int ParseSizes(const char* list, uint64_t unit, uint64_t* sizes)
+{
+	int count = 0;
+	char* end;
+	for (const char* size = list; *size != 0 && count < MAX_SIZES; size = *end == ',' ? end + 1 : end)
+	{
+		uint64_t value = strtoull(size, &end, 10);
+		if (end == size || value == 0) return 0;
+		sizes[count++] = value * unit;
+	}
+	return count;
+}
+
+static void Usage(const char* name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -b MB[,MB...]        buffer sizes (default 100,1024)\n"
+		"  -c BYTES[,BYTES...]  chunk sizes (default 1316,65536,1048576)\n"
+		"  -w FACTOR            bytes written per run, as multiple of buffer size (default 2)\n"
+		"  -H                   heap segments instead of mirrored memory file\n"
+		"  -l LABEL             label added to each result (e.g. commit id)\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t bufferSizes[MAX_SIZES] = { 100ull << 20, 1024ull << 20 };
+	int bufferSizeCount = 2;
+	uint64_t chunkSizes[MAX_SIZES] = { 7 * TS_PACKET_SIZE, 64 * 1024, 1024 * 1024 };
+	int chunkSizeCount = 3;
+	int writeFactor = 2;
+
+	int c;
+	while ((c = getopt(argc, argv, "b:c:w:Hl:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'b':
+			bufferSizeCount = ParseSizes(optarg, 1024 * 1024, bufferSizes);
+			break;
+		case 'c':
+			chunkSizeCount = ParseSizes(optarg, 1, chunkSizes);
+			break;
+		case 'w':
+			writeFactor = atoi(optarg);
+			break;
+		case 'H':
+			s_mirrored = false;
+			break;
+		case 'l':
+			s_label = optarg;
+			break;
+		default:
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+	if (bufferSizeCount == 0 || chunkSizeCount == 0 || writeFactor < 1)
+	{
+		Usage(argv[0]);
+		return 2;
+	}
+
+	int failed = 0;
+	for (int bufferSize = 0; bufferSize < bufferSizeCount; bufferSize++)
+	{
+		for (int chunkSize = 0; chunkSize < chunkSizeCount; chunkSize++)
+		{
+			if (!Benchmark(bufferSizes[bufferSize], chunkSizes[chunkSize], writeFactor * bufferSizes[bufferSize]))
+			{
+				failed++;
+			}
+		}
+	}
+	return failed > 0 ? 1 : 0;
+}
@@ -130,3 +130,480 @@ BOOST_AUTO_TEST_CASE(ReadFromEnd)
 	BOOST_CHECK_EQUAL(count, 0);
 }
 
+
+
+BOOST_AUTO_TEST_CASE(MirroredReadOverEdge)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	cOverwritingRingBuffer buffer(pageSize);
+	BOOST_REQUIRE(buffer.Mirrored());
+
+	// fill three quarters, consume half and write another half, so data wraps around
+	uchar miniBuffer[pageSize];
+	uint64_t written = 0;
+	for (uint64_t i = 0; i < pageSize * 3 / 4; i++, written++)
+	{
+		miniBuffer[i] = (uchar)(written % 251);
+	}
+	buffer.WriteData(miniBuffer, pageSize * 3 / 4);
+
+	uchar* data;
+	uint64_t count = buffer.ReadData(&data, pageSize / 2);
+	BOOST_CHECK_EQUAL(count, pageSize / 2);
+
+	for (uint64_t i = 0; i < pageSize / 2; i++, written++)
+	{
+		miniBuffer[i] = (uchar)(written % 251);
+	}
+	buffer.WriteData(miniBuffer, pageSize / 2);
+
+	// whole rest is returned in one piece
+	count = buffer.ReadData(&data, pageSize);
+	BOOST_CHECK_EQUAL(count, pageSize * 3 / 4);
+	for (uint64_t i = 0; i < count; i++)
+	{
+		BOOST_CHECK_EQUAL(data[i], (uchar)((pageSize / 2 + i) % 251));
+	}
+
+	count = buffer.ReadData(&data, pageSize);
+	BOOST_CHECK_EQUAL(count, 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(MirroredReadFromEndOverEdge)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	cOverwritingRingBuffer buffer(pageSize);
+	BOOST_REQUIRE(buffer.Mirrored());
+
+	// overwrite the buffer by half its size
+	uchar miniBuffer[pageSize / 2];
+	for (uint64_t part = 0; part < 3; part++)
+	{
+		for (uint64_t i = 0; i < pageSize / 2; i++)
+		{
+			miniBuffer[i] = (uchar)((part * pageSize / 2 + i) % 251);
+		}
+		buffer.WriteData(miniBuffer, pageSize / 2);
+	}
+	BOOST_CHECK_EQUAL(buffer.BytesDropped(), pageSize / 2);
+
+	uchar* data;
+	uint64_t count = buffer.ReadDataFromEnd(&data, pageSize);
+	BOOST_CHECK_EQUAL(count, pageSize);
+	for (uint64_t i = 0; i < count; i++)
+	{
+		BOOST_CHECK_EQUAL(data[i], (uchar)((pageSize / 2 + i) % 251));
+	}
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(SegmentsFollowData)
+{
+	// segments of 4 bytes on the heap, so reads stop at segment ends
+	cSegmentPool pool(4, false);
+	cOverwritingRingBuffer buffer(10, &pool);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 0);
+
+	for (uchar i = 1; i < 12; i += 3)
+	{
+		uchar miniBuffer[] = { i, (uchar)(i + 1), (uchar)(i + 2) };
+		buffer.WriteData(miniBuffer, 3);
+	}
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 12);
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), 10);
+	BOOST_CHECK_EQUAL(buffer.BytesDropped(), 2);
+
+	uchar* data;
+	uchar count = buffer.ReadData(&data, 10);
+	BOOST_CHECK_EQUAL(count, 2);
+	BOOST_CHECK_EQUAL(data[0], 3);
+	BOOST_CHECK_EQUAL(data[1], 4);
+
+	count = buffer.ReadData(&data, 10);
+	BOOST_CHECK_EQUAL(count, 4);
+	for (uchar index = 0; index < 4; index++)
+	{
+		BOOST_CHECK_EQUAL(data[index], index + 5);
+	}
+	// first segment still holds the newest data
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 12);
+
+	count = buffer.ReadDataFromEnd(&data, 10);
+	BOOST_CHECK_EQUAL(count, 2);
+	BOOST_CHECK_EQUAL(data[0], 11);
+	BOOST_CHECK_EQUAL(data[1], 12);
+
+	count = buffer.ReadData(&data, 10);
+	BOOST_CHECK_EQUAL(count, 2);
+	BOOST_CHECK_EQUAL(data[0], 9);
+	BOOST_CHECK_EQUAL(data[1], 10);
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), 0);
+	// only the segment just read is kept
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 4);
+
+	count = buffer.ReadData(&data, 10);
+	BOOST_CHECK_EQUAL(count, 0);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(MirroredSegments)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	cSegmentPool pool(pageSize);
+	cOverwritingRingBuffer buffer(3 * pageSize, &pool);
+	BOOST_REQUIRE(buffer.Mirrored());
+
+	uchar miniBuffer[pageSize / 2];
+	for (uint64_t part = 0; part < 7; part++)
+	{
+		memset(miniBuffer, (uchar)part, pageSize / 2);
+		buffer.WriteData(miniBuffer, pageSize / 2);
+	}
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 3 * pageSize);
+
+	// read across all three segments in one piece
+	uchar* data;
+	uint64_t count = buffer.ReadData(&data, 2 * pageSize + pageSize / 2);
+	BOOST_CHECK_EQUAL(count, 2 * pageSize + pageSize / 2);
+	for (uint64_t i = 0; i < count; i++)
+	{
+		BOOST_CHECK_EQUAL(data[i], (uchar)(1 + i / (pageSize / 2)));
+	}
+
+	count = buffer.ReadData(&data, pageSize);
+	BOOST_CHECK_EQUAL(count, pageSize / 2);
+	BOOST_CHECK_EQUAL(data[0], 6);
+	// only the segment holding the last part is left
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), pageSize);
+}
+
+
+BOOST_AUTO_TEST_CASE(SpareSegmentsReused)
+{
+	cSegmentPool pool(4, false);
+	pool.SetSpareLimit(8);
+
+	cOverwritingRingBuffer* buffer = new cOverwritingRingBuffer(10, &pool);
+	uchar miniBuffer[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	buffer->WriteData(miniBuffer, 10);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 12);
+	delete buffer;
+
+	// only as much as allowed is kept
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 0);
+	BOOST_CHECK_EQUAL(pool.BytesSpare(), 8);
+
+	// next buffer takes the spare segments first
+	buffer = new cOverwritingRingBuffer(10, &pool);
+	buffer->WriteData(miniBuffer, 6);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 8);
+	BOOST_CHECK_EQUAL(pool.BytesSpare(), 0);
+	delete buffer;
+}
+
+
+BOOST_AUTO_TEST_CASE(CopyOverEdge)
+{
+	cSegmentPool pool(4, false);
+	cOverwritingRingBuffer buffer(10, &pool);
+
+	for (uchar i = 1; i < 15; i += 7)
+	{
+		uchar miniBuffer[] = { i, (uchar)(i + 1), (uchar)(i + 2), (uchar)(i + 3), (uchar)(i + 4), (uchar)(i + 5), (uchar)(i + 6) };
+		buffer.WriteData(miniBuffer, 7);
+	}
+
+	// bytes 1 to 4 have been overwritten
+	uchar data[20];
+	BOOST_CHECK_EQUAL(buffer.CopyData(3, data, 20), 0);
+	BOOST_CHECK_EQUAL(buffer.CopyData(14, data, 20), 0);
+
+	uint64_t count = buffer.CopyData(5, data, 20);
+	BOOST_CHECK_EQUAL(count, 9);
+	for (uchar i = 0; i < count; i++)
+	{
+		BOOST_CHECK_EQUAL(data[i], i + 6);
+	}
+
+	// data stays in buffer
+	BOOST_CHECK_EQUAL(buffer.CopyData(12, data, 1), 1);
+	BOOST_CHECK_EQUAL(data[0], 13);
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), 10);
+}
+
+
+BOOST_AUTO_TEST_CASE(TruncateOverEdge)
+{
+	cSegmentPool pool(4, false);
+	cOverwritingRingBuffer buffer(10, &pool);
+
+	for (uchar i = 1; i < 15; i += 7)
+	{
+		uchar miniBuffer[] = { i, (uchar)(i + 1), (uchar)(i + 2), (uchar)(i + 3), (uchar)(i + 4), (uchar)(i + 5), (uchar)(i + 6) };
+		buffer.WriteData(miniBuffer, 7);
+	}
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 12);
+
+	// offsets not in buffer are ignored
+	buffer.Truncate(3);
+	buffer.Truncate(15);
+	BOOST_CHECK_EQUAL(buffer.BytesWritten(), 14);
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), 10);
+
+	// cut across the edge of the buffer, only the segment holding bytes 5 to 7 is kept
+	buffer.Truncate(7);
+	BOOST_CHECK_EQUAL(buffer.BytesWritten(), 7);
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), 3);
+	BOOST_CHECK_EQUAL(buffer.BytesDropped(), 4);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 4);
+
+	// writing goes on at the cut
+	uchar miniBuffer[] = { 20, 21 };
+	buffer.WriteData(miniBuffer, 2);
+	BOOST_CHECK_EQUAL(buffer.BytesWritten(), 9);
+	uchar data[20];
+	uint64_t count = buffer.CopyData(4, data, 20);
+	BOOST_CHECK_EQUAL(count, 5);
+	uchar expected[] = { 5, 6, 7, 20, 21 };
+	for (uchar i = 0; i < count; i++)
+	{
+		BOOST_CHECK_EQUAL(data[i], expected[i]);
+	}
+}
+
+
+BOOST_AUTO_TEST_CASE(PinnedDataKept)
+{
+	cSegmentPool pool(4, false);
+	cOverwritingRingBuffer buffer(12, &pool);
+
+	uchar miniBuffer[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+	buffer.WriteData(miniBuffer, 12);
+
+	// pin the two newest segments, as done for writes in flight
+	uchar* newest;
+	BOOST_CHECK_EQUAL(buffer.ReadDataFromEnd(&newest, 4), 4);
+	int newestPin = buffer.PinReadData();
+	uchar* middle;
+	BOOST_CHECK_EQUAL(buffer.ReadDataFromEnd(&middle, 4), 4);
+	int middlePin = buffer.PinReadData();
+	BOOST_CHECK(newestPin != middlePin);
+
+	uchar* data;
+	BOOST_CHECK_EQUAL(buffer.ReadDataFromEnd(&data, 4), 4);
+	BOOST_CHECK_EQUAL(buffer.ReadDataFromEnd(&data, 4), 0);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 8);
+	BOOST_CHECK_EQUAL(newest[0], 9);
+	BOOST_CHECK_EQUAL(middle[3], 8);
+
+	buffer.Unpin(newestPin);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 4);
+	BOOST_CHECK_EQUAL(middle[0], 5);
+
+	// unused pins are reused
+	buffer.WriteData(miniBuffer, 4);
+	BOOST_CHECK_EQUAL(buffer.ReadData(&data, 4), 4);
+	BOOST_CHECK_EQUAL(buffer.PinReadData(), newestPin);
+
+	buffer.Unpin(middlePin);
+	buffer.Unpin(newestPin);
+	BOOST_CHECK_EQUAL(buffer.ReadData(&data, 4), 0);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(PinnedRanges)
+{
+	cSegmentPool pool(4, false);
+	cOverwritingRingBuffer buffer(12, &pool);
+
+	uchar miniBuffer[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14 };
+	buffer.WriteData(miniBuffer, 2);
+	buffer.WriteData(miniBuffer + 2, 12);
+
+	// hand all data over to two pins
+	BOOST_CHECK_EQUAL(buffer.PinData(8, 8), -1);
+	int first = buffer.PinData(0, 4);
+	int second = buffer.PinData(4, 8);
+	BOOST_REQUIRE(first >= 0 && second >= 0);
+	buffer.DropData(buffer.BytesAvailable());
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 12);
+
+	// pinned data stops at segment ends without mirrored memory
+	uchar* data;
+	BOOST_CHECK_EQUAL(buffer.PinnedData(first, 1, &data, 10), 1);
+	BOOST_CHECK_EQUAL(data[0], 4);
+	BOOST_CHECK_EQUAL(buffer.PinnedData(second, 4, &data, 10), 2);
+	BOOST_CHECK_EQUAL(data[0], 11);
+	BOOST_CHECK_EQUAL(buffer.PinnedData(second, 5, &data, 10), 1);
+	BOOST_CHECK_EQUAL(data[0], 12);
+	BOOST_CHECK_EQUAL(buffer.PinnedData(second, 6, &data, 1), 1);
+	BOOST_CHECK_EQUAL(data[0], 13);
+	BOOST_CHECK_EQUAL(buffer.PinnedData(second, 8, &data, 1), 0);
+
+	// saved ranges are given back
+	buffer.ShrinkPin(second, 5);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 12);
+	buffer.ShrinkPin(second, 2);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 8);
+	buffer.ShrinkPin(second, 0);
+	buffer.ShrinkPin(first, 2);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 4);
+	buffer.Unpin(first);
+	BOOST_CHECK_EQUAL(pool.BytesInUse(), 0);
+}
+
+
+static void CheckSpilledBuffer(cSegmentPool* pool)
+{
+	uint64_t segmentSize = pool->SegmentSize();
+	cOverwritingRingBuffer buffer(16 * segmentSize, pool);
+	BOOST_REQUIRE(buffer.EnableSpill("/tmp", 4 * segmentSize));
+	BOOST_REQUIRE(buffer.Spilling());
+
+	// write the buffer over twice, waiting for evicted segments to be written
+	uchar chunk[1000];
+	uint64_t written = 0;
+	while (written < 40 * segmentSize)
+	{
+		for (uint64_t i = 0; i < sizeof(chunk); i++)
+		{
+			chunk[i] = (uchar)((written + i) % 251);
+		}
+		BOOST_REQUIRE(buffer.WriteData(chunk, sizeof(chunk)));
+		written += sizeof(chunk);
+		for (int wait = 0; wait < 1000 && buffer.BytesInMemory() > 6 * segmentSize; wait++)
+		{
+			usleep(1000);
+			buffer.DropData(0);
+		}
+	}
+	BOOST_CHECK_LE(buffer.BytesInMemory(), 6 * segmentSize);
+	BOOST_CHECK_GT(buffer.BytesAvailable(), 14 * segmentSize);
+
+	// copies are read from the spill file, without loading segments
+	uint64_t memoryUsed = buffer.BytesInMemory();
+	uchar copy[3 * 1000];
+	uint64_t offset = buffer.BytesDropped() + 1234;
+	BOOST_REQUIRE_EQUAL(buffer.CopyData(offset, copy, sizeof(copy)), sizeof(copy));
+	for (uint64_t i = 0; i < sizeof(copy); i++)
+	{
+		BOOST_REQUIRE_EQUAL(copy[i], (uchar)((offset + i) % 251));
+	}
+	BOOST_CHECK_EQUAL(buffer.BytesInMemory(), memoryUsed);
+
+	// pinned data is loaded back, and given back when unpinned
+	int pin = buffer.PinData(0, 2 * segmentSize);
+	BOOST_REQUIRE(pin >= 0);
+	uchar* data;
+	uint64_t count = buffer.PinnedData(pin, 10, &data, segmentSize);
+	BOOST_REQUIRE(count > 0);
+	for (uint64_t i = 0; i < count; i++)
+	{
+		BOOST_REQUIRE_EQUAL(data[i], (uchar)((buffer.BytesDropped() + 10 + i) % 251));
+	}
+	BOOST_CHECK_GT(buffer.BytesInMemory(), memoryUsed);
+	buffer.Unpin(pin);
+	BOOST_CHECK_LE(buffer.BytesInMemory(), memoryUsed);
+
+	// all data is read back in order
+	uint64_t readOffset = buffer.BytesDropped();
+	while ((count = buffer.ReadData(&data, 3 * segmentSize)) > 0)
+	{
+		for (uint64_t i = 0; i < count; i++, readOffset++)
+		{
+			BOOST_REQUIRE_EQUAL(data[i], (uchar)(readOffset % 251));
+		}
+	}
+	BOOST_CHECK_EQUAL(readOffset, written);
+}
+
+
+BOOST_AUTO_TEST_CASE(SpilledSegments)
+{
+	cSegmentPool pool(4096, false);
+	CheckSpilledBuffer(&pool);
+}
+
+
+BOOST_AUTO_TEST_CASE(MirroredSpilledSegments)
+{
+	cSegmentPool pool(sysconf(_SC_PAGESIZE));
+	CheckSpilledBuffer(&pool);
+}
+
+
+static void CheckFileBuffer(cSegmentPool* pool)
+{
+	uint64_t segmentSize = pool->SegmentSize();
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	char fileName[] = "/tmp/permashift-test-XXXXXX";
+	int file = mkstemp(fileName);
+	BOOST_REQUIRE(file >= 0);
+	unlink(fileName);
+	BOOST_REQUIRE_EQUAL(ftruncate(file, pageSize + 16 * segmentSize), 0);
+
+	// fill the buffer more than once, keeping state as of some data ago
+	uint64_t dataStart, dataLength, dataWritten = 0;
+	{
+		cOverwritingRingBuffer buffer(16 * segmentSize, pool);
+		BOOST_REQUIRE(buffer.AttachFile(file, pageSize));
+		uchar chunk[1000];
+		for (uint64_t written = 0; written < 20 * segmentSize; written += sizeof(chunk))
+		{
+			for (uint64_t i = 0; i < sizeof(chunk); i++)
+			{
+				chunk[i] = (uchar)((written + i) % 251);
+			}
+			BOOST_REQUIRE(buffer.WriteData(chunk, sizeof(chunk)));
+			if (dataWritten == 0 && written >= 18 * segmentSize)
+			{
+				buffer.GetPersistentState(2 * segmentSize, &dataStart, &dataLength, &dataWritten);
+			}
+		}
+		BOOST_CHECK_EQUAL(pool->BytesInUse(), 0);
+	}
+	BOOST_REQUIRE_GT(dataWritten, 18 * segmentSize);
+	BOOST_CHECK_EQUAL(dataLength, 14 * segmentSize);
+
+	// a new buffer takes the data found in the file, which hasn't been overwritten since
+	cOverwritingRingBuffer buffer(16 * segmentSize, pool);
+	BOOST_REQUIRE(buffer.AttachFile(file, pageSize));
+	BOOST_REQUIRE(buffer.Restore(dataStart, dataLength, dataWritten));
+	BOOST_CHECK_EQUAL(buffer.BytesWritten(), dataWritten);
+	BOOST_CHECK_EQUAL(buffer.BytesAvailable(), dataLength);
+	uchar* data;
+	uint64_t count;
+	uint64_t readOffset = buffer.BytesDropped();
+	while ((count = buffer.ReadData(&data, 3 * segmentSize)) > 0)
+	{
+		for (uint64_t i = 0; i < count; i++, readOffset++)
+		{
+			BOOST_REQUIRE_EQUAL(data[i], (uchar)(readOffset % 251));
+		}
+	}
+	BOOST_CHECK_EQUAL(readOffset, dataWritten);
+
+	// state not matching the buffer is refused
+	cOverwritingRingBuffer other(16 * segmentSize, pool);
+	BOOST_REQUIRE(other.AttachFile(file, pageSize));
+	BOOST_CHECK(!other.Restore(dataStart + 1, dataLength, dataWritten));
+	close(file);
+}
+
+
+BOOST_AUTO_TEST_CASE(FileSegments)
+{
+	cSegmentPool pool(4096, false);
+	CheckFileBuffer(&pool);
+}
+
+
+BOOST_AUTO_TEST_CASE(MirroredFileSegments)
+{
+	cSegmentPool pool(sysconf(_SC_PAGESIZE));
+	CheckFileBuffer(&pool);
+}
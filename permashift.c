@@ -7,6 +7,14 @@
 
 #include "permashift.h"
 #include "bufferreceiver.h"
+#include "segmentpool.h"
+#include "services.h"
+#include "bufferplayer.h"
+#include "clipexporter.h"
+#include "latencyhistogram.h"
+
+#include <getopt.h>
+#include <unistd.h>
 
 
 static const char *VERSION        = "1.0.4";
@@ -18,6 +26,11 @@ static const char *MenuEntry_EnablePlugin = "EnablePlugin";
 static const char *MenuEntry_MaxLength = "MaxTimeshiftLength";	// obsolete, but must be recognized for ignoring
 static const char *MenuEntry_BufferSize = "MemoryBufferSizeMB";
 static const char *MenuEntry_SaveOnTheFly = "SaveOnTheFly";
+static const char *MenuEntry_SaveMode = "SaveMode";
+static const char *MenuEntry_SaveWorkers = "SaveFilesInParallel";
+static const char *MenuEntry_BufferedChannels = "BufferedChannels";
+static const char *MenuEntry_BufferTransponder = "BufferTransponder";
+static const char *MenuEntry_SpillSize = "DiscBufferSizeGB";
 
 // option variables
 const char *bufferSizeTexts[] = { "20 MB", "50 MB", "100 MB", "250 MB", "500 MB", "1 GB", "2 GB", "3 GB", "4 GB", "5 GB", "6 GB"};
@@ -27,6 +40,22 @@ int bufferSizesInMB[bufferSizeCount] = { 20, 50, 100, 250, 500, 1 * 1024, 2 * 10
 int g_bufferSize = 100;
 bool g_enablePlugin = true;
 bool g_saveOnTheFly = true;
+const char *saveModeTexts[smCount] = { trNOOP("through cache"), trNOOP("dropping cache"), trNOOP("direct I/O") };
+int g_saveMode = smCached;
+int g_saveWorkers = 1;
+// the memory buffer size is shared by the buffers of all channels
+int g_bufferedChannels = 3;
+// channels on the same transponder as the one watched are buffered as well (as far as channels are kept)
+bool g_bufferTransponder = false;
+// older data of the channel watched is evicted to disc, beyond the memory buffer size (GB, 0 if off)
+int g_spillSize = 0;
+// directory for data evicted to disc (command line option)
+cString g_spillDirectory;
+// directory for the buffer of the channel watched to survive restarts (command line option)
+cString g_persistDirectory;
+
+// time between checks of memory used by all buffers
+#define BUDGET_CHECK_INTERVAL_MS 1000
 
 
 const char *cPluginPermashift::Version(void) { return VERSION; }
@@ -34,33 +63,106 @@ const char *cPluginPermashift::Description(void) { return tr(DESCRIPTION); }
 
 
 cPluginPermashift::cPluginPermashift(void) : 
-		m_statusMonitor(NULL), m_bufferReceiver(NULL)
+		m_statusMonitor(NULL), m_bufferReceiver(NULL), m_segmentPool(NULL), m_analyzer(NULL), m_staleBufferFilesRemoved(false),
+		m_clipExporter(NULL)
 {
 
 }
 
 cPluginPermashift::~cPluginPermashift()
 {
+	DeleteClipExporter();
 	if (m_bufferReceiver != NULL)
 	{
 		delete m_bufferReceiver;
 	}
+	while (DropParkedBuffer(0))
+	{
+	}
 	if (m_statusMonitor != NULL)
 	{
 		delete m_statusMonitor;
 	}
+	if (m_analyzer != NULL)
+	{
+		delete m_analyzer;
+	}
+	if (m_segmentPool != NULL)
+	{
+		delete m_segmentPool;
+	}
+}
+
+const char *cPluginPermashift::CommandLineHelp(void)
+{
+	return "  -s DIR,   --spilldir=DIR  directory for buffer data evicted to disc\n"
+		"                            (see setup option \"Disc buffer size\")\n"
+		"  -p DIR,   --persistdir=DIR  keep buffer of channel watched in a file in DIR,\n"
+		"                            resuming it after restarting\n";
+}
+
+bool cPluginPermashift::ProcessArgs(int argc, char *argv[])
+{
+	static struct option longOptions[] =
+	{
+		{ "spilldir", required_argument, NULL, 's' },
+		{ "persistdir", required_argument, NULL, 'p' },
+		{ NULL, no_argument, NULL, 0 }
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "s:p:", longOptions, NULL)) != -1)
+	{
+		switch (c)
+		{
+		case 's':
+			g_spillDirectory = optarg;
+			break;
+		case 'p':
+			g_persistDirectory = optarg;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
 }
 
 bool cPluginPermashift::Start(void)
 {
+	m_segmentPool = new cSegmentPool();
+	m_analyzer = new cBufferAnalyzer();
 	m_statusMonitor = new LRStatusMonitor(this);
 	return true;
 }
 
 void cPluginPermashift::Stop(void)
 {
-	// stop last recording
+	// an export not done yet is given up
+	DeleteClipExporter();
+
+	// the buffer of the channel watched is resumed after restarting
+	m_bufferMutex.Lock();
+	if (m_bufferReceiver != NULL && !m_bufferReceiver->IsPromoted())
+	{
+		m_bufferReceiver->KeepBufferFile();
+	}
+	m_bufferMutex.Unlock();
+
+	// stop last recording and drop buffers of other channels
 	StopLiveRecording();
+	while (DropParkedBuffer(0))
+	{
+	}
+}
+
+void cPluginPermashift::MainThreadHook(void)
+{
+	if (m_budgetCheckTimer.TimedOut())
+	{
+		EnforceMemoryBudget();
+		m_budgetCheckTimer.Set(BUDGET_CHECK_INTERVAL_MS);
+	}
 }
 
 void cPluginPermashift::ChannelSwitch(const cDevice *device, int channelNumber, bool liveView)
@@ -69,18 +171,38 @@ void cPluginPermashift::ChannelSwitch(const cDevice *device, int channelNumber,
 	{
 		if (liveView)
 		{
-			if (channelNumber > 0)
-			{
-				StartLiveRecording(channelNumber);
-			}
-			else
+			// A switch is announced with channel number 0, but the buffer is kept until
+			// the new channel is known, so switching back to the channel being buffered
+			// (e.g. when replay of the buffer ends) doesn't lose its contents.
+			if (channelNumber > 0 && !IsBuffering(channelNumber))
 			{
-				StopLiveRecording();
+				// keep buffer of channel switched away from, switching back resumes it
+				ParkLiveRecording();
+				if (!ResumeLiveRecording(channelNumber))
+				{
+					StartLiveRecording(channelNumber);
+				}
+				if (g_bufferTransponder)
+				{
+					StartTransponderBuffers(channelNumber);
+				}
+				EnforceMemoryBudget();
 			}
 		}
 	}
 }
 
+bool cPluginPermashift::IsBuffering(int channelNumber)
+{
+#if VDRVERSNUM > 20300
+	LOCK_CHANNELS_READ;
+	const cChannel *channel = Channels->GetByNumber(channelNumber);
+#else
+	const cChannel *channel = Channels.GetByNumber(channelNumber);
+#endif
+	return m_bufferReceiver != NULL && m_bufferReceiver->IsAttached() && m_bufferReceiver->IsPreRecording(channel);
+}
+
 bool cPluginPermashift::StartLiveRecording(int channelNumber)
 {
 #if VDRVERSNUM > 20300
@@ -96,48 +218,325 @@ bool cPluginPermashift::StartLiveRecording(int channelNumber)
 	}
 
 	dsyslog("permashift: starting RAM recording\n");
-	
-	// create our receiver
-	m_bufferReceiver = new cBufferReceiver();
 
-	// allocate buffer memory (MBs rounded to multiple of TS package size 188)
-	if (!m_bufferReceiver->Allocate((g_bufferSize * 1024ull * 1024) / 188 * 188))
+	// keep as much memory for the next receiver as this one may use
+	m_segmentPool->SetSpareLimit(g_bufferSize * 1024ull * 1024);
+
+	// a buffer kept in a file is memory mapped from it as a whole, which rules out evicting data to disc
+	uint64_t spillSize = 0;
+	if (g_spillSize > 0 && *g_persistDirectory == NULL)
+	{
+		if (*g_spillDirectory != NULL)
+		{
+			spillSize = g_spillSize * 1024ull * 1024 * 1024;
+		}
+		else
+		{
+			esyslog("permashift: no directory for disc buffer given (option --spilldir)!");
+		}
+	}
+
+	cBufferReceiver* bufferReceiver = CreateBuffer(channel, g_bufferSize * 1024ull * 1024, spillSize);
+	if (bufferReceiver == NULL)
 	{
-		delete m_bufferReceiver;
-		m_bufferReceiver = NULL;
-		esyslog("permashift: out of memory!");
 		Skins.QueueMessage(mtError, tr("Permashift out of memory!"));
 		return false;
 	}
 
-	// pass channel, options and a pointer to this plugin for callback
-	m_bufferReceiver->SetChannel(channel);
-	m_bufferReceiver->SetSavingOnTheFly(g_saveOnTheFly);
-	m_bufferReceiver->SetOwner(this);
+	if (*g_persistDirectory != NULL && bufferReceiver->MakePersistent(g_persistDirectory) && !m_staleBufferFilesRemoved)
+	{
+		RemoveStaleBufferFiles(channel);
+		m_staleBufferFilesRemoved = true;
+	}
+
+	m_bufferMutex.Lock();
+	m_bufferReceiver = bufferReceiver;
+	m_bufferMutex.Unlock();
 
 	// attach it as current receiver
 	dsyslog("permashift: attaching our receiver\n");
-	cDevice::ActualDevice()->AttachReceiver(m_bufferReceiver);
+	cDevice::ActualDevice()->AttachReceiver(bufferReceiver);
 
 	dsyslog("permashift: started live recording\n");
 
 	return true;
 }
 
+cBufferReceiver* cPluginPermashift::CreateBuffer(const cChannel* channel, uint64_t bufferSize, uint64_t spillSize)
+{
+	// create our receiver
+	cBufferReceiver* bufferReceiver = new cBufferReceiver(m_segmentPool, m_analyzer);
+
+	// allocate buffer memory (rounded to multiple of TS package size 188)
+	if (!bufferReceiver->Allocate(bufferSize / 188 * 188, spillSize / 188 * 188, g_spillDirectory))
+	{
+		delete bufferReceiver;
+		esyslog("permashift: out of memory!");
+		return NULL;
+	}
+
+	// pass channel, options and a pointer to this plugin for callback
+	bufferReceiver->SetChannel(channel);
+	bufferReceiver->SetSavingOnTheFly(g_saveOnTheFly);
+	bufferReceiver->SetSaveMode((eSaveMode)g_saveMode);
+	bufferReceiver->SetSaveWorkers(g_saveWorkers);
+	bufferReceiver->SetOwner(this);
+
+	return bufferReceiver;
+}
+
+void cPluginPermashift::StartTransponderBuffers(int channelNumber)
+{
+#if VDRVERSNUM > 20300
+	LOCK_CHANNELS_READ;
+	const cChannels* channels = Channels;
+#else
+	cChannels* channels = &Channels;
+#endif
+	const cChannel *liveChannel = channels->GetByNumber(channelNumber);
+	if (liveChannel == NULL) return;
+
+	// video channels on the multiplex the device is tuned to, nearest channel numbers first
+	// (encrypted ones would need a CAM slot each)
+	cVector<const cChannel*> neighbours;
+	for (const cChannel* channel = channels->First(); channel != NULL; channel = channels->Next(channel))
+	{
+		if (channel == liveChannel || channel->GroupSep() || channel->Vpid() == 0 || channel->Ca() != 0
+			|| channel->Source() != liveChannel->Source() || !ISTRANSPONDER(channel->Transponder(), liveChannel->Transponder()))
+		{
+			continue;
+		}
+		int distance = abs(channel->Number() - channelNumber);
+		int position = 0;
+		while (position < neighbours.Size() && abs(neighbours[position]->Number() - channelNumber) <= distance)
+		{
+			position++;
+		}
+		neighbours.Insert(channel, position);
+	}
+
+	// each buffer gets its share of the memory buffer size
+	uint64_t bufferSize = g_bufferSize * 1024ull * 1024 / g_bufferedChannels;
+	for (int neighbour = 0; neighbour < neighbours.Size() && ParkedBuffers() < g_bufferedChannels - 1; neighbour++)
+	{
+		const cChannel* channel = neighbours[neighbour];
+		if (IsKept(channel)) continue;
+
+		cBufferReceiver* bufferReceiver = CreateBuffer(channel, bufferSize);
+		if (bufferReceiver == NULL) break;
+
+		bufferReceiver->SetWatched(false);
+		if (!cDevice::ActualDevice()->AttachReceiver(bufferReceiver))
+		{
+			delete bufferReceiver;
+			continue;
+		}
+		dsyslog("permashift: buffering channel %d on same transponder\n", channel->Number());
+
+		m_bufferMutex.Lock();
+		m_parkedReceivers.Append(bufferReceiver);
+		m_bufferMutex.Unlock();
+	}
+}
+
+bool cPluginPermashift::IsKept(const cChannel* channel)
+{
+	cMutexLock lock(&m_bufferMutex);
+
+	for (int parked = 0; parked < m_parkedReceivers.Size(); parked++)
+	{
+		if (m_parkedReceivers[parked]->Channel() == channel)
+		{
+			return true;
+		}
+	}
+	return m_bufferReceiver != NULL && m_bufferReceiver->Channel() == channel;
+}
+
+void cPluginPermashift::ParkLiveRecording()
+{
+	m_bufferMutex.Lock();
+	cBufferReceiver* bufferReceiver = m_bufferReceiver;
+	if (bufferReceiver != NULL && !bufferReceiver->IsPromoted() && g_bufferedChannels > 1)
+	{
+		dsyslog("permashift: keeping buffer of channel %d\n", bufferReceiver->Channel()->Number());
+		bufferReceiver->SetWatched(false);
+		m_parkedReceivers.Append(bufferReceiver);
+		m_bufferReceiver = NULL;
+	}
+	m_bufferMutex.Unlock();
+
+	// buffer not kept is deleted
+	StopLiveRecording();
+
+	// make room for the channel switched to
+	while (ParkedBuffers() > g_bufferedChannels - 1 && DropParkedBuffer(0))
+	{
+	}
+}
+
+bool cPluginPermashift::ResumeLiveRecording(int channelNumber)
+{
+#if VDRVERSNUM > 20300
+	LOCK_CHANNELS_READ;
+	const cChannel *channel = Channels->GetByNumber(channelNumber);
+#else
+	const cChannel *channel = Channels.GetByNumber(channelNumber);
+#endif
+
+	m_bufferMutex.Lock();
+	cBufferReceiver* bufferReceiver = NULL;
+	for (int parked = 0; parked < m_parkedReceivers.Size(); parked++)
+	{
+		if (m_parkedReceivers[parked]->IsPreRecording(channel))
+		{
+			bufferReceiver = m_parkedReceivers[parked];
+			m_parkedReceivers.Remove(parked);
+			break;
+		}
+	}
+	m_bufferMutex.Unlock();
+	if (bufferReceiver == NULL)
+	{
+		return false;
+	}
+
+	// still receiving if there was a tuner left on its transponder, otherwise its history has been frozen
+	if (!bufferReceiver->IsAttached())
+	{
+		dsyslog("permashift: attaching kept buffer of channel %d again\n", channelNumber);
+		if (!cDevice::ActualDevice()->AttachReceiver(bufferReceiver))
+		{
+			esyslog("permashift: could not attach kept buffer!");
+			delete bufferReceiver;
+			return false;
+		}
+	}
+	dsyslog("permashift: resumed buffer of channel %d\n", channelNumber);
+
+	bufferReceiver->SetWatched(true);
+	m_bufferMutex.Lock();
+	m_bufferReceiver = bufferReceiver;
+	m_bufferMutex.Unlock();
+	return true;
+}
+
+int cPluginPermashift::ParkedBuffers()
+{
+	cMutexLock lock(&m_bufferMutex);
+
+	// promoted buffers belong to their recordings now
+	for (int parked = m_parkedReceivers.Size() - 1; parked >= 0; parked--)
+	{
+		if (m_parkedReceivers[parked]->IsPromoted())
+		{
+			m_parkedReceivers.Remove(parked);
+		}
+	}
+	return m_parkedReceivers.Size();
+}
+
+bool cPluginPermashift::DropParkedBuffer(int parked)
+{
+	m_bufferMutex.Lock();
+	if (parked >= m_parkedReceivers.Size())
+	{
+		m_bufferMutex.Unlock();
+		return false;
+	}
+	cBufferReceiver* bufferReceiver = m_parkedReceivers[parked];
+	m_parkedReceivers.Remove(parked);
+	m_bufferMutex.Unlock();
+
+	if (!bufferReceiver->IsPromoted())
+	{
+		dsyslog("permashift: dropping kept buffer of channel %d\n", bufferReceiver->Channel()->Number());
+		delete bufferReceiver;
+	}
+	return true;
+}
+
+void cPluginPermashift::EnforceMemoryBudget()
+{
+	uint64_t budget = g_bufferSize * 1024ull * 1024;
+	while (ParkedBuffers() > 0 && BufferMemoryInUse() > budget)
+	{
+		// drop the buffer costing most, holding most data for the longest time unwatched
+		uint64_t now = cTimeMs::Now();
+		int victim = 0;
+		double victimCost = -1;
+		m_bufferMutex.Lock();
+		for (int parked = 0; parked < m_parkedReceivers.Size(); parked++)
+		{
+			double unwatchedSecs = (now - m_parkedReceivers[parked]->UnwatchedSince()) / 1000.0;
+			double cost = (m_parkedReceivers[parked]->BufferedBytes() + 1.0) * (unwatchedSecs + 1);
+			if (cost > victimCost)
+			{
+				victim = parked;
+				victimCost = cost;
+			}
+		}
+		m_bufferMutex.Unlock();
+
+		if (!DropParkedBuffer(victim))
+		{
+			break;
+		}
+	}
+}
+
+uint64_t cPluginPermashift::BufferMemoryInUse()
+{
+	uint64_t inUse = m_segmentPool->BytesInUse();
+
+	cMutexLock lock(&m_bufferMutex);
+	if (m_bufferReceiver != NULL)
+	{
+		inUse += m_bufferReceiver->FileBackedBytes();
+	}
+	for (int parked = 0; parked < m_parkedReceivers.Size(); parked++)
+	{
+		inUse += m_parkedReceivers[parked]->FileBackedBytes();
+	}
+	return inUse;
+}
+
+void cPluginPermashift::RemoveStaleBufferFiles(const cChannel* channel)
+{
+	// buffers of other channels (kept when VDR went down) are not resumed
+	cString keptName = cString::sprintf("%s.buffer", *channel->GetChannelID().ToString());
+	cReadDir directory(g_persistDirectory);
+	struct dirent* entry;
+	while ((entry = directory.Next()) != NULL)
+	{
+		if (!endswith(entry->d_name, ".buffer") || strcmp(entry->d_name, keptName) == 0) continue;
+
+		cString fileName = AddDirectory(g_persistDirectory, entry->d_name);
+		dsyslog("permashift: removing stale buffer file %s\n", *fileName);
+		if (unlink(fileName) != 0)
+		{
+			esyslog("permashift: could not delete buffer file %s (%d)!", *fileName, errno);
+		}
+	}
+}
+
 bool cPluginPermashift::StopLiveRecording()
 {
 	dsyslog("permashift: stopping live recording\n");
 	
-	// Check if it has been promoted and thus shouldn't be deleted by us.
-	if (m_bufferReceiver != NULL && !m_bufferReceiver->IsPromoted())
+	// we're "detaching" in any case, so other threads won't access the buffer anymore...
+	m_bufferMutex.Lock();
+	cBufferReceiver* bufferReceiver = m_bufferReceiver;
+	m_bufferReceiver = NULL;
+	m_bufferMutex.Unlock();
+
+	// ... but check if it has been promoted and thus shouldn't be deleted by us.
+	if (bufferReceiver != NULL && !bufferReceiver->IsPromoted())
 	{
 		dsyslog("permashift: deleting recording buffer\n");
-		delete m_bufferReceiver;
+		delete bufferReceiver;
 	}
 
-	// ... but we're "detaching" in any case
-	m_bufferReceiver = NULL;
-
 	dsyslog("permashift: stopped live recording\n");
 	
 	return true;
@@ -149,10 +548,32 @@ void cPluginPermashift::BufferDeleted(cBufferReceiver* callingReceiver)
 	
 	// our buffer is about to be deleted by other means
 	// only delete it if it is really our buffer and not an old promoted one!
+	cMutexLock lock(&m_bufferMutex);
 	if (m_bufferReceiver == callingReceiver)
 	{
 		m_bufferReceiver = NULL;
 	}
+	int parked = m_parkedReceivers.IndexOf(callingReceiver);
+	if (parked >= 0)
+	{
+		m_parkedReceivers.Remove(parked);
+	}
+}
+
+cBufferReceiver* cPluginPermashift::LockBuffer(cBufferReceiver* bufferReceiver)
+{
+	m_bufferMutex.Lock();
+	if (bufferReceiver == NULL || m_bufferReceiver != bufferReceiver || bufferReceiver->IsPromoted())
+	{
+		m_bufferMutex.Unlock();
+		return NULL;
+	}
+	return bufferReceiver;
+}
+
+void cPluginPermashift::UnlockBuffer()
+{
+	m_bufferMutex.Unlock();
 }
 
 cMenuSetupPage *cPluginPermashift::SetupMenu(void)
@@ -184,6 +605,43 @@ bool cPluginPermashift::SetupParse(const char *Name, const char *Value)
 		g_saveOnTheFly = (0 == strcmp(Value, "1"));
 		return true;
 	}
+	else if (!strcmp(Name, MenuEntry_SaveMode))
+	{
+		if (isnumber(Value) && atoi(Value) < smCount)
+		{
+			g_saveMode = atoi(Value);
+			return true;
+		}
+	}
+	else if (!strcmp(Name, MenuEntry_SaveWorkers))
+	{
+		if (isnumber(Value))
+		{
+			g_saveWorkers = constrain(atoi(Value), 1, MAX_SAVE_WORKERS);
+			return true;
+		}
+	}
+	else if (!strcmp(Name, MenuEntry_BufferTransponder))
+	{
+		g_bufferTransponder = (0 == strcmp(Value, "1"));
+		return true;
+	}
+	else if (!strcmp(Name, MenuEntry_BufferedChannels))
+	{
+		if (isnumber(Value))
+		{
+			g_bufferedChannels = constrain(atoi(Value), 1, MAX_BUFFERED_CHANNELS);
+			return true;
+		}
+	}
+	else if (!strcmp(Name, MenuEntry_SpillSize))
+	{
+		if (isnumber(Value))
+		{
+			g_spillSize = constrain(atoi(Value), 0, MAX_SPILL_SIZE_GB);
+			return true;
+		}
+	}
 	return false;
 }
 
@@ -194,12 +652,72 @@ bool cPluginPermashift::Service(const char* Id, void* Data)
 	{
 		if (Data != NULL)
 		{
-			if (m_bufferReceiver != NULL)
+			cBufferAccess access(this, m_bufferReceiver);
+			if (access.Receiver() != NULL)
 			{
 				// get data but ignore return value,
 				// we're supposed to return true either way as we know the service id
-				(void)m_bufferReceiver->GetUsedBufferSecs((int*)Data);
+				(void)access.Receiver()->GetUsedBufferSecs((int*)Data);
+			}
+		}
+		return true;
+	}
+
+	// map time before newest frame to buffer position and vice versa
+	if (strcmp(Id, "Permashift-TimeToOffset-v1") == 0 || strcmp(Id, "Permashift-OffsetToTime-v1") == 0)
+	{
+		if (Data != NULL)
+		{
+			Permashift_BufferPosition_v1* position = (Permashift_BufferPosition_v1*)Data;
+			bool found = false;
+			cBufferAccess access(this, m_bufferReceiver);
+			if (access.Receiver() != NULL)
+			{
+				if (strcmp(Id, "Permashift-TimeToOffset-v1") == 0)
+				{
+					found = access.Receiver()->TimeToOffset(position->secondsBack, &position->offset, &position->frame);
+				}
+				else
+				{
+					found = access.Receiver()->OffsetToTime(position->offset, &position->secondsBack, &position->frame);
+				}
 			}
+			if (!found)
+			{
+				position->frame = -1;
+			}
+		}
+		return true;
+	}
+
+	// replay buffer from memory instead of pausing live video
+	if (strcmp(Id, "Permashift-PlayBuffer-v1") == 0)
+	{
+		if (Data != NULL)
+		{
+			Permashift_PlayBuffer_v1* play = (Permashift_PlayBuffer_v1*)Data;
+			play->started = PlayBuffer(play->rewind);
+		}
+		return true;
+	}
+
+	// statistics for monitoring
+	if (strcmp(Id, "Permashift-GetStats-v1") == 0)
+	{
+		if (Data != NULL)
+		{
+			GetStats((Permashift_Stats_v1*)Data);
+		}
+		return true;
+	}
+
+	// export part of the buffer as a recording of its own
+	if (strcmp(Id, "Permashift-ExportClip-v1") == 0)
+	{
+		if (Data != NULL)
+		{
+			Permashift_ExportClip_v1* clip = (Permashift_ExportClip_v1*)Data;
+			clip->started = ExportClip(clip->secondsBack, clip->seconds, clip->title);
 		}
 		return true;
 	}
@@ -207,6 +725,199 @@ bool cPluginPermashift::Service(const char* Id, void* Data)
 	return false;
 }
 
+bool cPluginPermashift::PlayBuffer(bool rewind)
+{
+	// the buffer can't go away while the player is set up, which locks it as well
+	cBufferAccess access(this, m_bufferReceiver);
+	if (access.Receiver() == NULL)
+	{
+		return false;
+	}
+
+	// replay starts at the newest complete I frame
+	uint64_t offset;
+	int length;
+	int64_t frameTime;
+	if (!access.Receiver()->FindIFrame(INT64_MAX, false, &offset, &length, &frameTime))
+	{
+		return false;
+	}
+
+	dsyslog("permashift: replaying buffer from memory");
+	cControl::Launch(new cBufferControl(this, access.Receiver(), rewind));
+	cControl::Attach();
+	return true;
+}
+
+void cPluginPermashift::GetStats(Permashift_Stats_v1* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->switchMs = -1;
+
+	{
+		cBufferAccess access(this, m_bufferReceiver);
+		if (access.Receiver() != NULL)
+		{
+			stats->buffering = true;
+			access.Receiver()->GetStats(stats);
+		}
+	}
+
+	stats->keptBuffers = ParkedBuffers();
+	stats->poolBytes = m_segmentPool != NULL ? m_segmentPool->BytesInUse() : 0;
+}
+
+bool cPluginPermashift::ExportClip(double secondsBack, double seconds, const char* title, cString* recordingName)
+{
+	cMutexLock lock(&m_exportMutex);
+
+	// one export at a time
+	if (m_clipExporter != NULL && m_clipExporter->State() == cClipExporter::esExporting)
+	{
+		return false;
+	}
+	delete m_clipExporter;
+	m_clipExporter = new cClipExporter(this, m_bufferReceiver, title);
+	if (!m_clipExporter->Export(secondsBack, seconds))
+	{
+		delete m_clipExporter;
+		m_clipExporter = NULL;
+		return false;
+	}
+	if (recordingName != NULL)
+	{
+		*recordingName = m_clipExporter->RecordingName();
+	}
+	return true;
+}
+
+void cPluginPermashift::DeleteClipExporter()
+{
+	cMutexLock lock(&m_exportMutex);
+
+	delete m_clipExporter;
+	m_clipExporter = NULL;
+}
+
+const char **cPluginPermashift::SVDRPHelpPages(void)
+{
+	static const char *HelpPages[] =
+	{
+		"STAT\n"
+		"    Print statistics of the buffer of the channel watched,\n"
+		"    one \"name: value\" pair per line.",
+		"LAT [ RESET ]\n"
+		"    Print latency histograms of receiving, analysis, switching to disk\n"
+		"    recording, buffer writes and saving (if built with LATENCY=1).\n"
+		"    With RESET, the histograms start over.",
+		"CLIP [ <seconds back> [ <seconds> ] [ <title> ] ]\n"
+		"    Export the buffer of the channel watched, from <seconds back> before\n"
+		"    its newest frame on, as a recording of its own named <title> (the\n"
+		"    channel's name by default), lasting <seconds> or up to the newest\n"
+		"    frame. The clip is written in the background while buffering goes on.\n"
+		"    Without options, print the state of the last export.",
+		NULL
+	};
+	return HelpPages;
+}
+
+cString cPluginPermashift::SVDRPCommand(const char *Command, const char *Option, int &ReplyCode)
+{
+	if (strcasecmp(Command, "STAT") == 0)
+	{
+		Permashift_Stats_v1 stats;
+		GetStats(&stats);
+		return cString::sprintf(
+			"buffering: %d\n"
+			"channel: %d\n"
+			"bytes_written: %llu\n"
+			"bytes_dropped: %llu\n"
+			"bytes_available: %llu\n"
+			"bytes_in_memory: %llu\n"
+			"frames: %d\n"
+			"iframes: %d\n"
+			"bitrate: %.0f\n"
+			"fill_secs: %.1f\n"
+			"receive_calls_per_sec: %.1f\n"
+			"analysis_lag: %d\n"
+			"max_analysis_lag: %d\n"
+			"lock_wait_us: %llu\n"
+			"switch_ms: %d\n"
+			"bytes_to_save: %llu\n"
+			"bytes_saved: %llu\n"
+			"save_mb_per_sec: %.1f\n"
+			"kept_buffers: %d\n"
+			"pool_bytes: %llu",
+			stats.buffering, stats.channelNumber,
+			(unsigned long long)stats.bytesWritten, (unsigned long long)stats.bytesDropped,
+			(unsigned long long)stats.bytesAvailable, (unsigned long long)stats.bytesInMemory,
+			stats.frames, stats.iFrames, stats.bitrate, stats.fillSecs, stats.receiveCallsPerSec,
+			stats.analysisLag, stats.maxAnalysisLag, (unsigned long long)stats.lockWaitUs, stats.switchMs,
+			(unsigned long long)stats.bytesToSave, (unsigned long long)stats.bytesSaved, stats.saveMBPerSec,
+			stats.keptBuffers, (unsigned long long)stats.poolBytes);
+	}
+	if (strcasecmp(Command, "CLIP") == 0)
+	{
+		if (isempty(Option))
+		{
+			cMutexLock lock(&m_exportMutex);
+			if (m_clipExporter == NULL)
+			{
+				ReplyCode = 550;
+				return "No clip exported";
+			}
+			static const char* stateNames[] = { "exporting", "done", "failed" };
+			uint64_t bytesToExport, bytesExported;
+			m_clipExporter->GetProgress(&bytesToExport, &bytesExported);
+			return cString::sprintf(
+				"state: %s\n"
+				"recording: %s\n"
+				"bytes_to_export: %llu\n"
+				"bytes_exported: %llu",
+				stateNames[m_clipExporter->State()], m_clipExporter->RecordingName(),
+				(unsigned long long)bytesToExport, (unsigned long long)bytesExported);
+		}
+
+		// seconds back, then optionally the length (a title must not start with a digit then)
+		char* end;
+		double secondsBack = strtod(Option, &end);
+		if (end == Option || secondsBack <= 0)
+		{
+			ReplyCode = 501;
+			return "Seconds back missing";
+		}
+		double seconds = 0;
+		Option = skipspace(end);
+		if (isdigit(*Option))
+		{
+			seconds = strtod(Option, &end);
+			Option = skipspace(end);
+		}
+		cString recordingName;
+		if (!ExportClip(secondsBack, seconds, *Option ? Option : NULL, &recordingName))
+		{
+			ReplyCode = 550;
+			return "No clip exported (no buffer, or last export still running)";
+		}
+		return cString::sprintf("Exporting clip to %s", *recordingName);
+	}
+	if (strcasecmp(Command, "LAT") == 0)
+	{
+#ifdef PERMASHIFT_LATENCY_HISTOGRAMS
+		if (Option != NULL && strcasecmp(Option, "RESET") == 0)
+		{
+			ResetLatencyHistograms();
+			return "Latency histograms reset";
+		}
+		return DumpLatencyHistograms();
+#else
+		ReplyCode = 550;
+		return "Latency histograms not built in (build with LATENCY=1)";
+#endif
+	}
+	return NULL;
+}
+
 cMenuSetupLR::cMenuSetupLR()
 {
 	newEnablePlugin = g_enablePlugin;
@@ -219,10 +930,24 @@ cMenuSetupLR::cMenuSetupLR()
 		}
 	}
 	newSaveBlocksRewind = !g_saveOnTheFly;
+	newSaveMode = g_saveMode;
+	newSaveWorkers = g_saveWorkers;
+	newBufferedChannels = g_bufferedChannels;
+	newBufferTransponder = g_bufferTransponder;
+	newSpillSize = g_spillSize;
+	for (int i = 0; i < smCount; i++)
+	{
+		saveModeItems[i] = tr(saveModeTexts[i]);
+	}
 
 	Add(new cMenuEditBoolItem(tr("Enable plugin"), &newEnablePlugin));
 	Add(new cMenuEditStraItem(tr("Memory buffer size"), &newBufferSizeIndex, bufferSizeCount, bufferSizeTexts));
 	Add(new cMenuEditBoolItem(tr("Saving buffer blocks rewinding"), &newSaveBlocksRewind));
+	Add(new cMenuEditStraItem(tr("Saving buffer to disc"), &newSaveMode, smCount, saveModeItems));
+	Add(new cMenuEditIntItem(tr("Files saved in parallel"), &newSaveWorkers, 1, MAX_SAVE_WORKERS));
+	Add(new cMenuEditIntItem(tr("Channels kept buffered"), &newBufferedChannels, 1, MAX_BUFFERED_CHANNELS));
+	Add(new cMenuEditBoolItem(tr("Buffer channels on same transponder"), &newBufferTransponder));
+	Add(new cMenuEditIntItem(tr("Disc buffer size (GB)"), &newSpillSize, 0, MAX_SPILL_SIZE_GB, tr("off")));
 }
 
 void cMenuSetupLR::Store(void)
@@ -230,10 +955,20 @@ void cMenuSetupLR::Store(void)
 	g_enablePlugin = newEnablePlugin;
 	g_bufferSize = bufferSizesInMB[newBufferSizeIndex];
 	g_saveOnTheFly = !newSaveBlocksRewind;
+	g_saveMode = newSaveMode;
+	g_saveWorkers = newSaveWorkers;
+	g_bufferedChannels = newBufferedChannels;
+	g_bufferTransponder = newBufferTransponder;
+	g_spillSize = newSpillSize;
 
 	SetupStore(MenuEntry_EnablePlugin, newEnablePlugin);
 	SetupStore(MenuEntry_BufferSize, g_bufferSize);
 	SetupStore(MenuEntry_SaveOnTheFly, g_saveOnTheFly);
+	SetupStore(MenuEntry_SaveMode, g_saveMode);
+	SetupStore(MenuEntry_SaveWorkers, g_saveWorkers);
+	SetupStore(MenuEntry_BufferedChannels, g_bufferedChannels);
+	SetupStore(MenuEntry_BufferTransponder, g_bufferTransponder);
+	SetupStore(MenuEntry_SpillSize, g_spillSize);
 }
 
 
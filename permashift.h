@@ -13,8 +13,20 @@
 #include <vdr/shutdown.h>
 #include <vdr/interface.h>
 
+#include "bufferwriter.h"
+
 class cPluginPermashift;
 class cBufferReceiver;
+class cSegmentPool;
+class cBufferAnalyzer;
+class cClipExporter;
+struct Permashift_Stats_v1;
+
+/// most channels whose buffers are kept
+#define MAX_BUFFERED_CHANNELS 8
+
+/// largest disc buffer of the channel watched (GB)
+#define MAX_SPILL_SIZE_GB 64
 
 /// Setup menu class
 class cMenuSetupLR : public cMenuSetupPage 
@@ -23,6 +35,12 @@ private:
 	int newEnablePlugin;
 	int newBufferSizeIndex;
 	int newSaveBlocksRewind;
+	int newSaveMode;
+	int newSaveWorkers;
+	int newBufferedChannels;
+	int newBufferTransponder;
+	int newSpillSize;
+	const char *saveModeItems[smCount];
 
 protected:
 	virtual void Store(void);
@@ -58,9 +76,33 @@ private:
 	// our status monitor
 	LRStatusMonitor *m_statusMonitor;
 
-	// memory buffer receiver
+	// memory buffer receiver of channel watched live
 	cBufferReceiver* m_bufferReceiver;
 
+	// buffer receivers of channels switched away from, least recently watched first
+	cVector<cBufferReceiver*> m_parkedReceivers;
+
+	// time to check memory used by all buffers
+	cTimeMs m_budgetCheckTimer;
+
+	// syncs changing the buffer receiver vs. access by other threads
+	cMutex m_bufferMutex;
+
+	// buffer memory, recycled from one receiver to the next
+	cSegmentPool* m_segmentPool;
+
+	// thread analyzing received data, shared by all receivers
+	cBufferAnalyzer* m_analyzer;
+
+	// buffer files of other channels left from before a restart have been removed
+	bool m_staleBufferFilesRemoved;
+
+	// syncs starting a clip export vs. deleting the last one
+	cMutex m_exportMutex;
+
+	// exporter of the last clip, NULL if none
+	cClipExporter* m_clipExporter;
+
 public:
 
 	cPluginPermashift(void);
@@ -69,12 +111,22 @@ public:
 	/// our buffer tells us that it's gone
 	void BufferDeleted(cBufferReceiver* callingReceiver);
 
+	/// locks the given buffer against deletion if it's still our current one and not promoted,
+	/// returns NULL (without locking) otherwise
+	cBufferReceiver* LockBuffer(cBufferReceiver* bufferReceiver);
+
+	/// unlocks buffer locked by LockBuffer()
+	void UnlockBuffer();
+
 	/// status callback
 	void ChannelSwitch(const cDevice *device, int channelNumber, bool liveView);
 
 	// plugin overrides
+	virtual const char *CommandLineHelp(void);
+	virtual bool ProcessArgs(int argc, char *argv[]);
 	virtual bool Start(void);
 	virtual void Stop(void);
+	virtual void MainThreadHook(void);
 	virtual const char *Version(void);
 	virtual const char *Description(void);
 	virtual cMenuSetupPage *SetupMenu(void);
@@ -83,14 +135,102 @@ public:
 	/// Service "Permashift-GetUsedBufferSecs-v1", called with int*.
 	/// Will receive the seconds read into buffer available for rewinding.
 	/// If there's no useful value (yet), secs will remain unchanged.
+	/// Services "Permashift-TimeToOffset-v1" and "Permashift-OffsetToTime-v1",
+	/// called with Permashift_BufferPosition_v1* (see services.h).
+	/// Service "Permashift-PlayBuffer-v1", called with Permashift_PlayBuffer_v1*,
+	/// replays the buffer from memory instead of pausing live video.
+	/// Service "Permashift-GetStats-v1", called with Permashift_Stats_v1*,
+	/// fills in statistics for monitoring.
+	/// Service "Permashift-ExportClip-v1", called with Permashift_ExportClip_v1*,
+	/// exports part of the buffer as a recording of its own.
 	bool Service(const char* Id, void* Data);
 
+	/// SVDRP command STAT prints the statistics of service "Permashift-GetStats-v1",
+	/// CLIP exports part of the buffer like service "Permashift-ExportClip-v1"
+	virtual const char **SVDRPHelpPages(void);
+	virtual cString SVDRPCommand(const char *Command, const char *Option, int &ReplyCode);
+
 private:
 
+	/// is the channel being buffered already?
+	bool IsBuffering(int channelNumber);
+
 	/// start a recording
 	bool StartLiveRecording(int channelNumber);
 
 	/// stop a recording
 	bool StopLiveRecording(void);
 
+	/// starts replaying the buffer of the channel watched from memory, pausing or rewinding;
+	/// returns false if there's no buffer or no complete I frame in it yet
+	bool PlayBuffer(bool rewind);
+
+	/// creates a buffer receiver for the given channel and buffer size (plus the size of data evicted to disc),
+	/// returns NULL if out of memory
+	cBufferReceiver* CreateBuffer(const cChannel* channel, uint64_t bufferSize, uint64_t spillSize = 0);
+
+	/// starts buffering other channels on the transponder of the given channel, as far as channels are kept
+	void StartTransponderBuffers(int channelNumber);
+
+	/// is there a buffer of the given channel?
+	bool IsKept(const cChannel* channel);
+
+	/// keeps buffer of channel watched live as a channel switched away from (or stops it)
+	void ParkLiveRecording();
+
+	/// continues buffer kept for a channel switched back to, returns false if there's none
+	bool ResumeLiveRecording(int channelNumber);
+
+	/// number of buffers kept for channels switched away from
+	int ParkedBuffers();
+
+	/// deletes a buffer kept for a channel switched away from, returns false if there's none
+	bool DropParkedBuffer(int parked);
+
+	/// drops kept buffers while all buffers take more memory than the buffer size option allows
+	void EnforceMemoryBudget();
+
+	/// memory taken by all buffers, from the segment pool or mapped from buffer files
+	uint64_t BufferMemoryInUse();
+
+	/// removes buffer files in the persistence directory except the one of the given channel
+	void RemoveStaleBufferFiles(const cChannel* channel);
+
+	/// statistics of the buffer of the channel watched and of all buffers
+	void GetStats(Permashift_Stats_v1* stats);
+
+	/// starts exporting a clip of the buffer of the channel watched (see Permashift_ExportClip_v1),
+	/// giving the directory of its recording; returns false if there's no such clip
+	/// or the last export is still running
+	bool ExportClip(double secondsBack, double seconds, const char* title, cString* recordingName = NULL);
+
+	/// deletes exporter of the last clip, stopping it if it's still running
+	void DeleteClipExporter();
+
+};
+
+
+/// grants access to the buffer of a receiver as long as it exists
+class cBufferAccess
+{
+private:
+	cPluginPermashift* m_plugin;
+	cBufferReceiver* m_bufferReceiver;
+
+public:
+	cBufferAccess(cPluginPermashift* plugin, cBufferReceiver* bufferReceiver) : m_plugin(plugin)
+	{
+		m_bufferReceiver = m_plugin->LockBuffer(bufferReceiver);
+	}
+
+	~cBufferAccess()
+	{
+		if (m_bufferReceiver != NULL)
+		{
+			m_plugin->UnlockBuffer();
+		}
+	}
+
+	/// the buffer's receiver, NULL if it's gone
+	cBufferReceiver* Receiver() { return m_bufferReceiver; }
 };
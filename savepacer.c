@@ -0,0 +1,97 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "savepacer.h"
+
+// below this recorder backlog, all writes may be in flight
+#define BACKLOG_LOW 0.2
+// above this recorder backlog, no write may be started
+#define BACKLOG_HIGH 0.5
+// time spent writing before measured bandwidth is updated
+#define BANDWIDTH_WINDOW_MS 200
+// weight of latest measurement in bandwidth estimate
+#define BANDWIDTH_WEIGHT 0.5
+// time a chunk should take on disc
+#define CHUNK_TARGET_MS 100
+// chunk lengths are multiples of this
+#define CHUNK_GRANULARITY (64 * 1024)
+
+
+cSavePacer::cSavePacer(int maxInFlight) :
+ m_maxInFlight(max(maxInFlight, 1)),
+ m_inFlight(0),
+ m_backlog(0),
+ m_windowBytes(0),
+ m_windowMs(0),
+ m_lastEvent(0),
+ m_bandwidth(0)
+{
+}
+
+void cSavePacer::SetBacklog(int bytesWaiting, int bufferSize)
+{
+	m_backlog = bufferSize > 0 ? (double)bytesWaiting / bufferSize : 0;
+}
+
+void cSavePacer::Advance(uint64_t now)
+{
+	if (m_inFlight > 0 && now > m_lastEvent)
+	{
+		m_windowMs += now - m_lastEvent;
+	}
+	m_lastEvent = now;
+}
+
+void cSavePacer::Submitted(uint64_t now)
+{
+	Advance(now);
+	m_inFlight++;
+}
+
+void cSavePacer::Completed(uint64_t length, uint64_t now)
+{
+	Advance(now);
+	if (m_inFlight > 0)
+	{
+		m_inFlight--;
+	}
+
+	m_windowBytes += length;
+	if (m_windowMs >= BANDWIDTH_WINDOW_MS)
+	{
+		double bandwidth = m_windowBytes * 1000.0 / m_windowMs;
+		m_bandwidth = m_bandwidth > 0 ? (1 - BANDWIDTH_WEIGHT) * m_bandwidth + BANDWIDTH_WEIGHT * bandwidth : bandwidth;
+		m_windowBytes = 0;
+		m_windowMs = 0;
+	}
+}
+
+int cSavePacer::WritesAllowed()
+{
+	if (m_backlog >= BACKLOG_HIGH)
+	{
+		// let the recorder catch up
+		return 0;
+	}
+	if (m_backlog >= BACKLOG_LOW)
+	{
+		return 1;
+	}
+	return m_maxInFlight;
+}
+
+uint64_t cSavePacer::ChunkLength()
+{
+	if (m_bandwidth <= 0)
+	{
+		return SAVE_CHUNK_START;
+	}
+
+	uint64_t length = (uint64_t)(m_bandwidth * CHUNK_TARGET_MS / 1000) / CHUNK_GRANULARITY * CHUNK_GRANULARITY;
+	return min(max(length, (uint64_t)SAVE_CHUNK_MIN), (uint64_t)SAVE_CHUNK_MAX);
+}
@@ -0,0 +1,77 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef SAVEPACER_H_
+#define SAVEPACER_H_
+
+#include <vdr/tools.h>
+
+/// smallest, largest and initial length of chunks saved
+#define SAVE_CHUNK_MIN (256 * 1024)
+#define SAVE_CHUNK_MAX (4 * 1024 * 1024)
+#define SAVE_CHUNK_START (1024 * 1024)
+
+/// decides how fast the buffer is saved while live video is being recorded
+///
+/// The buffer should be saved as fast as the disc allows, but live video comes
+/// first. So the recorder's backlog (the fill level of its ring buffer) decides
+/// how many writes may be in flight: all of them while it's low, one while it
+/// grows, none while it's high. Chunks are sized to take about the same time
+/// on disc, according to the write bandwidth measured while writes are in flight.
+/// Times are passed in (ms), so the pacer doesn't depend on the clock.
+class cSavePacer
+{
+private:
+
+	/// most writes allowed in flight
+	int m_maxInFlight;
+
+	/// writes in flight
+	int m_inFlight;
+
+	/// recorder backlog (fill level of its ring buffer, 0..1)
+	double m_backlog;
+
+	/// bytes written and time spent writing (while writes were in flight) since last bandwidth update
+	uint64_t m_windowBytes;
+	uint64_t m_windowMs;
+
+	/// time of last write submitted or completed
+	uint64_t m_lastEvent;
+
+	/// estimated write bandwidth (bytes per second), 0 if unknown yet
+	double m_bandwidth;
+
+	/// accounts time spent writing up to now
+	void Advance(uint64_t now);
+
+public:
+
+	/// create pacer for the given number of writes in flight
+	cSavePacer(int maxInFlight);
+
+	/// sets recorder backlog, bytes waiting in recorder's ring buffer of given size
+	void SetBacklog(int bytesWaiting, int bufferSize);
+
+	/// a write has been submitted
+	void Submitted(uint64_t now);
+
+	/// a write of given length has completed
+	void Completed(uint64_t length, uint64_t now);
+
+	/// number of writes that may be in flight now
+	int WritesAllowed();
+
+	/// length of next chunk to save
+	uint64_t ChunkLength();
+
+	/// estimated write bandwidth (bytes per second), 0 if unknown yet
+	double Bandwidth() { return m_bandwidth; }
+};
+
+#endif /* SAVEPACER_H_ */
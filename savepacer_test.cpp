@@ -0,0 +1,66 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE SavePacer
+
+#include "savepacer.h"
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_CASE(BacklogLimitsWrites)
+{
+	cSavePacer pacer(4);
+
+	pacer.SetBacklog(0, 1000);
+	BOOST_CHECK_EQUAL(pacer.WritesAllowed(), 4);
+	pacer.SetBacklog(300, 1000);
+	BOOST_CHECK_EQUAL(pacer.WritesAllowed(), 1);
+	pacer.SetBacklog(600, 1000);
+	BOOST_CHECK_EQUAL(pacer.WritesAllowed(), 0);
+	pacer.SetBacklog(100, 1000);
+	BOOST_CHECK_EQUAL(pacer.WritesAllowed(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(ChunksFollowBandwidth)
+{
+	cSavePacer pacer(2);
+	BOOST_CHECK_EQUAL(pacer.ChunkLength(), (uint64_t)SAVE_CHUNK_START);
+
+	// 20 MB/s, two writes in flight all the time
+	uint64_t now = 1000;
+	pacer.Submitted(now);
+	pacer.Submitted(now);
+	for (int write = 0; write < 10; write++)
+	{
+		now += 50;
+		pacer.Completed(1000 * 1000, now);
+		pacer.Submitted(now);
+	}
+	BOOST_CHECK_CLOSE(pacer.Bandwidth(), 20e6, 1);
+	BOOST_CHECK_EQUAL(pacer.ChunkLength(), 30 * 64 * 1024u);
+
+	// idle time doesn't count
+	pacer.Completed(1000 * 1000, now + 50);
+	pacer.Completed(1000 * 1000, now + 50);
+	now += 10000;
+	pacer.Submitted(now);
+	pacer.Completed(1000 * 1000, now + 250);
+	BOOST_CHECK_CLOSE(pacer.Bandwidth(), 16.25e6, 1);
+
+	// fast disc, chunks limited
+	for (int write = 0; write < 400; write++)
+	{
+		pacer.Submitted(now);
+		now += 1;
+		pacer.Completed(SAVE_CHUNK_MAX, now);
+		now += 1000;
+	}
+	BOOST_CHECK_EQUAL(pacer.ChunkLength(), (uint64_t)SAVE_CHUNK_MAX);
+}
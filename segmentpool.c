@@ -0,0 +1,161 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "segmentpool.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+cSegmentPool::cSegmentPool(uint64_t segmentSize, bool useMemoryFile) :
+m_segmentSize(segmentSize), m_memoryFile(-1), m_slotCount(0), m_spareLimit(0)
+{
+#ifdef MFD_CLOEXEC
+	// segments in a memory file have to be mappable, so whole pages are needed
+	if (useMemoryFile && m_segmentSize % sysconf(_SC_PAGESIZE) == 0)
+	{
+		m_memoryFile = memfd_create("permashift", MFD_CLOEXEC);
+		if (m_memoryFile < 0)
+		{
+			dsyslog("permashift: SegmentPool, no memory file (%d), using heap\n", errno);
+		}
+	}
+#endif
+}
+
+cSegmentPool::~cSegmentPool()
+{
+	dsyslog("permashift: SegmentPool, free \n");
+	if (m_memoryFile >= 0)
+	{
+		close(m_memoryFile);
+	}
+	for (int slot = 0; slot < m_heapSegments.Size(); slot++)
+	{
+		free(m_heapSegments[slot]);
+	}
+}
+
+int cSegmentPool::Get(bool* reused)
+{
+	cMutexLock lock(&m_mutex);
+
+	if (reused != NULL)
+	{
+		*reused = false;
+	}
+
+	int slot = -1;
+	if (m_spareSlots.Size() > 0)
+	{
+		// memory is still there
+		slot = m_spareSlots[m_spareSlots.Size() - 1];
+		m_spareSlots.Remove(m_spareSlots.Size() - 1);
+		if (reused != NULL)
+		{
+			*reused = true;
+		}
+		return slot;
+	}
+	else if (m_freeSlots.Size() > 0)
+	{
+		slot = m_freeSlots[m_freeSlots.Size() - 1];
+		m_freeSlots.Remove(m_freeSlots.Size() - 1);
+	}
+	else
+	{
+		// create a new slot by growing the memory file
+		if (m_memoryFile >= 0 && ftruncate(m_memoryFile, (off_t)(m_slotCount + 1) * m_segmentSize) != 0)
+		{
+			esyslog("permashift: could not grow segment memory (%d)!", errno);
+			return -1;
+		}
+		slot = m_slotCount++;
+		if (m_memoryFile < 0)
+		{
+			m_heapSegments.Append(NULL);
+		}
+	}
+
+	if (m_memoryFile < 0 && m_heapSegments[slot] == NULL)
+	{
+		m_heapSegments[slot] = MALLOC(uchar, m_segmentSize);
+		if (m_heapSegments[slot] == NULL)
+		{
+			esyslog("permashift: could not allocate segment memory!");
+			m_freeSlots.Append(slot);
+			return -1;
+		}
+	}
+	return slot;
+}
+
+void cSegmentPool::Put(int slot)
+{
+	cMutexLock lock(&m_mutex);
+
+	// keep memory for the next buffer if allowed
+	if ((uint64_t)(m_spareSlots.Size() + 1) * m_segmentSize <= m_spareLimit)
+	{
+		m_spareSlots.Append(slot);
+		return;
+	}
+
+	// hand memory back to the system, the slot itself will be reused
+	ReleaseMemory(slot);
+	m_freeSlots.Append(slot);
+}
+
+void cSegmentPool::SetSpareLimit(uint64_t bytes)
+{
+	cMutexLock lock(&m_mutex);
+
+	m_spareLimit = bytes;
+	while ((uint64_t)m_spareSlots.Size() * m_segmentSize > m_spareLimit)
+	{
+		int slot = m_spareSlots[m_spareSlots.Size() - 1];
+		m_spareSlots.Remove(m_spareSlots.Size() - 1);
+		ReleaseMemory(slot);
+		m_freeSlots.Append(slot);
+	}
+}
+
+void cSegmentPool::ReleaseMemory(int slot)
+{
+	if (m_memoryFile >= 0)
+	{
+		if (fallocate(m_memoryFile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Offset(slot), m_segmentSize) != 0)
+		{
+			dsyslog("permashift: SegmentPool, could not release segment memory (%d)\n", errno);
+		}
+	}
+	else
+	{
+		free(m_heapSegments[slot]);
+		m_heapSegments[slot] = NULL;
+	}
+}
+
+uchar* cSegmentPool::Memory(int slot)
+{
+	cMutexLock lock(&m_mutex);
+	return m_heapSegments[slot];
+}
+
+uint64_t cSegmentPool::BytesInUse()
+{
+	cMutexLock lock(&m_mutex);
+	return (uint64_t)(m_slotCount - m_freeSlots.Size() - m_spareSlots.Size()) * m_segmentSize;
+}
+
+uint64_t cSegmentPool::BytesSpare()
+{
+	cMutexLock lock(&m_mutex);
+	return (uint64_t)m_spareSlots.Size() * m_segmentSize;
+}
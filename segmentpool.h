@@ -0,0 +1,96 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef SEGMENTPOOL_H_
+#define SEGMENTPOOL_H_
+
+#include <vdr/tools.h>
+#include <vdr/thread.h>
+
+/// default size of a buffer segment
+#define BUFFER_SEGMENT_SIZE (2 * 1024 * 1024)
+
+/// pool of fixed-size memory segments ring buffers are built from
+///
+/// Segments are identified by slot numbers. If possible, all segments live in
+/// one memory file (at offset slot * segment size), so they can be mapped
+/// anywhere, otherwise each segment is a block of heap memory.
+/// Up to a limit, memory of segments given back is kept for reuse by the next
+/// buffer, so it doesn't have to be allocated and faulted in again.
+class cSegmentPool
+{
+private:
+
+	/// syncs pool access of several buffers
+	cMutex m_mutex;
+
+	/// size of each segment
+	uint64_t m_segmentSize;
+
+	/// memory file containing all segments, -1 if using heap memory
+	int m_memoryFile;
+
+	/// number of slots created so far
+	int m_slotCount;
+
+	/// slots not in use, without memory
+	cVector<int> m_freeSlots;
+
+	/// slots not in use whose memory is kept for reuse
+	cVector<int> m_spareSlots;
+
+	/// maximum bytes of spare segment memory
+	uint64_t m_spareLimit;
+
+	/// heap memory per slot (only used without memory file)
+	cVector<uchar*> m_heapSegments;
+
+public:
+
+	/// create an empty pool, using a memory file if wanted and possible
+	cSegmentPool(uint64_t segmentSize = BUFFER_SEGMENT_SIZE, bool useMemoryFile = true);
+
+	/// destroy pool and release all memory
+	virtual ~cSegmentPool();
+
+	/// size of each segment
+	uint64_t SegmentSize() { return m_segmentSize; }
+
+	/// memory file holding the segments, -1 if segments are heap memory
+	int MemoryFile() { return m_memoryFile; }
+
+	/// offset of a slot's segment in memory file
+	off_t Offset(int slot) { return (off_t)slot * m_segmentSize; }
+
+	/// heap memory of a slot's segment (only without memory file)
+	uchar* Memory(int slot);
+
+	/// hands out a segment, returns its slot or -1 if out of memory
+	/// reused is set if the segment's memory has been used before
+	int Get(bool* reused = NULL);
+
+	/// takes back a segment, its memory is kept as spare or returned to the system
+	void Put(int slot);
+
+	/// sets how much memory of segments given back is kept for reuse
+	void SetSpareLimit(uint64_t bytes);
+
+	/// bytes of segments currently handed out
+	uint64_t BytesInUse();
+
+	/// bytes of memory kept for reuse
+	uint64_t BytesSpare();
+
+private:
+
+	/// returns a slot's memory to the system
+	void ReleaseMemory(int slot);
+
+};
+
+#endif /* SEGMENTPOOL_H_ */
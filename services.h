@@ -0,0 +1,81 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef SERVICES_H_
+#define SERVICES_H_
+
+#include <stdint.h>
+
+/// data for services "Permashift-TimeToOffset-v1" and "Permashift-OffsetToTime-v1"
+///
+/// TimeToOffset finds the frame being secondsBack seconds before the newest
+/// frame in buffer, OffsetToTime finds the frame containing the given offset.
+/// Both fill in the remaining fields, frame is -1 if no frame has been found
+/// (e.g. when the buffer is empty or has already been used for a recording).
+struct Permashift_BufferPosition_v1
+{
+	double secondsBack;		///< seconds before the newest frame in buffer
+	uint64_t offset;		///< buffer offset, counting all bytes written since channel switch
+	int frame;				///< out: frame number in buffer, 0 being the oldest frame
+};
+
+/// data for service "Permashift-PlayBuffer-v1"
+///
+/// Launches a player replaying the buffer straight from memory,
+/// started is false if there's no buffer to replay.
+struct Permashift_PlayBuffer_v1
+{
+	bool rewind;			///< start rewinding instead of pausing
+	bool started;			///< out: replay has been started
+};
+
+/// data for service "Permashift-GetStats-v1"
+///
+/// Fills in statistics of the buffer of the channel watched live, for monitoring.
+/// Buffer figures are 0 once the buffer has been promoted to a recording,
+/// save figures are 0 until then.
+struct Permashift_Stats_v1
+{
+	bool buffering;				///< out: there's a buffer of the channel watched, the rest is valid
+	int channelNumber;			///< out: channel buffered
+	uint64_t bytesWritten;		///< out: bytes written to buffer since channel switch
+	uint64_t bytesDropped;		///< out: bytes overwritten by newer data
+	uint64_t bytesAvailable;	///< out: bytes in buffer
+	uint64_t bytesInMemory;		///< out: buffer memory in use (less than bytesAvailable when buffering on disc)
+	int frames;					///< out: frames in index
+	int iFrames;				///< out: I frames in index
+	double bitrate;				///< out: bits per second of video in buffer
+	double fillSecs;			///< out: seconds of video in buffer
+	double receiveCallsPerSec;	///< out: calls of receiver per second, since buffering started
+	int analysisLag;			///< out: bytes received but not analyzed yet
+	int maxAnalysisLag;			///< out: largest analysis lag seen
+	uint64_t lockWaitUs;		///< out: total time analysis waited for the buffer lock (microseconds)
+	int switchMs;				///< out: time taken to switch to disk recording (ms), -1 if not switched
+	uint64_t bytesToSave;		///< out: bytes of buffer to be saved to recording
+	uint64_t bytesSaved;		///< out: bytes of buffer saved to recording
+	double saveMBPerSec;		///< out: save throughput (MB/s)
+	int keptBuffers;			///< out: buffers kept for other channels
+	uint64_t poolBytes;			///< out: memory taken from segment pool by all buffers
+};
+
+/// data for service "Permashift-ExportClip-v1"
+///
+/// Exports part of the buffer of the channel watched as a recording of its own,
+/// in the background while buffering goes on, leaving the buffer as it is.
+/// The clip starts at the I frame at or before secondsBack seconds before the newest
+/// frame and lasts the given seconds (0 for up to the newest frame). started is false
+/// if there's no such part in buffer or the last export is still running.
+struct Permashift_ExportClip_v1
+{
+	double secondsBack;		///< start of clip, seconds before the newest frame in buffer
+	double seconds;			///< length of clip, 0 for up to the newest frame
+	const char* title;		///< name of recording, NULL for the channel's name
+	bool started;			///< out: export has been started
+};
+
+#endif /* SERVICES_H_ */
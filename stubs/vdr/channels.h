@@ -0,0 +1,71 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's channels.h (see tools.h).
+// A channel only has a number and its PIDs, which are set directly.
+
+#ifndef STUBS_VDR_CHANNELS_H_
+#define STUBS_VDR_CHANNELS_H_
+
+#include "tools.h"
+
+#define MAXAPIDS 32
+#define MAXDPIDS 16
+
+struct tChannelID
+{
+private:
+	int number;
+public:
+	tChannelID(int Number = 0) : number(Number) {}
+	cString ToString(void) const { return cString::sprintf("R-0-0-%d", number); }
+};
+
+class cChannel
+{
+private:
+	int number;
+	int vpid;
+	int vtype;
+	int apids[MAXAPIDS + 1];
+	int atypes[MAXAPIDS + 1];
+	int dpids[MAXDPIDS + 1];
+public:
+	cChannel(void) : number(0), vpid(0), vtype(0)
+	{
+		apids[0] = dpids[0] = 0;
+	}
+	int Number(void) const { return number; }
+	int Vpid(void) const { return vpid; }
+	int Vtype(void) const { return vtype; }
+	int Apid(int i) const { return (0 <= i && i < MAXAPIDS) ? apids[i] : 0; }
+	int Atype(int i) const { return (0 <= i && i < MAXAPIDS) ? atypes[i] : 0; }
+	int Dpid(int i) const { return (0 <= i && i < MAXDPIDS) ? dpids[i] : 0; }
+	tChannelID GetChannelID(void) const { return tChannelID(number); }
+	void SetNumber(int Number) { number = Number; }
+	/// simpler than VDR's, the PID lists end with 0
+	void SetPids(int Vpid, int Vtype, const int *Apids, const int *Atypes, const int *Dpids)
+	{
+		vpid = Vpid;
+		vtype = Vtype;
+		int i = 0;
+		for (; i < MAXAPIDS && Apids[i]; i++)
+		{
+			apids[i] = Apids[i];
+			atypes[i] = Atypes[i];
+		}
+		apids[i] = 0;
+		for (i = 0; i < MAXDPIDS && Dpids[i]; i++)
+		{
+			dpids[i] = Dpids[i];
+		}
+		dpids[i] = 0;
+	}
+};
+
+#endif /* STUBS_VDR_CHANNELS_H_ */
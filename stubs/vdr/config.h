@@ -0,0 +1,22 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's config.h (see tools.h), the buffer classes only need the version.
+
+#ifndef STUBS_VDR_CONFIG_H_
+#define STUBS_VDR_CONFIG_H_
+
+#include "tools.h"
+
+#define VDRVERSION  "2.6.1"
+#define VDRVERSNUM   20601
+
+#define APIVERSION  "2.6.1"
+#define APIVERSNUM   20601
+
+#endif /* STUBS_VDR_CONFIG_H_ */
@@ -0,0 +1,104 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's device.h (see tools.h).
+// There's no hardware, whoever has the data hands it to the device by calling Distribute(),
+// which passes it on to the receivers like VDR's receiving thread does.
+
+#ifndef STUBS_VDR_DEVICE_H_
+#define STUBS_VDR_DEVICE_H_
+
+#include "receiver.h"
+#include "remux.h"
+
+#define MAXRECEIVERS 16
+
+class cDevice
+{
+private:
+	cMutex mutexReceiver;
+	cReceiver *receiver[MAXRECEIVERS];
+public:
+	cDevice(void) { memset(receiver, 0, sizeof(receiver)); }
+	virtual ~cDevice() { DetachAllReceivers(); }
+	bool AttachReceiver(cReceiver *Receiver)
+	{
+		if (!Receiver)
+		{
+			return false;
+		}
+		if (Receiver->device == this)
+		{
+			return true;
+		}
+		cMutexLock MutexLock(&mutexReceiver);
+		for (int i = 0; i < MAXRECEIVERS; i++)
+		{
+			if (!receiver[i])
+			{
+				Receiver->device = this;
+				receiver[i] = Receiver;
+				Receiver->Activate(true);
+				return true;
+			}
+		}
+		esyslog("ERROR: no free receiver slot!");
+		return false;
+	}
+	void Detach(cReceiver *Receiver, bool ReleaseCam = true)
+	{
+		if (!Receiver || Receiver->device != this)
+		{
+			return;
+		}
+		cMutexLock MutexLock(&mutexReceiver);
+		for (int i = 0; i < MAXRECEIVERS; i++)
+		{
+			if (receiver[i] == Receiver)
+			{
+				receiver[i] = NULL;
+				Receiver->device = NULL;
+				Receiver->Activate(false);
+			}
+		}
+	}
+	void DetachAllReceivers(void)
+	{
+		cMutexLock MutexLock(&mutexReceiver);
+		for (int i = 0; i < MAXRECEIVERS; i++)
+		{
+			Detach(receiver[i]);
+		}
+	}
+	/// passes each TS packet to the receivers wanting its PID
+	void Distribute(const uchar *Data, int Length)
+	{
+		cMutexLock MutexLock(&mutexReceiver);
+		for (; Length >= TS_SIZE; Data += TS_SIZE, Length -= TS_SIZE)
+		{
+			int Pid = TsPid(Data);
+			for (int i = 0; i < MAXRECEIVERS; i++)
+			{
+				if (receiver[i] && receiver[i]->WantsPid(Pid))
+				{
+					receiver[i]->Receive(Data, TS_SIZE);
+				}
+			}
+		}
+	}
+};
+
+inline void cReceiver::Detach(void)
+{
+	if (device)
+	{
+		device->Detach(this);
+	}
+}
+
+#endif /* STUBS_VDR_DEVICE_H_ */
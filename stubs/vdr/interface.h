@@ -0,0 +1,16 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's interface.h (see tools.h), nothing of it is needed without VDR.
+
+#ifndef STUBS_VDR_INTERFACE_H_
+#define STUBS_VDR_INTERFACE_H_
+
+#include "tools.h"
+
+#endif /* STUBS_VDR_INTERFACE_H_ */
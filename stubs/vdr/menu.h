@@ -0,0 +1,25 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's menu.h (see tools.h), only for declaring permashift's setup page.
+
+#ifndef STUBS_VDR_MENU_H_
+#define STUBS_VDR_MENU_H_
+
+#include "tools.h"
+
+class cMenuSetupPage
+{
+protected:
+	virtual void Store(void) = 0;
+public:
+	cMenuSetupPage(void) {}
+	virtual ~cMenuSetupPage() {}
+};
+
+#endif /* STUBS_VDR_MENU_H_ */
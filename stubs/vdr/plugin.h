@@ -0,0 +1,37 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's plugin.h (see tools.h), only for declaring permashift's plugin class.
+
+#ifndef STUBS_VDR_PLUGIN_H_
+#define STUBS_VDR_PLUGIN_H_
+
+#include "config.h"
+
+class cMenuSetupPage;
+
+class cPlugin
+{
+public:
+	cPlugin(void) {}
+	virtual ~cPlugin() {}
+	virtual const char *Version(void) = 0;
+	virtual const char *Description(void) = 0;
+	virtual const char *CommandLineHelp(void) { return NULL; }
+	virtual bool ProcessArgs(int argc, char *argv[]) { return true; }
+	virtual bool Start(void) { return true; }
+	virtual void Stop(void) {}
+	virtual void MainThreadHook(void) {}
+	virtual cMenuSetupPage *SetupMenu(void) { return NULL; }
+	virtual bool SetupParse(const char *Name, const char *Value) { return false; }
+	virtual bool Service(const char *Id, void *Data = NULL) { return false; }
+	virtual const char **SVDRPHelpPages(void) { return NULL; }
+	virtual cString SVDRPCommand(const char *Command, const char *Option, int &ReplyCode) { return NULL; }
+};
+
+#endif /* STUBS_VDR_PLUGIN_H_ */
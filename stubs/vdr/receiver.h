@@ -0,0 +1,91 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's receiver.h (see tools.h), including permashift's VDR patch.
+
+#ifndef STUBS_VDR_RECEIVER_H_
+#define STUBS_VDR_RECEIVER_H_
+
+#include "config.h"
+#include "channels.h"
+
+#define MAXRECEIVEPIDS 64
+#define MINPRIORITY (-99)
+
+class cDevice;
+
+class cReceiver
+{
+	friend class cDevice;
+private:
+	cDevice *device;
+	int priority;
+	int pids[MAXRECEIVEPIDS];
+	int numPids;
+	bool WantsPid(int Pid)
+	{
+		for (int i = 0; i < numPids; i++)
+		{
+			if (pids[i] == Pid)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+protected:
+	virtual void Activate(bool On) {}
+	virtual void Receive(const uchar *Data, int Length) = 0;
+public:
+	cReceiver(const cChannel *Channel = NULL, int Priority = MINPRIORITY) : device(NULL), priority(Priority), numPids(0)
+	{
+		SetPids(Channel);
+	}
+	virtual ~cReceiver() {}
+	bool AddPid(int Pid)
+	{
+		if (Pid && !WantsPid(Pid))
+		{
+			if (numPids >= MAXRECEIVEPIDS)
+			{
+				return false;
+			}
+			pids[numPids++] = Pid;
+		}
+		return true;
+	}
+	bool SetPids(const cChannel *Channel)
+	{
+		numPids = 0;
+		if (Channel == NULL)
+		{
+			return true;
+		}
+		bool ok = AddPid(Channel->Vpid());
+		for (int i = 0; Channel->Apid(i); i++)
+		{
+			ok &= AddPid(Channel->Apid(i));
+		}
+		for (int i = 0; Channel->Dpid(i); i++)
+		{
+			ok &= AddPid(Channel->Dpid(i));
+		}
+		return ok;
+	}
+	int Priority(void) { return priority; }
+	void SetPriority(int Priority) { priority = Priority; }
+	bool IsAttached(void) { return device != NULL; }
+	void Detach(void);
+	virtual bool IsPreRecording(const cChannel *Channel) { return false; }
+	virtual bool ActivatePreRecording(const char* fileName, int Priority) { return false; }
+};
+
+// defines Detach()
+#include "device.h"
+
+#endif /* STUBS_VDR_RECEIVER_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's recorder.h (see tools.h), as changed by permashift's VDR patch.
+// Recording itself is left to derived classes, there's no checking of stream errors
+// and no check of disc space.
+
+#ifndef STUBS_VDR_RECORDER_H_
+#define STUBS_VDR_RECORDER_H_
+
+#include "receiver.h"
+#include "recording.h"
+#include "remux.h"
+#include "ringbuffer.h"
+#include "thread.h"
+
+#define RECORDERBUFSIZE  (MEGABYTE(20))
+
+// Setup.MaxVideoFileSize of VDR's default setup (MB)
+#define MAXVIDEOFILESIZEDEFAULT 2000
+
+class cRecorder : public cReceiver, protected cThread
+{
+protected:
+	cRingBufferLinear *ringBuffer;
+	cFrameDetector *frameDetector;
+	cPatPmtGenerator patPmtGenerator;
+	cFileName *fileName;
+	cIndexFile *index;
+	cUnbufferedFile *recordFile;
+	char *recordingName;
+	off_t fileSize;
+	bool NextFile(void)
+	{
+		if (recordFile && frameDetector->IndependentFrame())
+		{
+			// every file shall start with an independent frame
+			if (fileSize > MEGABYTE(off_t(MAXVIDEOFILESIZEDEFAULT)))
+			{
+				recordFile = fileName->NextFile();
+				fileSize = 0;
+			}
+		}
+		return recordFile != NULL;
+	}
+	virtual void Activate(bool On)
+	{
+		if (On)
+		{
+			Start();
+		}
+		else
+		{
+			Cancel(3);
+		}
+	}
+	virtual void Receive(const uchar *Data, int Length)
+	{
+		if (Running())
+		{
+			int p = ringBuffer->Put(Data, Length);
+			if (p != Length && Running())
+			{
+				ringBuffer->ReportOverflow(Length - p);
+			}
+		}
+	}
+	virtual void Action(void) {}
+	void InitializeFile(const char *FileName, const cChannel *Channel)
+	{
+		recordingName = strdup(FileName);
+		ringBuffer = new cRingBufferLinear(RECORDERBUFSIZE, MIN_TS_PACKETS_FOR_FRAME_DETECTOR * TS_SIZE, true, "Recorder");
+		ringBuffer->SetTimeouts(0, 100);
+		ringBuffer->SetIoThrottle();
+		if (frameDetector == NULL)
+		{
+			frameDetector = new cFrameDetector(Channel->Vpid(), Channel->Vtype());
+		}
+		index = NULL;
+		fileSize = 0;
+		fileName = new cFileName(FileName, true);
+		patPmtGenerator.SetChannel(Channel);
+		recordFile = fileName->Open();
+		if (!recordFile)
+		{
+			return;
+		}
+		index = new cIndexFile(FileName, true);
+	}
+public:
+	cRecorder(const char *FileName, const cChannel *Channel, int Priority) : cReceiver(Channel, Priority), cThread("recording"),
+		ringBuffer(NULL), frameDetector(NULL), fileName(NULL), index(NULL), recordFile(NULL), recordingName(NULL), fileSize(0)
+	{
+		if (FileName != NULL)
+		{
+			InitializeFile(FileName, Channel);
+		}
+	}
+	virtual ~cRecorder()
+	{
+		Detach();
+		delete index;
+		delete fileName;
+		delete frameDetector;
+		delete ringBuffer;
+		free(recordingName);
+	}
+};
+
+#endif /* STUBS_VDR_RECORDER_H_ */
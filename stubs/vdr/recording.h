@@ -0,0 +1,191 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's recording.h (see tools.h).
+// Files are written in VDR's formats, the info file only holds the frame rate.
+
+#ifndef STUBS_VDR_RECORDING_H_
+#define STUBS_VDR_RECORDING_H_
+
+#include "config.h"
+#include "remux.h"
+
+#define RECORDFILESUFFIXTS  "/%05d.ts"
+#define RECORDFILESUFFIXLEN 20
+#define INDEXFILESUFFIX     "/index"
+#define INFOFILESUFFIX      "/info"
+
+#define MAXFILESPERRECORDINGTS 65535
+
+class cRecordingInfo
+{
+private:
+	cString fileName;
+	double framesPerSecond;
+public:
+	cRecordingInfo(const char *FileName) : framesPerSecond(DEFAULTFRAMESPERSECOND)
+	{
+		fileName = cString::sprintf("%s%s", FileName, INFOFILESUFFIX);
+	}
+	double FramesPerSecond(void) const { return framesPerSecond; }
+	void SetFramesPerSecond(double FramesPerSecond) { framesPerSecond = FramesPerSecond; }
+	bool Read(void)
+	{
+		FILE *f = fopen(fileName, "r");
+		if (!f)
+		{
+			return false;
+		}
+		char line[256];
+		while (fgets(line, sizeof(line), f))
+		{
+			if (line[0] == 'F' && line[1] == ' ')
+			{
+				framesPerSecond = atof(line + 2);
+			}
+		}
+		fclose(f);
+		return true;
+	}
+	bool Write(void) const
+	{
+		FILE *f = fopen(fileName, "w");
+		if (!f)
+		{
+			LOG_ERROR_STR(*fileName);
+			return false;
+		}
+		fprintf(f, "F %.10g\n", framesPerSecond);
+		fclose(f);
+		return true;
+	}
+};
+
+class cRecordings
+{
+public:
+	void UpdateByName(const char *FileName) {}
+	static cRecordings *GetRecordingsWrite(void)
+	{
+		static cRecordings recordings;
+		return &recordings;
+	}
+};
+
+#define LOCK_RECORDINGS_WRITE cRecordings *Recordings = cRecordings::GetRecordingsWrite()
+
+class cFileName
+{
+private:
+	cUnbufferedFile *file;
+	uint16_t fileNumber;
+	char *fileName;
+	char *pFileNumber;
+	bool record;
+public:
+	cFileName(const char *FileName, bool Record, bool Blocking = false, bool IsPesRecording = false) :
+		file(NULL), fileNumber(0), record(Record)
+	{
+		fileName = MALLOC(char, strlen(FileName) + RECORDFILESUFFIXLEN);
+		strcpy(fileName, FileName);
+		pFileNumber = fileName + strlen(fileName);
+		SetOffset(1);
+	}
+	~cFileName()
+	{
+		Close();
+		free(fileName);
+	}
+	const char *Name(void) { return fileName; }
+	uint16_t Number(void) { return fileNumber; }
+	cUnbufferedFile *Open(void)
+	{
+		if (!file)
+		{
+			file = cUnbufferedFile::Create(fileName, record ? O_RDWR | O_CREAT : O_RDONLY);
+			if (!file)
+			{
+				LOG_ERROR_STR(fileName);
+			}
+		}
+		return file;
+	}
+	void Close(void)
+	{
+		delete file;
+		file = NULL;
+	}
+	cUnbufferedFile *SetOffset(int Number, off_t Offset = 0)
+	{
+		if (fileNumber != Number)
+		{
+			Close();
+		}
+		if (0 < Number && Number <= MAXFILESPERRECORDINGTS)
+		{
+			fileNumber = uint16_t(Number);
+			sprintf(pFileNumber, RECORDFILESUFFIXTS, fileNumber);
+			if (record)
+			{
+				// files already there are skipped, empty ones removed
+				struct stat buf;
+				if (stat(fileName, &buf) == 0)
+				{
+					if (buf.st_size != 0)
+					{
+						return SetOffset(Number + 1);
+					}
+					unlink(fileName);
+				}
+			}
+			return Open();
+		}
+		esyslog("ERROR: max number of files (%d) exceeded", MAXFILESPERRECORDINGTS);
+		return NULL;
+	}
+	cUnbufferedFile *NextFile(void) { return SetOffset(fileNumber + 1); }
+};
+
+class cIndexFile
+{
+private:
+	int f;
+public:
+	cIndexFile(const char *FileName, bool Record, bool IsPesRecording = false, bool PauseLive = false, bool Update = false)
+	{
+		cString fileName = cString::sprintf("%s%s", FileName, INDEXFILESUFFIX);
+		f = open(fileName, Record ? O_WRONLY | O_CREAT | O_APPEND : O_RDONLY, DEFFILEMODE);
+		if (f < 0)
+		{
+			LOG_ERROR_STR(*fileName);
+		}
+	}
+	~cIndexFile()
+	{
+		if (f >= 0)
+		{
+			close(f);
+		}
+	}
+	bool Ok(void) { return f >= 0; }
+	bool Write(bool Independent, uint16_t FileNumber, off_t FileOffset)
+	{
+		// VDR's tIndexTs, as it's laid out by the compiler
+		uint64_t record = ((uint64_t)FileOffset & 0xFFFFFFFFFFull) | ((uint64_t)Independent << 47) | ((uint64_t)FileNumber << 48);
+		if (f >= 0 && safe_write(f, &record, sizeof(record)) < 0)
+		{
+			LOG_ERROR;
+			close(f);
+			f = -1;
+			return false;
+		}
+		return f >= 0;
+	}
+};
+
+#endif /* STUBS_VDR_RECORDING_H_ */
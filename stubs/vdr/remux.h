@@ -0,0 +1,341 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's remux.h (see tools.h).
+//
+// The TS and PES helpers are VDR's. The PAT/PMT generator only describes video,
+// audio and Dolby streams. The frame detector is much simpler than VDR's: a frame
+// starts with each video packet starting a payload unit, its type is taken from
+// that packet alone (MPEG-2 picture coding type, H.264 IDR or access unit delimiter,
+// H.265 IRAP or access unit delimiter), and it's synced at the first I frame.
+// Calls of Analyze() cut the data just like VDR's do.
+
+#ifndef STUBS_VDR_REMUX_H_
+#define STUBS_VDR_REMUX_H_
+
+#include "channels.h"
+
+#define TS_SIZE               188
+#define TS_SYNC_BYTE          0x47
+#define TS_ERROR              0x80
+#define TS_PAYLOAD_START      0x40
+#define TS_PID_MASK_HI        0x1F
+#define TS_SCRAMBLING_CONTROL 0xC0
+#define TS_ADAPT_FIELD_EXISTS 0x20
+#define TS_PAYLOAD_EXISTS     0x10
+#define TS_CONT_CNT_MASK      0x0F
+
+#define PATPID 0x0000
+
+#define MIN_TS_PACKETS_FOR_FRAME_DETECTOR 100
+
+#define DEFAULTFRAMESPERSECOND 25.0
+
+inline bool TsHasPayload(const uchar *p) { return p[3] & TS_PAYLOAD_EXISTS; }
+inline bool TsHasAdaptationField(const uchar *p) { return p[3] & TS_ADAPT_FIELD_EXISTS; }
+inline bool TsPayloadStart(const uchar *p) { return p[1] & TS_PAYLOAD_START; }
+inline bool TsError(const uchar *p) { return p[1] & TS_ERROR; }
+inline int TsPid(const uchar *p) { return (p[1] & TS_PID_MASK_HI) * 256 + p[2]; }
+inline bool TsIsScrambled(const uchar *p) { return p[3] & TS_SCRAMBLING_CONTROL; }
+inline int TsPayloadOffset(const uchar *p)
+{
+	int o = TsHasAdaptationField(p) ? p[4] + 5 : 4;
+	return o <= TS_SIZE ? o : TS_SIZE;
+}
+inline int TsGetPayload(const uchar **p)
+{
+	if (TsHasPayload(*p))
+	{
+		int o = TsPayloadOffset(*p);
+		*p += o;
+		return TS_SIZE - o;
+	}
+	return 0;
+}
+
+inline bool PesHasPts(const uchar *p) { return (p[7] & 0x80) && p[8] >= 5; }
+inline bool PesHasDts(const uchar *p) { return (p[7] & 0x40) && p[8] >= 10; }
+inline int64_t PesGetPts(const uchar *p)
+{
+	return ((((int64_t)p[9]) & 0x0E) << 29) | (((int64_t)p[10]) << 22) | ((((int64_t)p[11]) & 0xFE) << 14) |
+		(((int64_t)p[12]) << 7) | ((((int64_t)p[13]) & 0xFE) >> 1);
+}
+inline int64_t PesGetDts(const uchar *p)
+{
+	return ((((int64_t)p[14]) & 0x0E) << 29) | (((int64_t)p[15]) << 22) | ((((int64_t)p[16]) & 0xFE) << 14) |
+		(((int64_t)p[17]) << 7) | ((((int64_t)p[18]) & 0xFE) >> 1);
+}
+
+#define MAX33BIT 0x00000001FFFFFFFFLL
+
+inline int64_t PtsDiff(int64_t Pts1, int64_t Pts2)
+{
+	int64_t d = Pts2 - Pts1;
+	if (d > MAX33BIT / 2)
+	{
+		return d - (MAX33BIT + 1);
+	}
+	if (d < -(MAX33BIT / 2))
+	{
+		return d + (MAX33BIT + 1);
+	}
+	return d;
+}
+
+class cPatPmtGenerator
+{
+private:
+	uchar pat[TS_SIZE];
+	uchar pmt[TS_SIZE];
+	int patCounter;
+	int pmtCounter;
+	int pmtPid;
+	static uint32_t Crc32(const uchar *Data, int Length)
+	{
+		uint32_t crc = 0xFFFFFFFF;
+		for (int i = 0; i < Length; i++)
+		{
+			crc ^= (uint32_t)Data[i] << 24;
+			for (int bit = 0; bit < 8; bit++)
+			{
+				crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+			}
+		}
+		return crc;
+	}
+	/// finishes section starting at Section, whose data ends at End
+	static void EndSection(uchar *Section, uchar *End)
+	{
+		int length = End - Section - 3 + 4;
+		Section[1] = 0xB0 | (length >> 8);
+		Section[2] = length & 0xFF;
+		uint32_t crc = Crc32(Section, End - Section);
+		End[0] = crc >> 24;
+		End[1] = crc >> 16;
+		End[2] = crc >> 8;
+		End[3] = crc;
+	}
+	static uchar *AddStream(uchar *p, int Type, int Pid)
+	{
+		*p++ = Type;
+		*p++ = 0xE0 | (Pid >> 8);
+		*p++ = Pid & 0xFF;
+		*p++ = 0xF0;
+		*p++ = 0x00;
+		return p;
+	}
+	void IncCounter(int &Counter, uchar *TsPacket)
+	{
+		TsPacket[3] = (TsPacket[3] & ~TS_CONT_CNT_MASK) | Counter;
+		Counter = (Counter + 1) & TS_CONT_CNT_MASK;
+	}
+public:
+	cPatPmtGenerator(const cChannel *Channel = NULL) : patCounter(0), pmtCounter(0), pmtPid(0x0084)
+	{
+		memset(pat, 0xFF, sizeof(pat));
+		memset(pmt, 0xFF, sizeof(pmt));
+		if (Channel)
+		{
+			SetChannel(Channel);
+		}
+	}
+	void SetChannel(const cChannel *Channel)
+	{
+		uchar header[5] = { TS_SYNC_BYTE, TS_PAYLOAD_START, 0x00, TS_PAYLOAD_EXISTS, 0x00 };
+
+		// PAT with the one program
+		memcpy(pat, header, sizeof(header));
+		uchar *p = pat + sizeof(header);
+		uchar *section = p;
+		uchar patSection[] = { 0x00, 0x00, 0x00, 0x00, 0x01, 0xC1, 0x00, 0x00, 0x00, 0x01,
+			(uchar)(0xE0 | (pmtPid >> 8)), (uchar)(pmtPid & 0xFF) };
+		memcpy(p, patSection, sizeof(patSection));
+		EndSection(section, p + sizeof(patSection));
+
+		// PMT of its streams
+		memcpy(pmt, header, sizeof(header));
+		pmt[1] |= pmtPid >> 8;
+		pmt[2] = pmtPid & 0xFF;
+		p = section = pmt + sizeof(header);
+		int pcrPid = Channel->Vpid() ? Channel->Vpid() : 0x1FFF;
+		uchar pmtSection[] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0xC1, 0x00, 0x00,
+			(uchar)(0xE0 | (pcrPid >> 8)), (uchar)(pcrPid & 0xFF), 0xF0, 0x00 };
+		memcpy(p, pmtSection, sizeof(pmtSection));
+		p += sizeof(pmtSection);
+		if (Channel->Vpid())
+		{
+			p = AddStream(p, Channel->Vtype(), Channel->Vpid());
+		}
+		for (int i = 0; Channel->Apid(i) && p < pmt + TS_SIZE - 12; i++)
+		{
+			p = AddStream(p, Channel->Atype(i), Channel->Apid(i));
+		}
+		for (int i = 0; Channel->Dpid(i) && p < pmt + TS_SIZE - 12; i++)
+		{
+			p = AddStream(p, 0x06, Channel->Dpid(i));
+			// AC-3 descriptor
+			p[-1] = 0x03;
+			*p++ = 0x6A;
+			*p++ = 0x01;
+			*p++ = 0x00;
+		}
+		EndSection(section, p);
+	}
+	uchar *GetPat(void)
+	{
+		IncCounter(patCounter, pat);
+		return pat;
+	}
+	uchar *GetPmt(int &Index)
+	{
+		if (Index++ == 0)
+		{
+			IncCounter(pmtCounter, pmt);
+			return pmt;
+		}
+		return NULL;
+	}
+};
+
+class cFrameDetector
+{
+private:
+	int pid;
+	int type;
+	bool synced;
+	bool newFrame;
+	bool independentFrame;
+	int64_t lastDts;
+	double framesPerSecond;
+	/// does the video packet starting a payload unit start an I frame?
+	bool Independent(const uchar *Data)
+	{
+		const uchar *p = Data;
+		int length = TsGetPayload(&p);
+		if (length < 9 || p[0] != 0x00 || p[1] != 0x00 || p[2] != 0x01)
+		{
+			return false;
+		}
+		int headerLength = 9 + p[8];
+		for (int i = headerLength; i + 5 < length; i++)
+		{
+			if (p[i] != 0x00 || p[i + 1] != 0x00 || p[i + 2] != 0x01)
+			{
+				continue;
+			}
+			uchar code = p[i + 3];
+			switch (type)
+			{
+			case 0x01:
+			case 0x02:
+				// picture start code
+				if (code == 0x00)
+				{
+					return ((p[i + 5] >> 3) & 0x07) == 1;
+				}
+				break;
+			case 0x1B:
+				// IDR slice, or access unit delimiter of I slices only
+				if ((code & 0x1F) == 5) return true;
+				if ((code & 0x1F) == 9) return (p[i + 4] >> 5) == 0;
+				if ((code & 0x1F) == 1) return false;
+				break;
+			case 0x24:
+				// IRAP picture, or access unit delimiter of I slices only
+				if (((code >> 1) & 0x3F) >= 16 && ((code >> 1) & 0x3F) <= 21) return true;
+				if (((code >> 1) & 0x3F) == 35) return (p[i + 5] >> 5) == 0;
+				if (((code >> 1) & 0x3F) <= 9) return false;
+				break;
+			default:
+				return true;
+			}
+		}
+		return false;
+	}
+	/// takes frame rate from the first step between decoding time stamps
+	void TakeFrameRate(const uchar *Data)
+	{
+		const uchar *p = Data;
+		int length = TsGetPayload(&p);
+		if (framesPerSecond > 0 || length < 14 || !PesHasPts(p))
+		{
+			return;
+		}
+		int64_t dts = PesHasDts(p) && length >= 19 ? PesGetDts(p) : PesGetPts(p);
+		int64_t delta = lastDts >= 0 ? dts - lastDts : 0;
+		if (delta >= 900 && delta <= 9000)
+		{
+			framesPerSecond = 90000.0 / delta;
+		}
+		lastDts = dts;
+	}
+public:
+	cFrameDetector(int Pid = 0, int Type = 0) { SetPid(Pid, Type); }
+	void SetPid(int Pid, int Type)
+	{
+		pid = Pid;
+		type = Type;
+		synced = newFrame = independentFrame = false;
+		lastDts = -1;
+		framesPerSecond = 0;
+	}
+	int Analyze(const uchar *Data, int Length)
+	{
+		int Processed = 0;
+		newFrame = independentFrame = false;
+		while (Length >= MIN_TS_PACKETS_FOR_FRAME_DETECTOR * TS_SIZE)
+		{
+			// sync on TS packet borders
+			if (Data[0] != TS_SYNC_BYTE)
+			{
+				int Skipped = 1;
+				while (Skipped < Length && (Data[Skipped] != TS_SYNC_BYTE || (Length - Skipped > TS_SIZE && Data[Skipped + TS_SIZE] != TS_SYNC_BYTE)))
+				{
+					Skipped++;
+				}
+				return Processed + Skipped;
+			}
+			if (TsHasPayload(Data) && !TsIsScrambled(Data))
+			{
+				int Pid = TsPid(Data);
+				if (Pid == pid)
+				{
+					if (Processed)
+					{
+						return Processed;
+					}
+					if (TsPayloadStart(Data))
+					{
+						newFrame = true;
+						independentFrame = Independent(Data);
+						synced |= independentFrame;
+						TakeFrameRate(Data);
+					}
+				}
+				else if (Pid == PATPID && synced && Processed)
+				{
+					return Processed;
+				}
+			}
+			Data += TS_SIZE;
+			Length -= TS_SIZE;
+			Processed += TS_SIZE;
+			if (newFrame)
+			{
+				break;
+			}
+		}
+		return Processed;
+	}
+	bool Synced(void) { return synced; }
+	bool NewFrame(void) { return newFrame; }
+	bool IndependentFrame(void) { return independentFrame; }
+	double FramesPerSecond(void) { return framesPerSecond; }
+};
+
+#endif /* STUBS_VDR_REMUX_H_ */
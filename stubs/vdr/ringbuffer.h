@@ -0,0 +1,158 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's ringbuffer.h (see tools.h), including GetRest() of permashift's VDR patch.
+// Only one thread may put and one may get, as with VDR's.
+
+#ifndef STUBS_VDR_RINGBUFFER_H_
+#define STUBS_VDR_RINGBUFFER_H_
+
+#include "tools.h"
+#include <atomic>
+
+class cRingBufferLinear
+{
+private:
+	int size;
+	int margin;
+	std::atomic<int> head;
+	std::atomic<int> tail;
+	int gotten;
+	int getTimeout;
+	uchar *buffer;
+	cCondWait readyForGet;
+	int DataReady(const uchar *Data, int Count) { return Count >= margin ? Count : 0; }
+	void WaitForGet(void) { if (getTimeout) readyForGet.Wait(getTimeout); }
+public:
+	cRingBufferLinear(int Size, int Margin = 0, bool Statistics = false, const char *Description = NULL) :
+		size(Size), margin(Margin), head(Margin), tail(Margin), gotten(0), getTimeout(0)
+	{
+		buffer = MALLOC(uchar, Size);
+	}
+	~cRingBufferLinear() { free(buffer); }
+	void SetTimeouts(int PutTimeout, int GetTimeout) { getTimeout = GetTimeout; }
+	void SetIoThrottle(void) {}
+	int Size(void) { return size; }
+	int Available(void)
+	{
+		int diff = head - tail;
+		return (diff >= 0) ? diff : Size() + diff - margin;
+	}
+	int Free(void) { return Size() - Available() - 1 - margin; }
+	void ReportOverflow(int Bytes) { esyslog("ERROR: %d bytes lost in ring buffer", Bytes); }
+	int Put(const uchar *Data, int Count)
+	{
+		if (Count > 0)
+		{
+			int Tail = tail;
+			int Head = head;
+			int rest = Size() - Head;
+			int diff = Tail - Head;
+			int free = ((Tail < margin) ? rest : (diff > 0) ? diff : Size() + diff - margin) - 1;
+			if (free > 0)
+			{
+				if (free < Count)
+				{
+					Count = free;
+				}
+				if (Count >= rest)
+				{
+					memcpy(buffer + Head, Data, rest);
+					if (Count - rest)
+					{
+						memcpy(buffer + margin, Data + rest, Count - rest);
+					}
+					head = margin + Count - rest;
+				}
+				else
+				{
+					memcpy(buffer + Head, Data, Count);
+					head = Head + Count;
+				}
+			}
+			else
+			{
+				Count = 0;
+			}
+			if (getTimeout)
+			{
+				readyForGet.Signal();
+			}
+		}
+		return Count;
+	}
+	uchar *Get(int &Count)
+	{
+		int Head = head;
+		int Tail = tail;
+		int rest = Size() - Tail;
+		if (rest < margin && Head < Tail)
+		{
+			// move the rest in front of the start, so the data is contiguous
+			int t = margin - rest;
+			memcpy(buffer + t, buffer + Tail, rest);
+			tail = Tail = t;
+			rest = Head - Tail;
+		}
+		int diff = Head - Tail;
+		int cont = (diff >= 0) ? diff : Size() + diff - margin;
+		if (cont > rest)
+		{
+			cont = rest;
+		}
+		uchar *p = buffer + Tail;
+		if ((cont = DataReady(p, cont)) > 0)
+		{
+			Count = gotten = cont;
+			return p;
+		}
+		WaitForGet();
+		return NULL;
+	}
+	uchar *GetRest(int &Count)
+	{
+		int Head = head;
+		int Tail = tail;
+		int rest = Size() - Tail;
+		int diff = Head - Tail;
+		int cont = (diff >= 0) ? diff : Size() + diff - margin;
+		if (cont > rest)
+		{
+			cont = rest;
+		}
+		uchar *p = buffer + Tail;
+		if (cont > 0)
+		{
+			Count = gotten = cont;
+			return p;
+		}
+		WaitForGet();
+		return NULL;
+	}
+	void Del(int Count)
+	{
+		if (Count > gotten)
+		{
+			esyslog("ERROR: invalid Count in cRingBufferLinear::Del: %d (limited to %d)", Count, gotten);
+			Count = gotten;
+		}
+		if (Count > 0)
+		{
+			int Tail = tail;
+			Tail += Count;
+			gotten -= Count;
+			if (Tail >= Size())
+			{
+				Tail = margin;
+			}
+			tail = Tail;
+		}
+	}
+};
+
+#endif /* STUBS_VDR_RINGBUFFER_H_ */
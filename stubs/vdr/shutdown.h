@@ -0,0 +1,33 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's shutdown.h (see tools.h).
+// An emergency exit is only noted, it's up to the program to check for it.
+
+#ifndef STUBS_VDR_SHUTDOWN_H_
+#define STUBS_VDR_SHUTDOWN_H_
+
+#include "tools.h"
+
+class cShutdownHandler
+{
+private:
+	bool emergencyExitRequested;
+public:
+	cShutdownHandler(void) : emergencyExitRequested(false) {}
+	void RequestEmergencyExit(void)
+	{
+		esyslog("initiating emergency exit");
+		emergencyExitRequested = true;
+	}
+	bool EmergencyExitRequested(void) { return emergencyExitRequested; }
+};
+
+extern cShutdownHandler ShutdownHandler;
+
+#endif /* STUBS_VDR_SHUTDOWN_H_ */
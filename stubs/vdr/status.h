@@ -0,0 +1,27 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's status.h (see tools.h), only for declaring permashift's status monitor.
+
+#ifndef STUBS_VDR_STATUS_H_
+#define STUBS_VDR_STATUS_H_
+
+#include "tools.h"
+
+class cDevice;
+
+class cStatus
+{
+protected:
+	virtual void ChannelSwitch(const cDevice *Device, int ChannelNumber, bool LiveView) {}
+public:
+	cStatus(void) {}
+	virtual ~cStatus() {}
+};
+
+#endif /* STUBS_VDR_STATUS_H_ */
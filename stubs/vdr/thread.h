@@ -0,0 +1,177 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for VDR's thread.h, on plain POSIX threads (see tools.h).
+
+#ifndef STUBS_VDR_THREAD_H_
+#define STUBS_VDR_THREAD_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+class cCondVar;
+
+class cMutex
+{
+	friend class cCondVar;
+private:
+	pthread_mutex_t mutex;
+public:
+	cMutex(void)
+	{
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	~cMutex() { pthread_mutex_destroy(&mutex); }
+	void Lock(void) { pthread_mutex_lock(&mutex); }
+	void Unlock(void) { pthread_mutex_unlock(&mutex); }
+};
+
+class cMutexLock
+{
+private:
+	cMutex *mutex;
+public:
+	cMutexLock(cMutex *Mutex = NULL) : mutex(Mutex) { if (mutex) mutex->Lock(); }
+	~cMutexLock() { if (mutex) mutex->Unlock(); }
+	bool Lock(cMutex *Mutex) { if (mutex || !Mutex) return false; mutex = Mutex; mutex->Lock(); return true; }
+};
+
+class cCondVar
+{
+private:
+	pthread_cond_t cond;
+public:
+	cCondVar(void) { pthread_cond_init(&cond, NULL); }
+	~cCondVar() { pthread_cond_destroy(&cond); }
+	void Wait(cMutex &Mutex) { pthread_cond_wait(&cond, &Mutex.mutex); }
+	bool TimedWait(cMutex &Mutex, int TimeoutMs)
+	{
+		struct timespec abstime;
+		clock_gettime(CLOCK_REALTIME, &abstime);
+		abstime.tv_sec += TimeoutMs / 1000;
+		abstime.tv_nsec += (TimeoutMs % 1000) * 1000000L;
+		if (abstime.tv_nsec >= 1000000000L)
+		{
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000L;
+		}
+		return pthread_cond_timedwait(&cond, &Mutex.mutex, &abstime) == 0;
+	}
+	void Broadcast(void) { pthread_cond_broadcast(&cond); }
+};
+
+class cCondWait
+{
+private:
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool signaled;
+public:
+	cCondWait(void) : signaled(false)
+	{
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+	}
+	~cCondWait() { pthread_cond_destroy(&cond); pthread_mutex_destroy(&mutex); }
+	static void SleepMs(int TimeoutMs) { usleep(TimeoutMs * 1000); }
+	bool Wait(int TimeoutMs = 0)
+	{
+		pthread_mutex_lock(&mutex);
+		if (!signaled)
+		{
+			if (TimeoutMs > 0)
+			{
+				struct timespec abstime;
+				clock_gettime(CLOCK_REALTIME, &abstime);
+				abstime.tv_sec += TimeoutMs / 1000;
+				abstime.tv_nsec += (TimeoutMs % 1000) * 1000000L;
+				if (abstime.tv_nsec >= 1000000000L)
+				{
+					abstime.tv_sec++;
+					abstime.tv_nsec -= 1000000000L;
+				}
+				while (!signaled && pthread_cond_timedwait(&cond, &mutex, &abstime) == 0) ;
+			}
+			else
+			{
+				while (!signaled)
+				{
+					pthread_cond_wait(&cond, &mutex);
+				}
+			}
+		}
+		bool r = signaled;
+		signaled = false;
+		pthread_mutex_unlock(&mutex);
+		return r;
+	}
+	void Signal(void)
+	{
+		pthread_mutex_lock(&mutex);
+		signaled = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+};
+
+class cThread
+{
+private:
+	volatile bool running;
+	bool active;
+	pthread_t childTid;
+	static void *StartThread(void *Thread)
+	{
+		((cThread *)Thread)->Action();
+		((cThread *)Thread)->active = false;
+		return NULL;
+	}
+protected:
+	void SetPriority(int Priority) {}
+	void SetIOPriority(int Priority) {}
+	virtual void Action(void) = 0;
+	bool Running(void) { return running; }
+	void Cancel(int WaitSeconds = 0)
+	{
+		running = false;
+		if (WaitSeconds < 0)
+		{
+			// only tells the thread to stop
+			return;
+		}
+		if (childTid != 0 && !pthread_equal(childTid, pthread_self()))
+		{
+			pthread_join(childTid, NULL);
+			childTid = 0;
+		}
+		active = false;
+	}
+public:
+	cThread(const char *Description = NULL, bool LowPriority = false) : running(false), active(false), childTid(0) {}
+	virtual ~cThread() {}
+	void SetDescription(const char *Description, ...) {}
+	bool Start(void)
+	{
+		running = active = true;
+		if (pthread_create(&childTid, NULL, StartThread, this) != 0)
+		{
+			running = active = false;
+			childTid = 0;
+		}
+		return active;
+	}
+	bool Active(void) { return active; }
+};
+
+#endif /* STUBS_VDR_THREAD_H_ */
@@ -0,0 +1,268 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+// Stand-in for the parts of VDR's tools.h used by permashift's buffer classes,
+// so tests and benchmarks can be built without VDR (see "make bufferreceiver_test" and "make bench").
+// Behaves like VDR's version as far as the buffer classes rely on it.
+
+#ifndef STUBS_VDR_TOOLS_H_
+#define STUBS_VDR_TOOLS_H_
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef unsigned char uchar;
+
+// debug messages are dropped (but checked), errors go to stderr
+#define dsyslog(a...) do { if (0) fprintf(stderr, a); } while (0)
+#define isyslog(a...) do { if (0) fprintf(stderr, a); } while (0)
+#define esyslog(a...) do { fprintf(stderr, a); fputc('\n', stderr); } while (0)
+
+#define LOG_ERROR         esyslog("ERROR (%s,%d): %m", __FILE__, __LINE__)
+#define LOG_ERROR_STR(s)  esyslog("ERROR (%s,%d): %s: %m", __FILE__, __LINE__, s)
+
+#define MALLOC(type, size)  (type *)malloc(sizeof(type) * (size))
+
+#define DELETENULL(p) (delete (p), p = NULL)
+
+#define KILOBYTE(n) ((n) * 1024)
+#define MEGABYTE(n) ((n) * 1024LL * 1024LL)
+
+template<class T> inline T min(T a, T b) { return a <= b ? a : b; }
+template<class T> inline T max(T a, T b) { return a >= b ? a : b; }
+template<class T> inline T constrain(T v, T l, T h) { return v < l ? l : v > h ? h : v; }
+
+inline bool DoubleEqual(double a, double b) { return fabs(a - b) <= 1e-9; }
+
+inline char *strn0cpy(char *dest, const char *src, size_t n)
+{
+	char *s = dest;
+	for (; --n && (*dest = *src) != 0; dest++, src++) ;
+	*dest = 0;
+	return s;
+}
+
+inline bool endswith(const char *s, const char *p)
+{
+	size_t ls = strlen(s), lp = strlen(p);
+	return ls >= lp && strcmp(s + ls - lp, p) == 0;
+}
+
+class cString
+{
+private:
+	char *s;
+public:
+	cString(const char *S = NULL, bool TakePointer = false) : s(S ? (TakePointer ? (char *)S : strdup(S)) : NULL) {}
+	cString(const cString &String) : s(String.s ? strdup(String.s) : NULL) {}
+	~cString() { free(s); }
+	operator const void * () const { return s; }
+	operator const char * () const { return s; }
+	const char *operator*() const { return s; }
+	cString &operator=(const cString &String) { if (this != &String) { free(s); s = String.s ? strdup(String.s) : NULL; } return *this; }
+	cString &operator=(const char *String) { if (s != String) { free(s); s = String ? strdup(String) : NULL; } return *this; }
+	static cString sprintf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)))
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		char *buffer;
+		if (vasprintf(&buffer, fmt, ap) < 0)
+		{
+			buffer = NULL;
+		}
+		va_end(ap);
+		return cString(buffer, true);
+	}
+};
+
+inline ssize_t safe_write(int filedes, const void *buffer, size_t size)
+{
+	ssize_t p = 0;
+	ssize_t written = size;
+	const unsigned char *ptr = (const unsigned char *)buffer;
+	while (size > 0)
+	{
+		p = write(filedes, ptr, size);
+		if (p < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		ptr += p;
+		size -= p;
+	}
+	return written;
+}
+
+inline bool MakeDirs(const char *FileName, bool IsDirectory = false)
+{
+	char *s = strdup(FileName);
+	bool result = true;
+	for (char *p = s + 1; result && *p; p++)
+	{
+		if (*p == '/')
+		{
+			*p = 0;
+			result = mkdir(s, ACCESSPERMS) == 0 || errno == EEXIST;
+			*p = '/';
+		}
+	}
+	if (result && IsDirectory)
+	{
+		result = mkdir(s, ACCESSPERMS) == 0 || errno == EEXIST;
+	}
+	free(s);
+	return result;
+}
+
+inline cString AddDirectory(const char *DirName, const char *FileName)
+{
+	return cString::sprintf("%s/%s", DirName && *DirName ? DirName : ".", FileName);
+}
+
+class cTimeMs
+{
+private:
+	uint64_t begin;
+public:
+	cTimeMs(int Ms = 0) { Set(Ms); }
+	static uint64_t Now(void)
+	{
+		struct timespec tp;
+		clock_gettime(CLOCK_MONOTONIC, &tp);
+		return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+	}
+	void Set(int Ms = 0) { begin = Now() + Ms; }
+	bool TimedOut(void) const { return Now() >= begin; }
+	uint64_t Elapsed(void) const { return Now() - begin; }
+};
+
+template<class T> class cVector
+{
+private:
+	mutable int allocated;
+	mutable int size;
+	mutable T *data;
+	void Realloc(int Index) const
+	{
+		if (++Index > allocated)
+		{
+			data = (T *)realloc(data, Index * sizeof(T));
+			memset((void *)&data[allocated], 0, (Index - allocated) * sizeof(T));
+			allocated = Index;
+		}
+	}
+public:
+	cVector(int Allocated = 10) : allocated(0), size(0), data(NULL) { Realloc(Allocated); }
+	virtual ~cVector() { free(data); }
+	T& At(int Index) const { Realloc(Index); if (Index >= size) size = Index + 1; return data[Index]; }
+	const T& operator[](int Index) const { return At(Index); }
+	T& operator[](int Index) { return At(Index); }
+	int IndexOf(const T &Data) { for (int i = 0; i < size; i++) if (data[i] == Data) return i; return -1; }
+	int Size(void) const { return size; }
+	virtual void Insert(T Data, int Before = 0)
+	{
+		if (Before < size)
+		{
+			Realloc(size);
+			memmove((void *)&data[Before + 1], &data[Before], (size - Before) * sizeof(T));
+			size++;
+			data[Before] = Data;
+		}
+		else
+		{
+			Append(Data);
+		}
+	}
+	virtual void Append(T Data) { if (size >= allocated) Realloc(allocated * 3 / 2); data[size++] = Data; }
+	virtual void Remove(int Index)
+	{
+		if (Index < 0 || Index >= size) return;
+		if (Index < size - 1)
+		{
+			memmove((void *)&data[Index], &data[Index + 1], (size - Index - 1) * sizeof(T));
+		}
+		size--;
+	}
+	virtual bool RemoveElement(const T &Data) { int i = IndexOf(Data); if (i >= 0) { Remove(i); return true; } return false; }
+	virtual void Clear(void) { size = 0; }
+};
+
+class cReadDir
+{
+private:
+	DIR *directory;
+public:
+	cReadDir(const char *Directory) { directory = opendir(Directory); }
+	~cReadDir() { if (directory) closedir(directory); }
+	bool Ok(void) { return directory != NULL; }
+	struct dirent *Next(void)
+	{
+		struct dirent *entry;
+		while (directory && (entry = readdir(directory)) != NULL)
+		{
+			if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+			{
+				return entry;
+			}
+		}
+		return NULL;
+	}
+};
+
+/// writes straight to the file, without VDR's cache handling
+class cUnbufferedFile
+{
+private:
+	int fd;
+public:
+	cUnbufferedFile(void) : fd(-1) {}
+	~cUnbufferedFile() { Close(); }
+	int Open(const char *FileName, int Flags, mode_t Mode = DEFFILEMODE)
+	{
+		Close();
+		fd = open(FileName, Flags, Mode);
+		return fd;
+	}
+	int Close(void)
+	{
+		int result = fd >= 0 ? close(fd) : 0;
+		fd = -1;
+		return result;
+	}
+	ssize_t Write(const void *Data, size_t Size) { return safe_write(fd, Data, Size); }
+	static cUnbufferedFile *Create(const char *FileName, int Flags, mode_t Mode = DEFFILEMODE)
+	{
+		cUnbufferedFile *File = new cUnbufferedFile;
+		if (File->Open(FileName, Flags, Mode) < 0)
+		{
+			delete File;
+			File = NULL;
+		}
+		return File;
+	}
+};
+
+#include "thread.h"
+
+#endif /* STUBS_VDR_TOOLS_H_ */
@@ -0,0 +1,227 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#include "tsscanner.h"
+
+#include <vdr/remux.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_SCANNER_X86
+#endif
+
+// TS header bits, in a header read as little endian 32 bit word
+#define HEADER_SYNC_MASK 0x000000FF
+#define HEADER_PID_MASK 0x00FF1FFF		// sync byte and PID
+#define HEADER_PAYLOAD_START 0x00004000
+#define HEADER_PAYLOAD_MASK 0xD0000000	// scrambling control and payload flag
+#define HEADER_PAYLOAD 0x10000000		// unscrambled payload
+
+// frames analyzed completely before continuation packets are skipped
+#define LEARNING_FRAMES 100
+
+
+/// first four bytes of a TS packet
+static inline uint32_t Header(const uchar* packet)
+{
+	return packet[0] | (packet[1] << 8) | (packet[2] << 16) | ((uint32_t)packet[3] << 24);
+}
+
+/// header of sync byte and PID, masked with HEADER_PID_MASK
+static inline uint32_t PidHeader(int pid)
+{
+	return TS_SYNC_BYTE | (((pid >> 8) & 0x1F) << 8) | ((pid & 0xFF) << 16);
+}
+
+
+cTsScanner::cTsScanner(int videoPid, bool simd) :
+ m_skippable(&cTsScanner::SkippableScalar)
+{
+	SetVideoPid(videoPid);
+
+#if defined(TS_SCANNER_X86) && defined(__SSE2__)
+	if (simd && __builtin_cpu_supports("avx2"))
+	{
+		m_skippable = &cTsScanner::SkippableAvx2;
+	}
+	else if (simd)
+	{
+		m_skippable = &cTsScanner::SkippableSse2;
+	}
+#endif
+}
+
+void cTsScanner::SetVideoPid(int videoPid)
+{
+	m_videoHeader = videoPid != 0 ? PidHeader(videoPid) : 0;
+	m_patHeader = PidHeader(PATPID);
+	m_videoIdle = false;
+	m_skipVideo = true;
+	m_learningFrames = LEARNING_FRAMES;
+	m_payloadStarted = false;
+}
+
+const char* cTsScanner::Implementation()
+{
+	if (m_skippable == &cTsScanner::SkippableAvx2) return "AVX2";
+	if (m_skippable == &cTsScanner::SkippableSse2) return "SSE2";
+	return "scalar";
+}
+
+int cTsScanner::Skippable(const uchar* data, int length)
+{
+	// without video, everything is left to the frame detector
+	if (m_videoHeader == 0) return 0;
+
+	return (this->*m_skippable)(data, length / TS_SIZE, m_videoIdle) * TS_SIZE;
+}
+
+void cTsScanner::Analyzed(const uchar* data, int length, bool synced, bool newFrame)
+{
+	for (; length >= TS_SIZE; data += TS_SIZE, length -= TS_SIZE)
+	{
+		if ((Header(data) & (HEADER_PID_MASK | HEADER_PAYLOAD_START)) == (m_videoHeader | HEADER_PAYLOAD_START))
+		{
+			m_payloadStarted = true;
+		}
+	}
+
+	if (newFrame)
+	{
+		if (synced && m_learningFrames > 0)
+		{
+			if (!m_payloadStarted)
+			{
+				// several frames in a payload unit, the frame detector looks at all of its packets
+				dsyslog("permashift: several frames per payload unit, analyzing all video packets\n");
+				m_skipVideo = false;
+				m_learningFrames = 0;
+			}
+			else
+			{
+				m_learningFrames--;
+			}
+		}
+		m_payloadStarted = false;
+	}
+
+	m_videoIdle = synced && newFrame && m_skipVideo && m_learningFrames == 0;
+}
+
+int cTsScanner::SkippableScalar(const uchar* data, int packets, bool videoIdle)
+{
+	for (int packet = 0; packet < packets; packet++, data += TS_SIZE)
+	{
+		uint32_t header = Header(data);
+		uint32_t pidHeader = header & HEADER_PID_MASK;
+		if ((header & HEADER_SYNC_MASK) != TS_SYNC_BYTE || pidHeader == m_patHeader)
+		{
+			return packet;
+		}
+		if (pidHeader == m_videoHeader && (header & HEADER_PAYLOAD_MASK) == HEADER_PAYLOAD
+			&& (!videoIdle || (header & HEADER_PAYLOAD_START) != 0))
+		{
+			return packet;
+		}
+	}
+	return packets;
+}
+
+#if defined(TS_SCANNER_X86) && defined(__SSE2__)
+
+int cTsScanner::SkippableSse2(const uchar* data, int packets, bool videoIdle)
+{
+	const __m128i syncMask = _mm_set1_epi32(HEADER_SYNC_MASK);
+	const __m128i sync = _mm_set1_epi32(TS_SYNC_BYTE);
+	const __m128i pidMask = _mm_set1_epi32(HEADER_PID_MASK);
+	const __m128i video = _mm_set1_epi32(m_videoHeader);
+	const __m128i pat = _mm_set1_epi32(m_patHeader);
+	const __m128i payloadMask = _mm_set1_epi32(HEADER_PAYLOAD_MASK);
+	const __m128i payload = _mm_set1_epi32(HEADER_PAYLOAD);
+	const __m128i payloadStart = _mm_set1_epi32(HEADER_PAYLOAD_START);
+	const __m128i all = _mm_set1_epi32(-1);
+
+	int packet = 0;
+	for (; packet + 4 <= packets; packet += 4, data += 4 * TS_SIZE)
+	{
+		__m128i header = _mm_set_epi32(Header(data + 3 * TS_SIZE), Header(data + 2 * TS_SIZE), Header(data + TS_SIZE), Header(data));
+		__m128i pidHeader = _mm_and_si128(header, pidMask);
+
+		// packets the frame detector needs: bad sync byte, PAT, or video payload it may be looking for
+		__m128i needed = _mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(header, syncMask), sync), all);
+		needed = _mm_or_si128(needed, _mm_cmpeq_epi32(pidHeader, pat));
+		__m128i videoPayload = _mm_and_si128(_mm_cmpeq_epi32(pidHeader, video),
+			_mm_cmpeq_epi32(_mm_and_si128(header, payloadMask), payload));
+		if (videoIdle)
+		{
+			videoPayload = _mm_and_si128(videoPayload, _mm_cmpeq_epi32(_mm_and_si128(header, payloadStart), payloadStart));
+		}
+		needed = _mm_or_si128(needed, videoPayload);
+
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(needed));
+		if (mask != 0)
+		{
+			return packet + __builtin_ctz(mask);
+		}
+	}
+	return packet + SkippableScalar(data, packets - packet, videoIdle);
+}
+
+__attribute__((target("avx2")))
+int cTsScanner::SkippableAvx2(const uchar* data, int packets, bool videoIdle)
+{
+	const __m256i offsets = _mm256_setr_epi32(0, TS_SIZE, 2 * TS_SIZE, 3 * TS_SIZE, 4 * TS_SIZE, 5 * TS_SIZE, 6 * TS_SIZE, 7 * TS_SIZE);
+	const __m256i syncMask = _mm256_set1_epi32(HEADER_SYNC_MASK);
+	const __m256i sync = _mm256_set1_epi32(TS_SYNC_BYTE);
+	const __m256i pidMask = _mm256_set1_epi32(HEADER_PID_MASK);
+	const __m256i video = _mm256_set1_epi32(m_videoHeader);
+	const __m256i pat = _mm256_set1_epi32(m_patHeader);
+	const __m256i payloadMask = _mm256_set1_epi32(HEADER_PAYLOAD_MASK);
+	const __m256i payload = _mm256_set1_epi32(HEADER_PAYLOAD);
+	const __m256i payloadStart = _mm256_set1_epi32(HEADER_PAYLOAD_START);
+	const __m256i all = _mm256_set1_epi32(-1);
+
+	int packet = 0;
+	for (; packet + 8 <= packets; packet += 8, data += 8 * TS_SIZE)
+	{
+		__m256i header = _mm256_i32gather_epi32((const int*)data, offsets, 1);
+		__m256i pidHeader = _mm256_and_si256(header, pidMask);
+
+		// packets the frame detector needs: bad sync byte, PAT, or video payload it may be looking for
+		__m256i needed = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_and_si256(header, syncMask), sync), all);
+		needed = _mm256_or_si256(needed, _mm256_cmpeq_epi32(pidHeader, pat));
+		__m256i videoPayload = _mm256_and_si256(_mm256_cmpeq_epi32(pidHeader, video),
+			_mm256_cmpeq_epi32(_mm256_and_si256(header, payloadMask), payload));
+		if (videoIdle)
+		{
+			videoPayload = _mm256_and_si256(videoPayload, _mm256_cmpeq_epi32(_mm256_and_si256(header, payloadStart), payloadStart));
+		}
+		needed = _mm256_or_si256(needed, videoPayload);
+
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(needed));
+		if (mask != 0)
+		{
+			return packet + __builtin_ctz(mask);
+		}
+	}
+	return packet + SkippableScalar(data, packets - packet, videoIdle);
+}
+
+#else
+
+int cTsScanner::SkippableSse2(const uchar* data, int packets, bool videoIdle)
+{
+	return SkippableScalar(data, packets, videoIdle);
+}
+
+int cTsScanner::SkippableAvx2(const uchar* data, int packets, bool videoIdle)
+{
+	return SkippableScalar(data, packets, videoIdle);
+}
+
+#endif
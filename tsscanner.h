@@ -0,0 +1,71 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#ifndef TSSCANNER_H_
+#define TSSCANNER_H_
+
+#include <vdr/tools.h>
+
+/// finds the TS packets VDR's frame detector has to look at
+///
+/// The frame detector only changes its state on packets of the video PID carrying
+/// payload (and on PAT packets), and ignores continuation packets of a payload unit
+/// once it has found the frame starting in it. All other packets can go to the buffer
+/// without being analyzed. Packet headers are classified in bulk, eight or four at a time
+/// with AVX2 or SSE2 where available.
+///
+/// Continuation packets are only skipped when every payload unit holds one frame at most,
+/// which is checked while the first frames are being analyzed.
+class cTsScanner
+{
+private:
+
+	/// masked packet headers (sync byte and PID) of video and PAT packets
+	uint32_t m_videoHeader;
+	uint32_t m_patHeader;
+
+	/// the frame detector is done with the current payload unit of the video PID
+	bool m_videoIdle;
+
+	/// continuation packets of the video PID may be skipped
+	bool m_skipVideo;
+
+	/// frames still to be checked before continuation packets are skipped
+	int m_learningFrames;
+
+	/// a payload unit of the video PID has started since the last frame
+	bool m_payloadStarted;
+
+	/// implementations of Skippable()
+	int SkippableScalar(const uchar* data, int packets, bool videoIdle);
+	int SkippableSse2(const uchar* data, int packets, bool videoIdle);
+	int SkippableAvx2(const uchar* data, int packets, bool videoIdle);
+
+	/// implementation chosen for this CPU
+	int (cTsScanner::*m_skippable)(const uchar* data, int packets, bool videoIdle);
+
+public:
+
+	/// scanner for the given video PID, using the fastest implementation available
+	/// (or the scalar one, if simd is false)
+	cTsScanner(int videoPid = 0, bool simd = true);
+
+	/// sets video PID, starting over
+	void SetVideoPid(int videoPid);
+
+	/// number of bytes (whole packets) at the start of data the frame detector doesn't need to see
+	int Skippable(const uchar* data, int length);
+
+	/// to be called after the frame detector has analyzed the given data
+	void Analyzed(const uchar* data, int length, bool synced, bool newFrame);
+
+	/// name of implementation used
+	const char* Implementation();
+};
+
+#endif /* TSSCANNER_H_ */
@@ -0,0 +1,95 @@
+/*
+ * Part of permashift, a plugin for the Video Disk Recorder
+ *
+ * See the README file for copyright information and how to reach the author.
+ *
+ */
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE TsScanner
+
+#include "tsscanner.h"
+
+#include <vdr/remux.h>
+#include <boost/test/unit_test.hpp>
+
+#define VIDEO_PID 0x1FF
+#define AUDIO_PID 0x200
+
+
+static void MakePacket(uchar* packet, int pid, bool payloadStart, bool payload = true)
+{
+	memset(packet, 0xFF, TS_SIZE);
+	packet[0] = TS_SYNC_BYTE;
+	packet[1] = (payloadStart ? 0x40 : 0x00) | ((pid >> 8) & 0x1F);
+	packet[2] = pid & 0xFF;
+	packet[3] = payload ? 0x10 : 0x20;
+}
+
+
+BOOST_AUTO_TEST_CASE(FindsPacketsForDetector)
+{
+	uchar data[20 * TS_SIZE];
+	for (int packet = 0; packet < 20; packet++)
+	{
+		MakePacket(data + packet * TS_SIZE, AUDIO_PID, packet % 4 == 0);
+	}
+	MakePacket(data + 9 * TS_SIZE, VIDEO_PID, false, false);
+	MakePacket(data + 13 * TS_SIZE, VIDEO_PID, false);
+
+	cTsScanner scanner(VIDEO_PID);
+	BOOST_CHECK_EQUAL(scanner.Skippable(data, sizeof(data)), 13 * TS_SIZE);
+	BOOST_CHECK_EQUAL(scanner.Skippable(data, 5 * TS_SIZE + 100), 5 * TS_SIZE);
+
+	// lost sync
+	data[11 * TS_SIZE] = 0;
+	BOOST_CHECK_EQUAL(scanner.Skippable(data, sizeof(data)), 11 * TS_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(SimdMatchesScalar)
+{
+	cTsScanner simd(VIDEO_PID);
+	cTsScanner scalar(VIDEO_PID, false);
+	BOOST_TEST_MESSAGE("using " << simd.Implementation());
+
+	uchar data[64 * TS_SIZE];
+	srand(1);
+	for (int round = 0; round < 1000; round++)
+	{
+		int stop = rand() % 80;
+		for (int packet = 0; packet < 64; packet++)
+		{
+			MakePacket(data + packet * TS_SIZE, packet == stop ? (rand() % 2 ? VIDEO_PID : PATPID) : AUDIO_PID, rand() % 2, rand() % 2);
+		}
+		int length = (rand() % 64 + 1) * TS_SIZE;
+		BOOST_CHECK_EQUAL(simd.Skippable(data, length), scalar.Skippable(data, length));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(SkipsContinuationOnceLearned)
+{
+	uchar start[TS_SIZE];
+	uchar continuation[TS_SIZE];
+	MakePacket(start, VIDEO_PID, true);
+	MakePacket(continuation, VIDEO_PID, false);
+
+	// one frame per payload unit
+	cTsScanner scanner(VIDEO_PID);
+	for (int frame = 0; frame < 200; frame++)
+	{
+		scanner.Analyzed(start, TS_SIZE, true, false);
+		scanner.Analyzed(continuation, TS_SIZE, true, true);
+	}
+	BOOST_CHECK_EQUAL(scanner.Skippable(continuation, TS_SIZE), TS_SIZE);
+	BOOST_CHECK_EQUAL(scanner.Skippable(start, TS_SIZE), 0);
+
+	// several frames per payload unit
+	cTsScanner multiple(VIDEO_PID);
+	for (int frame = 0; frame < 200; frame++)
+	{
+		multiple.Analyzed(start, TS_SIZE, true, true);
+		multiple.Analyzed(continuation, TS_SIZE, true, true);
+	}
+	BOOST_CHECK_EQUAL(multiple.Skippable(continuation, TS_SIZE), 0);
+}